@@ -146,6 +146,53 @@ struct p9_msg {
   int deferred;
 };
 
+/* A field of a compact message.  Strings and data are len bytes at s,
+ * wname and wqid are len elements and stat len bytes in packed form at s. */
+union p9_cfield {
+  unsigned long long n;
+  struct p9_qid qid;
+  struct {
+    unsigned int len;
+    char *s;
+  } str;
+};
+
+/* Compact form of a message: the header followed by the fields of its
+ * type in wire order, as listed in p9_schema.  It points into the packed
+ * message and is expanded into struct p9_msg with p9_cmsg_to_msg. */
+struct p9_cmsg {
+  unsigned int size;
+  unsigned char type;
+  unsigned short tag;
+  union p9_cfield f[5];
+};
+
+/* Latency histogram in nanoseconds with P9_HISTSUB buckets per power of
+ * two, so a value is known to within 1/P9_HISTSUB of itself.  The last
+ * bucket takes everything from 2^40. */
+#define P9_HISTSUB 16
+#define P9_HISTBUCKETS (37 * P9_HISTSUB)
+
+struct p9_hist {
+  unsigned long long count;
+  unsigned long long sum;
+  unsigned long long max;
+  unsigned int bucket[P9_HISTBUCKETS];
+};
+
+/* Counters of a client connection.  Latency is from sending a T-message
+ * to receiving its reply, kept by T-message type. */
+struct p9_stats {
+  unsigned long long bytes_in;
+  unsigned long long bytes_out;
+  unsigned long long sends;
+  unsigned long long recvs;
+  unsigned long long partial_recvs;  /* ending inside a message */
+  unsigned long long moved;  /* bytes moved to the start of the buffer */
+  unsigned long long errors[(P9_XEND - P9_XSTART) / 2];
+  struct p9_hist lat[(P9_XEND - P9_XSTART) / 2];
+};
+
 #define P9_WRITE_MODE(mode) \
   ((((mode) & 3) == P9_OWRITE) || (((mode) & 3) == P9_ORDWR))
 #define P9_READ_MODE(mode) \
@@ -161,7 +208,15 @@ int p9_pack_stat(int bytes, char *buf, struct p9_stat *stat);
 int p9_unpack_stat(int bytes, char *buf, struct p9_stat *stat);
 int p9_unpack_msg(int bytes, char *buf, struct p9_msg *m);
 int p9_pack_msg(int bytes, char *buf, struct p9_msg *m);
+unsigned int p9_msg_size(struct p9_msg *m);
+void p9_pack_msg_sized(unsigned int size, char *buf, struct p9_msg *m);
+int p9_unpack_cmsg(int bytes, char *buf, struct p9_cmsg *m);
+int p9_cmsg_to_msg(struct p9_cmsg *cm, struct p9_msg *m);
+
+#define P9_NOTOPEN ((char)-1)
 
+/* rm releases what the fid holds; clone is called on a byte copy of the
+ * fid to take its own references. */
 struct p9_fid {
   unsigned int fid;
   struct p9_qid qid;
@@ -170,6 +225,7 @@ struct p9_fid {
   char *uid;
   unsigned int iounit;
   void (*rm)(struct p9_fid *);
+  int (*clone)(struct p9_fid *dst, struct p9_fid *src);
   void *file;
   void *aux;
 };
@@ -189,6 +245,7 @@ struct p9_fs {
   void (*attach)(struct p9_connection *c);
   void (*flush)(struct p9_connection *c);
   void (*walk)(struct p9_connection *c);
+  /* walks t.pfid by the element r.nwqid, see p9_fidtab_walk */
   void (*walk1)(struct p9_connection *c, struct p9_fs *fs);
   void (*open)(struct p9_connection *c);
   void (*create)(struct p9_connection *c);
@@ -198,6 +255,8 @@ struct p9_fs {
   void (*remove)(struct p9_connection *c);
   void (*stat)(struct p9_connection *c);
   void (*wstat)(struct p9_connection *c);
+  void (*connect)(struct p9_connection *c);
+  void (*disconnect)(struct p9_connection *c);
 };
 
 int p9_process_treq(struct p9_connection *c, struct p9_fs *fs);
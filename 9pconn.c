@@ -4,17 +4,26 @@
 #include <errno.h>
 #include <sys/time.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <stdio.h>
+#include <time.h>
 
 #include "9p.h"
 #include "9pconn.h"
+#include "9pdbg.h"
+#include "9ptrace.h"
 #include "seq.h"
 #include "util.h"
 
 #define MSIZE 65536
+#define IOHDRSZ 24
+#define IOWINDOW 32
+#define STATSVAR "P9STATS"
 
 struct p9_req {
   int tag;
+  int type;
+  unsigned long long start;
   void *aux;
   void (*fn)(struct p9_conn *c, void *aux);
   struct p9_req *next;
@@ -27,6 +36,7 @@ struct p9_conn {
   int outsize;
   int insize;
   int off;
+  int nasync;
   int logmask;
   unsigned char *outbuf;
   unsigned char *inbuf;
@@ -34,6 +44,8 @@ struct p9_conn {
   struct p9_req *req_pool;
   struct p9_seq *tags;
   struct p9_seq *fids;
+  struct p9_trace *trace;
+  struct p9_stats stats;
 
   char *user;
   char *res;
@@ -42,6 +54,7 @@ struct p9_conn {
 struct p9_file {
   int fid;
   int off;
+  unsigned int iounit;
   int buf_size;
   int buf_used;
   int buf_off;
@@ -57,9 +70,18 @@ get_req(int tag, struct p9_conn *c)
   return r;
 }
 
+static unsigned long long
+now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
 static int
 set_req(struct p9_conn *c, void (*fn)(struct p9_conn *c, void *aux),
-        void *aux)
+        void *aux, unsigned long long start)
 {
   struct p9_req *req;
   int i;
@@ -72,6 +94,8 @@ set_req(struct p9_conn *c, void (*fn)(struct p9_conn *c, void *aux),
   if (!req)
     return -1;
   req->tag = c->c.t.tag;
+  req->type = c->c.t.type;
+  req->start = start;
   i = req->tag & 0xff;
   req->fn = fn;
   req->aux = aux;
@@ -80,6 +104,19 @@ set_req(struct p9_conn *c, void (*fn)(struct p9_conn *c, void *aux),
   return 0;
 }
 
+static void
+put_req(int tag, struct p9_conn *c)
+{
+  struct p9_req **pr, *r;
+  pr = &c->req[tag & 0xff];
+  for (; *pr && (*pr)->tag != tag; pr = &(*pr)->next) {}
+  if ((r = *pr)) {
+    *pr = r->next;
+    r->next = c->req_pool;
+    c->req_pool = r;
+  }
+}
+
 static unsigned int
 unpack_uint4(unsigned char *buf)
 {
@@ -91,6 +128,7 @@ p9_io_send(struct p9_conn *c, void (*fn)(struct p9_conn *c, void *aux),
            void *aux)
 {
   struct p9_msg *m = &c->c.t;
+  unsigned long long start;
   int size, sent = 0, r;
 
   if (m->type == P9_TVERSION)
@@ -101,63 +139,106 @@ p9_io_send(struct p9_conn *c, void (*fn)(struct p9_conn *c, void *aux),
   c->c.r.ename_len = 0;
   if (c->logmask)
     p9_print_msg(&c->c.t, "OUT");
-  if (p9_pack_msg(c->c.msize, (char *)c->outbuf, m))
+  size = p9_msg_size(m);
+  if (!size || size > c->c.msize)
     return -1;
-  size = unpack_uint4(c->outbuf);
+  p9_pack_msg_sized(size, (char *)c->outbuf, m);
+  p9_trace(P9_TRACE_OUT, size, size, c->outbuf, c->trace);
+  start = now();
   for (sent = 0; sent < size; ) {
-    r = send(c->fd, c->outbuf + sent, size - sent, 0);
+    r = send(c->fd, c->outbuf + sent, size - sent, MSG_NOSIGNAL);
+    ++c->stats.sends;
     if (r <= 0)
       return -1;
     sent += r;
   }
-  set_req(c, fn, aux);
+  c->stats.bytes_out += size;
+  set_req(c, fn, aux, start);
   return m->tag;
 }
 
-int
-p9_io_recv(struct p9_conn *c, int wait_tag)
+static void
+account(struct p9_req *req, struct p9_conn *c)
 {
-  int r, off, size, run = 1;
+  int i = (req->type - P9_XSTART) / 2;
+
+  if (req->type < P9_XSTART || req->type >= P9_XEND)
+    return;
+  p9_hist_add(now() - req->start, &c->stats.lat[i]);
+  if (c->c.r.type == P9_RERROR)
+    ++c->stats.errors[i];
+}
+
+static int
+io_recv(struct p9_conn *c, int wait_tag, int flags)
+{
+  int r, size, tag;
   struct p9_req *req;
+  void (*fn)(struct p9_conn *c, void *aux);
+  void *aux;
   unsigned char *buf = c->inbuf;
 
-  while (run) {
-    if (c->insize) {
-      memmove(buf, buf + c->insize, c->c.msize - c->insize);
-      c->off -= c->insize;
-      c->insize = 0;
-    }
-    r = recv(c->fd, buf + c->off, c->c.msize - c->off, 0);
-    if (r == 0)
-      return -1;
-    if (r < 0)
-      return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
-    c->insize += r;
-    off = c->off;
-    while (c->insize - off >= 7) {
-      size = unpack_uint4(buf + off);
-      if (size < 7)
+  for (;;) {
+    while (c->insize - c->off >= 7) {
+      size = unpack_uint4(buf + c->off);
+      if (size < 7 || size > c->c.msize)
         return -1;
-      if (off + size > c->insize)
+      if (c->off + size > c->insize)
         break;
-      if (p9_unpack_msg(size, (char *)buf + off, &c->c.r))
+      c->c.r.ename = 0;
+      c->c.r.ename_len = 0;
+      p9_trace(P9_TRACE_IN, size, size, buf + c->off, c->trace);
+      if (p9_unpack_msg(size, (char *)buf + c->off, &c->c.r))
         return -1;
-      off += size;
+      c->off += size;
       if (c->logmask)
         p9_print_msg(&c->c.r, "IN");
       /* TODO: handle incorrect response type */
-      req = get_req(c->c.r.tag, c);
-      if (req && req->fn)
-        req->fn(c, req->aux);
-      p9_seq_drop(c->c.r.tag, c->tags);
-      if (c->c.r.tag == wait_tag) {
-        run = 0;
-        break;
+      tag = c->c.r.tag;
+      fn = 0;
+      aux = 0;
+      if ((req = get_req(tag, c))) {
+        account(req, c);
+        fn = req->fn;
+        aux = req->aux;
+        put_req(tag, c);
       }
+      p9_seq_drop(tag, c->tags);
+      if (fn)
+        fn(c, aux);
+      if (tag == wait_tag || wait_tag < 0)
+        return 1;
+    }
+    if (c->off) {
+      c->stats.moved += c->insize - c->off;
+      memmove(buf, buf + c->off, c->insize - c->off);
+      c->insize -= c->off;
+      c->off = 0;
     }
-    c->off = off;
+    r = recv(c->fd, buf + c->insize, c->c.msize - c->insize, flags);
+    ++c->stats.recvs;
+    if (r == 0)
+      return -1;
+    if (r < 0)
+      return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    c->insize += r;
+    c->stats.bytes_in += r;
+    if (c->insize < 7 || unpack_uint4(buf) > c->insize)
+      ++c->stats.partial_recvs;
   }
-  return 1;
+}
+
+int
+p9_io_recv(struct p9_conn *c, int wait_tag)
+{
+  return io_recv(c, wait_tag, 0);
+}
+
+/* Processes already arrived replies to clunks and removes. */
+static void
+io_reap(struct p9_conn *c)
+{
+  while (c->nasync > 0 && io_recv(c, -1, MSG_DONTWAIT) > 0) {}
 }
 
 static int
@@ -173,6 +254,15 @@ io_sendrecv(struct p9_conn *c)
   return 0;
 }
 
+static int
+io_wait(struct p9_conn *c, int *pending)
+{
+  while (*pending > 0)
+    if (p9_io_recv(c, -1) < 0)
+      return -1;
+  return 0;
+}
+
 static int
 p9_version(struct p9_conn *c)
 {
@@ -182,7 +272,7 @@ p9_version(struct p9_conn *c)
   if (io_sendrecv(c))
     return -1;
   c->c.msize = (c->c.msize < c->c.r.msize) ? c->c.msize : c->c.r.msize;
-  if (strcmp(c->c.r.version, "9P2000"))
+  if (c->c.r.version_len != 6 || strncmp(c->c.r.version, "9P2000", 6))
     return -1;
   c->root_fid = P9_NOFID;
   return 0;
@@ -238,11 +328,19 @@ err:
 void
 rm_p9conn(struct p9_conn *c, int clunk_root)
 {
+  struct p9_req *r;
+  int i;
+
   if (!c)
     return;
   if (clunk_root && c->root_fid != P9_NOFID)
     p9fid_close(c->root_fid, c);
-  /* TODO: free reqs, req_pool, */
+  io_wait(c, &c->nasync);
+  if (getenv(STATSVAR))
+    p9_print_stats(&c->stats, stderr);
+  for (i = 0; i < NITEMS(c->req); ++i)
+    for (; (r = c->req[i]); c->req[i] = r->next, free(r)) {}
+  for (; (r = c->req_pool); c->req_pool = r->next, free(r)) {}
   rm_p9seq(c->tags);
   rm_p9seq(c->fids);
   if (c->outbuf)
@@ -268,6 +366,25 @@ p9_set_root_fid(unsigned int root_fid, struct p9_conn *c)
   c->root_fid = root_fid;
 }
 
+void
+p9_get_stats(struct p9_stats *st, struct p9_conn *c)
+{
+  memcpy(st, &c->stats, sizeof(*st));
+}
+
+void
+p9_reset_stats(struct p9_conn *c)
+{
+  memset(&c->stats, 0, sizeof(c->stats));
+}
+
+/* Frames are traced into t until it is set to 0.  t is not owned. */
+void
+p9_set_trace(struct p9_trace *t, struct p9_conn *c)
+{
+  c->trace = t;
+}
+
 unsigned int
 p9_add_fid(unsigned int fid, struct p9_conn *c)
 {
@@ -280,47 +397,170 @@ p9_rm_fid(unsigned int fid, struct p9_conn *c)
   p9_seq_drop(fid, c->fids);
 }
 
-int
-p9fid_walk(unsigned int newfid, unsigned int fid, const char *path,
-           struct p9_conn *c)
+struct p9_walkseg {
+  int nwqid;
+  struct p9_walk *w;
+};
+
+struct p9_walk {
+  int len;
+  int nelem;
+  int nseg;
+  int nclunk;
+  int pending;
+  int err;
+  char *ename;
+  unsigned int *elem;
+  unsigned int *fids;
+  struct p9_walkseg *segs;
+};
+
+struct p9_step {
+  int type;
+  int nwqid;
+  int ok;
+  unsigned int iounit;
+  int *pending;
+};
+
+static void
+walk_done(struct p9_conn *c, void *aux)
 {
-  struct p9_msg *r = &c->c.r, *m = &c->c.t;
-  int i = 0, len, n, off;
-  char *p;
+  struct p9_walkseg *seg = aux;
+  struct p9_msg *r = &c->c.r;
 
-  m->type = P9_TWALK;
-  m->fid = fid;
-  m->newfid = newfid;
-  for (; path[i] == '/'; ++i) {}
-  off = i;
-  do {
-    for (n = 0; n < P9_MAXWELEM; ++i) {
-      if (path[i] == '/' || path[i] == 0) {
-        len = i - off;
-        if (len) {
-          m->wname[n] = (char *)path + off;
-          m->wname_len[n] = len;
-          ++n;
-        }
-        for (; path[i] == '/'; ++i) {}
-        off = i;
-        if (!path[i])
-          break;
-      }
+  --seg->w->pending;
+  seg->nwqid = (r->type == P9_RWALK) ? r->nwqid : -1;
+  if (r->type != P9_RWALK && r->ename && !seg->w->ename)
+    seg->w->ename = strndup(r->ename, r->ename_len);
+}
+
+static void
+step_done(struct p9_conn *c, void *aux)
+{
+  struct p9_step *s = aux;
+  struct p9_msg *r = &c->c.r;
+
+  --*s->pending;
+  s->ok = (r->type == s->type
+           && (r->type != P9_RWALK || r->nwqid == s->nwqid));
+  s->iounit = r->iounit;
+}
+
+static int
+step_send(struct p9_step *s, int rtype, int *pending, struct p9_conn *c)
+{
+  s->type = rtype;
+  s->nwqid = c->c.t.nwname;
+  s->ok = 0;
+  s->pending = pending;
+  if (p9_io_send(c, step_done, s) < 0)
+    return -1;
+  ++*pending;
+  return 0;
+}
+
+/* Sends the whole walk of the first len bytes of path without waiting.
+ * Every segment walks into a fresh fid so that a failed segment makes all
+ * following walks fail instead of continuing from a wrong place. */
+static int
+walk_send(struct p9_walk *w, unsigned int newfid, unsigned int fid,
+          const char *path, int len, struct p9_conn *c)
+{
+  struct p9_msg *m = &c->c.t;
+  int i, j, k, n;
+
+  memset(w, 0, sizeof(*w));
+  for (i = 0; i < len; ++i)
+    if (path[i] != '/' && (!i || path[i - 1] == '/'))
+      ++w->nelem;
+  w->len = len;
+  w->nseg = (w->nelem) ? (w->nelem + P9_MAXWELEM - 1) / P9_MAXWELEM : 1;
+  w->segs = calloc(w->nseg, sizeof(struct p9_walkseg));
+  w->fids = calloc(w->nseg + 1, sizeof(unsigned int));
+  w->elem = calloc(w->nelem + 1, sizeof(unsigned int));
+  if (!(w->segs && w->fids && w->elem)) {
+    w->nseg = 0;
+    return w->err = -1;
+  }
+  for (i = 0, n = 0; i < len; ++i)
+    if (path[i] != '/' && (!i || path[i - 1] == '/'))
+      w->elem[n++] = i;
+  w->elem[w->nelem] = len;
+
+  w->fids[0] = fid;
+  w->fids[w->nseg] = newfid;
+  for (k = 1; k < w->nseg; ++k)
+    w->fids[k] = p9_seq_next(c->fids);
+
+  for (k = 0; k < w->nseg; ++k) {
+    m->type = P9_TWALK;
+    m->fid = w->fids[k];
+    m->newfid = w->fids[k + 1];
+    for (n = 0, j = k * P9_MAXWELEM; n < P9_MAXWELEM && j < w->nelem;
+         ++n, ++j) {
+      m->wname[n] = (char *)path + w->elem[j];
+      for (i = w->elem[j]; i < len && path[i] != '/'; ++i) {}
+      m->wname_len[n] = i - w->elem[j];
     }
     m->nwname = n;
-    if (io_sendrecv(c))
-      return -1;
-    if (r->ename)
-      return -1;
-    if (r->nwqid < n) {
-      p = m->wname[r->nwqid - 1] + m->wname_len[r->nwqid - 1];
-      for (; *p == '/'; ++p) {}
-      return p - path;
+    w->segs[k].nwqid = -1;
+    w->segs[k].w = w;
+    if (p9_io_send(c, walk_done, &w->segs[k]) < 0)
+      return w->err = -1;
+    ++w->pending;
+    if (k) {
+      p9fid_close(w->fids[k], c);
+      w->nclunk = k;
+    }
+  }
+  return 0;
+}
+
+/* Must be called once all replies of the walk have arrived.  Returns the
+ * offset of the first element that could not be walked to, len when the
+ * whole path was walked or -1 on error.  The text of the first Rerror is
+ * in ename until then. */
+static int
+walk_result(struct p9_walk *w, struct p9_conn *c)
+{
+  int j, k, n, ret = -1;
+
+  if (!w->err) {
+    ret = w->len;
+    for (k = 0; k < w->nseg; ++k) {
+      j = k * P9_MAXWELEM;
+      n = (w->nelem - j < P9_MAXWELEM) ? w->nelem - j : P9_MAXWELEM;
+      if (w->segs[k].nwqid < 0) {
+        ret = (j < w->nelem) ? w->elem[j] : -1;
+        break;
+      }
+      if (w->segs[k].nwqid < n) {
+        ret = w->elem[j + w->segs[k].nwqid];
+        break;
+      }
     }
-    m->fid = newfid;
-  } while (path[i]);
-  return i;
+  }
+  for (k = w->nclunk + 1; k < w->nseg; ++k)
+    p9_seq_drop(w->fids[k], c->fids);
+  free(w->segs);
+  free(w->fids);
+  free(w->elem);
+  free(w->ename);
+  w->ename = 0;
+  return ret;
+}
+
+int
+p9fid_walk(unsigned int newfid, unsigned int fid, const char *path,
+           struct p9_conn *c)
+{
+  struct p9_walk w;
+
+  walk_send(&w, newfid, fid, path, strlen(path), c);
+  if (io_wait(c, &w.pending))
+    w.err = -1;
+  return walk_result(&w, c);
 }
 
 int
@@ -330,20 +570,38 @@ p9fid_open(unsigned int fid, int mode, struct p9_conn *c)
   m->type = P9_TOPEN;
   m->fid = fid;
   m->mode = mode;
-  if (io_sendrecv(c))
+  if (io_sendrecv(c) || c->c.r.ename)
     return -1;
   return 0;
 }
 
-void
-p9fid_close(unsigned int fid, struct p9_conn *c)
+static void
+release_done(struct p9_conn *c, void *aux)
+{
+  --c->nasync;
+  p9_seq_drop((uintptr_t)aux, c->fids);
+}
+
+/* Both Tclunk and Tremove free the fid whatever the outcome, so the reply
+ * is not waited for.  The fid is reused only after it arrives. */
+static void
+release_fid(int type, unsigned int fid, struct p9_conn *c)
 {
   if (fid == P9_NOFID)
     return;
-  c->c.t.type = P9_TCLUNK;
+  io_reap(c);
+  c->c.t.type = type;
   c->c.t.fid = fid;
-  io_sendrecv(c);
-  p9_seq_drop(fid, c->fids);
+  if (p9_io_send(c, release_done, (void *)(uintptr_t)fid) < 0)
+    p9_seq_drop(fid, c->fids);
+  else
+    ++c->nasync;
+}
+
+void
+p9fid_close(unsigned int fid, struct p9_conn *c)
+{
+  release_fid(P9_TCLUNK, fid, c);
 }
 
 int
@@ -366,9 +624,7 @@ p9fid_create(unsigned int fid, const char *name, int mode, int perm,
 void
 p9fid_remove(unsigned int fid, struct p9_conn *c)
 {
-  c->c.t.type = P9_TREMOVE;
-  c->c.t.fid = fid;
-  io_sendrecv(c);
+  release_fid(P9_TREMOVE, fid, c);
 }
 
 int
@@ -414,6 +670,172 @@ p9fid_stat(unsigned int fid, struct p9_stat *stat, struct p9_conn *c)
   return 0;
 }
 
+struct p9_vio;
+
+struct p9_chunk {
+  uint64_t off;
+  size_t pos;
+  int len;
+  int got;
+  struct p9_vio *io;
+};
+
+struct p9_vio {
+  const struct iovec *iov;
+  int iovcnt;
+  int pending;
+  int nchunks;
+  int next;
+  int last;
+  struct p9_chunk *chunks;
+};
+
+static void
+iov_copy(const struct iovec *iov, int iovcnt, size_t pos, char *buf, int len,
+         int to_iov)
+{
+  int i, n;
+  char *p;
+
+  for (i = 0; i < iovcnt && pos >= iov[i].iov_len; ++i)
+    pos -= iov[i].iov_len;
+  for (; i < iovcnt && len > 0; ++i, pos = 0) {
+    n = iov[i].iov_len - pos;
+    n = (n < len) ? n : len;
+    p = (char *)iov[i].iov_base + pos;
+    if (to_iov)
+      memcpy(p, buf, n);
+    else
+      memcpy(buf, p, n);
+    buf += n;
+    len -= n;
+  }
+}
+
+static void
+vio_done(struct p9_conn *c, void *aux)
+{
+  struct p9_chunk *ch = aux;
+  struct p9_msg *r = &c->c.r;
+  struct p9_vio *io = ch->io;
+
+  --io->pending;
+  switch (r->type) {
+  case P9_RREAD:
+    ch->got = (r->count < ch->len) ? r->count : ch->len;
+    iov_copy(io->iov, io->iovcnt, ch->pos, r->data, ch->got, 1);
+    break;
+  case P9_RWRITE:
+    ch->got = (r->count < ch->len) ? r->count : ch->len;
+    break;
+  default:
+    ch->got = -1;
+  }
+  /* no need to issue chunks past a short reply */
+  if (ch->got < ch->len && ch - io->chunks < io->last)
+    io->last = ch - io->chunks;
+}
+
+static int
+vio_send(int type, unsigned int fid, struct p9_chunk *ch, struct p9_conn *c)
+{
+  struct p9_msg *m = &c->c.t;
+  const struct iovec *iov = ch->io->iov;
+  int i;
+  size_t pos = ch->pos;
+
+  m->type = type;
+  m->fid = fid;
+  m->offset = ch->off;
+  m->count = ch->len;
+  if (type == P9_TWRITE) {
+    for (i = 0; pos >= iov[i].iov_len; ++i)
+      pos -= iov[i].iov_len;
+    if (pos + ch->len <= iov[i].iov_len)
+      m->data = (char *)iov[i].iov_base + pos;
+    else {
+      if (!c->c.buf && !(c->c.buf = malloc(c->c.msize)))
+        return -1;
+      iov_copy(iov, ch->io->iovcnt, ch->pos, c->c.buf, ch->len, 0);
+      m->data = c->c.buf;
+    }
+  }
+  if (p9_io_send(c, vio_done, ch) < 0)
+    return -1;
+  ++ch->io->pending;
+  return 0;
+}
+
+static long
+p9fid_vio(int type, unsigned int fid, uint64_t off, const struct iovec *iov,
+          int iovcnt, unsigned int iounit, struct p9_conn *c)
+{
+  struct p9_vio io = {0};
+  struct p9_chunk *ch;
+  size_t total = 0, pos;
+  int i, n, chunk, err = 0;
+  long ret;
+
+  chunk = c->c.msize - IOHDRSZ;
+  if (iounit && iounit < chunk)
+    chunk = iounit;
+  for (i = 0; i < iovcnt; ++i)
+    total += iov[i].iov_len;
+  if (!total)
+    return 0;
+  io.iov = iov;
+  io.iovcnt = iovcnt;
+  io.nchunks = (total + chunk - 1) / chunk;
+  io.last = io.nchunks;
+  io.chunks = calloc(io.nchunks, sizeof(struct p9_chunk));
+  if (!io.chunks)
+    return -1;
+  for (i = 0, pos = 0; i < io.nchunks; ++i, pos += chunk) {
+    ch = &io.chunks[i];
+    ch->off = off + pos;
+    ch->pos = pos;
+    ch->len = (total - pos < chunk) ? total - pos : chunk;
+    ch->got = -1;
+    ch->io = &io;
+  }
+  while (!err && (io.pending || (io.next < io.last))) {
+    while (!err && io.pending < IOWINDOW && io.next < io.last)
+      err = vio_send(type, fid, &io.chunks[io.next++], c);
+    if (!err && io.pending)
+      err = p9_io_recv(c, -1) < 0;
+  }
+  if (io.pending)
+    io_wait(c, &io.pending);
+  ret = 0;
+  for (i = 0; i < io.next; ++i) {
+    n = io.chunks[i].got;
+    if (n < 0) {
+      if (!ret)
+        ret = -1;
+      break;
+    }
+    ret += n;
+    if (n < io.chunks[i].len)
+      break;
+  }
+  free(io.chunks);
+  return ret;
+}
+
+long
+p9fid_preadv(unsigned int fid, uint64_t off, const struct iovec *iov,
+             int iovcnt, struct p9_conn *c)
+{
+  return p9fid_vio(P9_TREAD, fid, off, iov, iovcnt, 0, c);
+}
+
+long
+p9fid_pwritev(unsigned int fid, uint64_t off, const struct iovec *iov,
+              int iovcnt, struct p9_conn *c)
+{
+  return p9fid_vio(P9_TWRITE, fid, off, iov, iovcnt, 0, c);
+}
+
 int
 p9fid_walk2(const char *path, unsigned int fid, struct p9_conn *c,
             unsigned int *newfid)
@@ -437,6 +859,352 @@ p9fid_walk2(const char *path, unsigned int fid, struct p9_conn *c,
 }
 
 
+struct p9_bulkstat;
+
+struct p9_statslot {
+  char *path;
+  char *err;
+  unsigned int fid;
+  int pending;
+  int ok;
+  struct p9_walk w;
+  struct p9_bulkstat *b;
+};
+
+struct p9_bulkstat {
+  void (*fn)(const char *path, struct p9_stat *stat, const char *err,
+             void *aux);
+  void *aux;
+  int nerr;
+};
+
+static void
+bulkstat_done(struct p9_conn *c, void *aux)
+{
+  struct p9_statslot *s = aux;
+  struct p9_msg *r = &c->c.r;
+
+  --s->pending;
+  if (r->type == P9_RSTAT) {
+    s->ok = 1;
+    s->b->fn(s->path, &r->stat, 0, s->b->aux);
+  } else if (r->ename && !s->err)
+    s->err = strndup(r->ename, r->ename_len);
+}
+
+static int
+bulkstat_send(struct p9_statslot *s, const char *path, struct p9_conn *c)
+{
+  s->path = strdup(path);
+  if (!s->path)
+    return -1;
+  s->err = 0;
+  s->ok = 0;
+  s->fid = p9_seq_next(c->fids);
+  if (walk_send(&s->w, s->fid, c->root_fid, path, strlen(path), c))
+    return -1;
+  c->c.t.type = P9_TSTAT;
+  c->c.t.fid = s->fid;
+  if (p9_io_send(c, bulkstat_done, s) < 0)
+    return -1;
+  ++s->pending;
+  p9fid_close(s->fid, c);
+  return 0;
+}
+
+static void
+bulkstat_finish(struct p9_statslot *s, struct p9_conn *c)
+{
+  char *ename = s->w.ename;
+  int r;
+
+  s->w.ename = 0;
+  r = walk_result(&s->w, c);
+  if (!s->ok) {
+    ++s->b->nerr;
+    if (ename)
+      s->b->fn(s->path, 0, ename, s->b->aux);
+    else if (r >= 0 && s->path[r])
+      s->b->fn(s->path, 0, "file does not exist", s->b->aux);
+    else
+      s->b->fn(s->path, 0, (s->err) ? s->err : "error", s->b->aux);
+  }
+  free(ename);
+  free(s->path);
+  free(s->err);
+  s->path = 0;
+  s->err = 0;
+}
+
+/* Stats every path returned by next, keeping up to window walk, stat and
+ * clunk chains in flight.  fn is called for each path as soon as its
+ * result is known, with stat set to 0 and err describing the failure if
+ * it could not be stat'ed.  Returns the number of failed paths or -1 if
+ * the connection failed. */
+int
+p9_bulkstat(int window, const char *(*next)(void *aux),
+            void (*fn)(const char *path, struct p9_stat *stat,
+                       const char *err, void *aux),
+            void *aux, struct p9_conn *c)
+{
+  struct p9_bulkstat b = {fn, aux, 0};
+  struct p9_statslot *slots, *s;
+  const char *path = "";
+  int i, active = 0, err = 0;
+
+  if (window < 1)
+    window = 1;
+  slots = calloc(window, sizeof(struct p9_statslot));
+  if (!slots)
+    return -1;
+  for (i = 0; i < window; ++i)
+    slots[i].b = &b;
+  while (!err && (path || active)) {
+    for (i = 0; i < window && path && !err; ++i) {
+      s = &slots[i];
+      if (s->path || !(path = next(aux)))
+        continue;
+      err = bulkstat_send(s, path, c);
+      if (s->path)
+        ++active;
+    }
+    if (active && !err)
+      err = p9_io_recv(c, -1) < 0;
+    for (i = 0; i < window; ++i) {
+      s = &slots[i];
+      if (s->path && !s->pending && !s->w.pending) {
+        bulkstat_finish(s, c);
+        --active;
+      }
+    }
+  }
+  for (i = 0; i < window; ++i)
+    if (slots[i].path) {
+      io_wait(c, &slots[i].pending);
+      io_wait(c, &slots[i].w.pending);
+      bulkstat_finish(&slots[i], c);
+    }
+  free(slots);
+  return (err) ? -1 : b.nerr;
+}
+
+struct p9_bulkio;
+
+enum {
+  IO_OPEN,
+  IO_READ,
+  IO_STAT
+};
+
+struct p9_ioslot {
+  struct p9_bulkitem *item;
+  unsigned int fid;
+  unsigned int iounit;
+  int state;
+  int pending;
+  int ok;
+  int want;
+  int got;
+  unsigned long long off;
+  unsigned long long left;
+  char *err;
+  struct p9_walk w;
+  struct p9_bulkio *b;
+};
+
+struct p9_bulkio {
+  void (*fn)(struct p9_bulkitem *item, const char *data, int len,
+             struct p9_stat *stat, const char *err, void *aux);
+  void *aux;
+  int nerr;
+};
+
+static void
+bulkio_done(struct p9_conn *c, void *aux)
+{
+  struct p9_ioslot *s = aux;
+  struct p9_msg *r = &c->c.r;
+
+  --s->pending;
+  switch (r->type) {
+  case P9_ROPEN:
+    s->ok = 1;
+    s->iounit = r->iounit;
+    break;
+  case P9_RSTAT:
+    s->ok = 1;
+    s->b->fn(s->item, 0, 0, &r->stat, 0, s->b->aux);
+    break;
+  case P9_RREAD:
+    s->got = (r->count < s->want) ? r->count : s->want;
+    if (s->got)
+      s->b->fn(s->item, r->data, s->got, 0, 0, s->b->aux);
+    break;
+  default:
+    s->got = -1;
+    if (r->ename && !s->err)
+      s->err = strndup(r->ename, r->ename_len);
+  }
+}
+
+static int
+bulkio_send(struct p9_ioslot *s, struct p9_bulkitem *item, struct p9_conn *c)
+{
+  const char *path = item->path;
+
+  s->item = item;
+  s->state = (item->stat) ? IO_STAT : IO_OPEN;
+  s->err = 0;
+  s->ok = 0;
+  s->off = item->off;
+  s->left = (item->len) ? item->len : ~0ull;
+  s->fid = p9_seq_next(c->fids);
+  if (walk_send(&s->w, s->fid, c->root_fid, path, strlen(path), c))
+    return -1;
+  c->c.t.type = (item->stat) ? P9_TSTAT : P9_TOPEN;
+  c->c.t.fid = s->fid;
+  c->c.t.mode = P9_OREAD;
+  if (p9_io_send(c, bulkio_done, s) < 0)
+    return -1;
+  ++s->pending;
+  if (item->stat)
+    p9fid_close(s->fid, c);
+  return 0;
+}
+
+static int
+bulkio_read(struct p9_ioslot *s, struct p9_conn *c)
+{
+  unsigned int chunk = c->c.msize - IOHDRSZ;
+
+  if (s->iounit && s->iounit < chunk)
+    chunk = s->iounit;
+  s->want = (s->left < chunk) ? s->left : chunk;
+  s->got = 0;
+  c->c.t.type = P9_TREAD;
+  c->c.t.fid = s->fid;
+  c->c.t.offset = s->off;
+  c->c.t.count = s->want;
+  if (p9_io_send(c, bulkio_done, s) < 0)
+    return -1;
+  ++s->pending;
+  return 0;
+}
+
+static void
+bulkio_finish(struct p9_ioslot *s, const char *err, struct p9_conn *c)
+{
+  struct p9_bulkitem *item = s->item;
+
+  if (s->state != IO_STAT)
+    p9fid_close(s->fid, c);
+  if (err)
+    ++s->b->nerr;
+  s->item = 0;
+  s->b->fn(item, 0, 0, 0, err, s->b->aux);
+  free(s->err);
+  s->err = 0;
+}
+
+/* Moves the item of s on once all its replies have arrived. */
+static int
+bulkio_step(struct p9_ioslot *s, struct p9_conn *c)
+{
+  char *ename;
+  int r, err = 0;
+
+  if (s->state == IO_READ) {
+    if (s->got < 0) {
+      bulkio_finish(s, (s->err) ? s->err : "error", c);
+      return 0;
+    }
+    s->off += s->got;
+    s->left -= s->got;
+    if (s->got && s->left)
+      return bulkio_read(s, c);
+    bulkio_finish(s, 0, c);
+    return 0;
+  }
+  ename = s->w.ename;
+  s->w.ename = 0;
+  r = walk_result(&s->w, c);
+  if (s->ok && s->state == IO_STAT)
+    s->item = 0;
+  else if (!s->ok)
+    bulkio_finish(s, (ename) ? ename
+                     : (r >= 0 && s->item->path[r]) ? "file does not exist"
+                     : (s->err) ? s->err : "error", c);
+  else {
+    s->state = IO_READ;
+    err = bulkio_read(s, c);
+  }
+  free(ename);
+  return err;
+}
+
+/* Like p9_bulkstat, but every item returned by next is either stat'ed or
+ * read from its offset, keeping up to window of them in flight.  next is
+ * asked again whenever a slot is free, so it may return 0 while it has
+ * no item yet; p9_bulkio returns once it has none and nothing is left in
+ * flight.  fn gets the data of every Rread as it arrives and is called
+ * once more with data set to 0 when the item is done: with stat set for
+ * a stat'ed item, or with err set if the item failed.  Returns the number
+ * of failed items or -1 if the connection failed. */
+int
+p9_bulkio(int window, struct p9_bulkitem *(*next)(void *aux),
+          void (*fn)(struct p9_bulkitem *item, const char *data, int len,
+                     struct p9_stat *stat, const char *err, void *aux),
+          void *aux, struct p9_conn *c)
+{
+  struct p9_bulkio b = {fn, aux, 0};
+  struct p9_ioslot *slots, *s;
+  struct p9_bulkitem *item;
+  int i, more, active, err = 0;
+
+  if (window < 1)
+    window = 1;
+  slots = calloc(window, sizeof(struct p9_ioslot));
+  if (!slots)
+    return -1;
+  for (i = 0; i < window; ++i)
+    slots[i].b = &b;
+  while (!err) {
+    for (i = 0, more = 1; i < window && more && !err; ++i) {
+      s = &slots[i];
+      if (s->item)
+        continue;
+      if (!(item = next(aux)))
+        more = 0;
+      else
+        err = bulkio_send(s, item, c);
+    }
+    for (i = 0, active = 0; i < window; ++i)
+      active += slots[i].item != 0;
+    if (!active || err || (err = p9_io_recv(c, -1) < 0))
+      break;
+    for (i = 0; i < window && !err; ++i) {
+      s = &slots[i];
+      if (s->item && !s->pending && !s->w.pending)
+        err = bulkio_step(s, c);
+    }
+  }
+  for (i = 0; i < window; ++i) {
+    s = &slots[i];
+    if (!s->item)
+      continue;
+    io_wait(c, &s->pending);
+    io_wait(c, &s->w.pending);
+    if (s->state != IO_READ)
+      walk_result(&s->w, c);
+    if (s->state == IO_STAT && s->ok)
+      s->item = 0;
+    else
+      bulkio_finish(s, "connection failed", c);
+  }
+  free(slots);
+  return (err) ? -1 : b.nerr;
+}
+
 P9_file
 p9_open(const char *path, int mode, unsigned int root_fid, struct p9_conn *c)
 {
@@ -452,6 +1220,7 @@ p9_open(const char *path, int mode, unsigned int root_fid, struct p9_conn *c)
   f = calloc(1, sizeof(struct p9_file));
   if (f) {
     f->fid = fid;
+    f->iounit = c->c.r.iounit;
     f->c = c;
   }
   return (P9_file)f;
@@ -460,35 +1229,55 @@ err:
   return 0;
 }
 
+static int
+split_path(const char *path, int *baselen)
+{
+  int end, base;
+
+  for (end = strlen(path); end > 0 && path[end - 1] == '/'; --end) {}
+  for (base = end; base > 0 && path[base - 1] != '/'; --base) {}
+  *baselen = end - base;
+  return base;
+}
+
 P9_file
 p9_create(const char *path, int mode, int perm, unsigned int root_fid,
           struct p9_conn *c)
 {
-  struct p9_file *f;
+  struct p9_file *f = 0;
+  struct p9_walk w;
+  struct p9_step create;
+  struct p9_msg *m = &c->c.t;
   unsigned int fid;
-  int r;
-  char *dir = 0;
+  int dirlen, baselen, err;
 
-  r = p9fid_walk2(path, root_fid, c, &fid);
-  if (r < 0 || fid != P9_NOFID)
-    goto err;
-  dir = malloc(r + 1);
-  if (!dir)
-    return 0;
-  memcpy(dir, path, r);
-  dir[r] = 0;
-  r = p9fid_walk2(dir, root_fid, c, &fid);
-  free(dir);
-  if (fid == P9_NOFID)
+  if (root_fid == P9_NOFID || root_fid == -1)
+    root_fid = c->root_fid;
+  dirlen = split_path(path, &baselen);
+  if (!baselen)
     return 0;
-  if (p9fid_create(fid, path + r, mode, perm, c))
+  fid = p9_seq_next(c->fids);
+  err = walk_send(&w, fid, root_fid, path, dirlen, c);
+  if (!err) {
+    m->type = P9_TCREATE;
+    m->fid = fid;
+    m->name = (char *)path + dirlen;
+    m->name_len = baselen;
+    m->perm = perm;
+    m->mode = mode;
+    err = step_send(&create, P9_RCREATE, &w.pending, c);
+  }
+  if (io_wait(c, &w.pending))
+    err = -1;
+  if (walk_result(&w, c) != dirlen || err || !create.ok)
     goto err;
   f = calloc(1, sizeof(struct p9_file));
   if (f) {
     f->fid = fid;
+    f->iounit = create.iounit;
     f->c = c;
+    return (P9_file)f;
   }
-  return (P9_file) f;
 err:
   p9fid_close(fid, c);
   return 0;
@@ -506,6 +1295,84 @@ p9_mkdir(const char *path, int perm, struct p9_conn *c)
   return 0;
 }
 
+/* Walks as far as the path exists, then sends the whole chain of missing
+ * directories at once.  For each one the parent is cloned, the clone is
+ * turned into the new directory by Tcreate and the parent is walked into
+ * it, so a directory created concurrently by someone else still counts. */
+int
+p9_mkdirp(const char *path, int perm, struct p9_conn *c)
+{
+  struct p9_walk w;
+  struct p9_step *steps;
+  struct p9_msg *m = &c->c.t;
+  unsigned int dir, tmp, next;
+  int i, n, len, off, pending = 0, nsteps = 0, ret = -1, err;
+
+  for (len = strlen(path); len > 0 && path[len - 1] == '/'; --len) {}
+  dir = p9_seq_next(c->fids);
+  walk_send(&w, dir, c->root_fid, path, len, c);
+  if (io_wait(c, &w.pending))
+    w.err = -1;
+  off = walk_result(&w, c);
+  if (off < 0 || off == len) {
+    p9fid_close(dir, c);
+    return (off == len) ? 0 : -1;
+  }
+
+  for (n = 0, i = off; i < len; ++i)
+    if (path[i] != '/' && (!i || path[i - 1] == '/'))
+      ++n;
+  steps = calloc(3 * n, sizeof(struct p9_step));
+  if (!steps) {
+    p9_seq_drop(dir, c->fids);
+    return -1;
+  }
+  err = walk_send(&w, dir, c->root_fid, path, off, c);
+  while (!err && off < len) {
+    for (i = off; i < len && path[i] != '/'; ++i) {}
+    tmp = p9_seq_next(c->fids);
+    next = p9_seq_next(c->fids);
+
+    m->type = P9_TWALK;
+    m->fid = dir;
+    m->newfid = tmp;
+    m->nwname = 0;
+    err = step_send(&steps[nsteps++], P9_RWALK, &pending, c);
+
+    m->type = P9_TCREATE;
+    m->fid = tmp;
+    m->name = (char *)path + off;
+    m->name_len = i - off;
+    m->perm = P9_DMDIR | perm;
+    m->mode = P9_OREAD;
+    err = err || step_send(&steps[nsteps++], P9_RCREATE, &pending, c);
+    p9fid_close(tmp, c);
+
+    m->type = P9_TWALK;
+    m->fid = dir;
+    m->newfid = next;
+    m->nwname = 1;
+    m->wname[0] = (char *)path + off;
+    m->wname_len[0] = i - off;
+    err = err || step_send(&steps[nsteps++], P9_RWALK, &pending, c);
+    p9fid_close(dir, c);
+
+    dir = next;
+    for (off = i; off < len && path[off] == '/'; ++off) {}
+  }
+  if (io_wait(c, &pending) || io_wait(c, &w.pending))
+    err = 1;
+  walk_result(&w, c);
+  for (i = 0; i < nsteps; i += 3)
+    if (!steps[i].ok)
+      err = 1;
+  if (!err && nsteps && steps[nsteps - 1].ok)
+    ret = 0;
+  p9fid_close(dir, c);
+  free(steps);
+  return ret;
+}
+
 void
 p9_close(P9_file file)
 {
@@ -546,6 +1413,24 @@ p9_read(int len, void *data, P9_file file)
   return r;
 }
 
+long
+p9_preadv(const struct iovec *iov, int iovcnt, uint64_t off, P9_file file)
+{
+  struct p9_file *f = file;
+  if (!f)
+    return -1;
+  return p9fid_vio(P9_TREAD, f->fid, off, iov, iovcnt, f->iounit, f->c);
+}
+
+long
+p9_pwritev(const struct iovec *iov, int iovcnt, uint64_t off, P9_file file)
+{
+  struct p9_file *f = file;
+  if (!f)
+    return -1;
+  return p9fid_vio(P9_TWRITE, f->fid, off, iov, iovcnt, f->iounit, f->c);
+}
+
 static int
 p9_readstat(struct p9_stat *entry, struct p9_file *f)
 {
@@ -1,7 +1,19 @@
 struct p9_conn;
 struct p9_stat;
+struct p9_trace;
+struct p9_stats;
+struct iovec;
 typedef void *P9_file;
 
+/* An item of p9_bulkio: the file at path is stat'ed, or read from off for
+ * len bytes, to its end if len is 0. */
+struct p9_bulkitem {
+  const char *path;
+  int stat;
+  unsigned long long off;
+  unsigned long long len;
+};
+
 struct p9_conn *mk_p9conn(int fd, int init);
 void rm_p9conn(struct p9_conn *c, int clunk_root);
 
@@ -11,6 +23,9 @@ unsigned int p9_add_fid(unsigned int fid, struct p9_conn *c);
 void p9_rm_fid(unsigned int fid, struct p9_conn *c);
 unsigned int p9_root_fid(struct p9_conn *c);
 void p9_set_root_fid(unsigned int root_fid, struct p9_conn *c);
+void p9_set_trace(struct p9_trace *t, struct p9_conn *c);
+void p9_get_stats(struct p9_stats *st, struct p9_conn *c);
+void p9_reset_stats(struct p9_conn *c);
 
 int p9fid_walk(unsigned int newfid, unsigned int fid, const char *path,
                struct p9_conn *c);
@@ -27,15 +42,30 @@ int p9fid_write(unsigned int fid, uint64_t off, int len, void *data,
 int p9fid_read(unsigned int fid, uint64_t off, int len, void *data,
                struct p9_conn *c);
 int p9fid_stat(unsigned int fid, struct p9_stat *stat, struct p9_conn *c);
+int p9_bulkstat(int window, const char *(*next)(void *aux),
+                void (*fn)(const char *path, struct p9_stat *stat,
+                           const char *err, void *aux),
+                void *aux, struct p9_conn *c);
+int p9_bulkio(int window, struct p9_bulkitem *(*next)(void *aux),
+              void (*fn)(struct p9_bulkitem *item, const char *data, int len,
+                         struct p9_stat *stat, const char *err, void *aux),
+              void *aux, struct p9_conn *c);
+long p9fid_preadv(unsigned int fid, uint64_t off, const struct iovec *iov,
+                  int iovcnt, struct p9_conn *c);
+long p9fid_pwritev(unsigned int fid, uint64_t off, const struct iovec *iov,
+                   int iovcnt, struct p9_conn *c);
 
 P9_file p9_open(const char *path, int mode, unsigned int root_fid,
                 struct p9_conn *c);
 P9_file p9_create(const char *path, int mode, int perm, unsigned int root_fid,
                  struct p9_conn *c);
 int p9_mkdir(const char *path, int perm, struct p9_conn *c);
+int p9_mkdirp(const char *path, int perm, struct p9_conn *c);
 void p9_close(P9_file f);
 int p9_write(int len, void *data, P9_file f);
 int p9_read(int len, void *data, P9_file f);
+long p9_preadv(const struct iovec *iov, int iovcnt, uint64_t off, P9_file f);
+long p9_pwritev(const struct iovec *iov, int iovcnt, uint64_t off, P9_file f);
 int p9_readdir(struct p9_stat *entry, P9_file f);
 int p9_tell(P9_file f);
 int p9_seek(P9_file f, int mode, int seek);
@@ -1,16 +1,8 @@
 #include <stdio.h>
 #include "9p.h"
+#include "9pmsg.h"
 
-#define OUT_UINT(m, name) \
-  fprintf(stderr, ";       " # name ": %u\n", m->name)
-
-#define OUT_UINT8(m, name) \
-  fprintf(stderr, ";       " # name ": %llu\n", m->name)
-
-#define OUT_STR1(m, len, name) \
-  fprintf(stderr, ";       " # name ": '%.*s'\n", m->len, m->name)
-
-#define OUT_STR(m, name) OUT_STR1(m, name##_len, name)
+#define MEMBER(m, off, type) (*(type *)((char *)(m) + (off)))
 
 static void
 print_data_hex(const char *name, int len, char *data)
@@ -23,192 +15,190 @@ print_data_hex(const char *name, int len, char *data)
 }
 
 static void
-pprint_msg_hdr(struct p9_msg *m, const char *type, char *dir)
+print_qid(const char *name, int i, struct p9_qid *qid)
 {
-  fprintf(stderr, "\n;  %s MSG\n", dir);
-  OUT_UINT(m, size);
-  fprintf(stderr, ";       type: %s\n", type);
-  OUT_UINT(m, tag);
+  char buf[16];
+
+  if (i >= 0)
+    snprintf(buf, sizeof(buf), "%s[%d]", name, i);
+  else
+    snprintf(buf, sizeof(buf), "%s", name);
+  fprintf(stderr, ";       %s.type: %u\n", buf, qid->type);
+  fprintf(stderr, ";       %s.version: %u\n", buf, qid->version);
+  fprintf(stderr, ";       %s.path: %llu\n", buf, qid->path);
 }
 
-void
-p9_print_msg(struct p9_msg *m, char *dir)
+static void
+print_stat(struct p9_stat *st)
 {
-  int i;
-
-  switch (m->type) {
-  case P9_TVERSION:
-    pprint_msg_hdr(m, "Tversion", dir);
-    OUT_UINT(m, msize);
-    OUT_STR(m, version);
-    break;
-
-  case P9_RVERSION:
-    pprint_msg_hdr(m, "Rversion", dir);
-    OUT_UINT(m, msize);
-    OUT_STR(m, version);
-    break;
-
-  case P9_TAUTH:
-    pprint_msg_hdr(m, "Tauth", dir);
-    OUT_UINT(m, afid);
-    OUT_STR(m, uname);
-    OUT_STR(m, aname);
-    break;
-
-  case P9_RAUTH:
-    pprint_msg_hdr(m, "Rauth", dir);
-    OUT_UINT(m, qid.type);
-    OUT_UINT(m, qid.version);
-    OUT_UINT8(m, qid.path);
-    break;
-
-  case P9_TATTACH:
-    pprint_msg_hdr(m, "Tattach", dir);
-    OUT_UINT(m, fid);
-    OUT_UINT(m, afid);
-    OUT_STR(m, uname);
-    OUT_STR(m, aname);
-    break;
-
-  case P9_RATTACH:
-    pprint_msg_hdr(m, "Rattach", dir);
-    OUT_UINT(m, qid.type);
-    OUT_UINT(m, qid.version);
-    OUT_UINT8(m, qid.path);
-    break;
-
-  case P9_TERROR:
-    pprint_msg_hdr(m, "Terror", dir);
-    break;
-
-  case P9_RERROR:
-    pprint_msg_hdr(m, "Rerror", dir);
-    OUT_STR(m, ename);
-    break;
-
-  case P9_TFLUSH:
-    pprint_msg_hdr(m, "Tflush", dir);
-    OUT_UINT(m, oldtag);
-    break;
-
-  case P9_RFLUSH:
-    pprint_msg_hdr(m, "Rflush", dir);
-    break;
-
-  case P9_TWALK:
-    pprint_msg_hdr(m, "Twalk", dir);
-    OUT_UINT(m, fid);
-    OUT_UINT(m, newfid);
-    OUT_UINT(m, nwname);
-    for (i = 0; i < m->nwname; ++i)
-      OUT_STR1(m, wname_len[i], wname[i]);
-    break;
-
-  case P9_RWALK:
-    pprint_msg_hdr(m, "Rwalk", dir);
-    OUT_UINT(m, nwqid);
-    for (i = 0; i< m->nwqid; ++i) {
-      OUT_UINT(m, wqid[i].type);
-      OUT_UINT(m, wqid[i].version);
-      OUT_UINT8(m, wqid[i].path);
-    }
-    break;
-
-  case P9_TOPEN:
-    pprint_msg_hdr(m, "Topen", dir);
-    OUT_UINT(m, fid);
-    OUT_UINT(m, mode);
-    break;
-
-  case P9_ROPEN:
-    pprint_msg_hdr(m, "Ropen", dir);
-    OUT_UINT(m, qid.type);
-    OUT_UINT(m, qid.version);
-    OUT_UINT8(m, qid.path);
-    OUT_UINT(m, iounit);
-    break;
-
-  case P9_TCREATE:
-    pprint_msg_hdr(m, "Tcreate", dir);
-    OUT_UINT(m, fid);
-    OUT_STR(m, name);
-    OUT_UINT(m, perm);
-    OUT_UINT(m, mode);
-    break;
-
-  case P9_RCREATE:
-    pprint_msg_hdr(m, "Rcreate", dir);
-    OUT_UINT(m, qid.type);
-    OUT_UINT(m, qid.version);
-    OUT_UINT8(m, qid.path);
-    OUT_UINT(m, iounit);
-    break;
-
-  case P9_TREAD:
-    pprint_msg_hdr(m, "tread", dir);
-    OUT_UINT(m, fid);
-    OUT_UINT8(m, offset);
-    OUT_UINT(m, count);
-    break;
-
-  case P9_RREAD:
-    pprint_msg_hdr(m, "rread", dir);
-    OUT_UINT(m, count);
-    print_data_hex("data", m->count, m->data);
-    break;
-
-  case P9_TWRITE:
-    pprint_msg_hdr(m, "Twrite", dir);
-    OUT_UINT(m, fid);
-    OUT_UINT8(m, offset);
-    OUT_UINT(m, count);
-    print_data_hex("data", m->count, m->data);
-    break;
+  fprintf(stderr, ";       stat.size: %u\n", st->size);
+  fprintf(stderr, ";       stat.type: %u\n", st->type);
+  fprintf(stderr, ";       stat.dev: %u\n", st->dev);
+  print_qid("stat.qid", -1, &st->qid);
+  fprintf(stderr, ";       stat.mode: %o\n", st->mode);
+  fprintf(stderr, ";       stat.atime: %u\n", st->atime);
+  fprintf(stderr, ";       stat.mtime: %u\n", st->mtime);
+  fprintf(stderr, ";       stat.length: %llu\n", st->length);
+  fprintf(stderr, ";       stat.name: '%.*s'\n", st->name_len, st->name);
+  fprintf(stderr, ";       stat.uid: '%.*s'\n", st->uid_len, st->uid);
+  fprintf(stderr, ";       stat.gid: '%.*s'\n", st->gid_len, st->gid);
+  fprintf(stderr, ";       stat.muid: '%.*s'\n", st->muid_len, st->muid);
+}
 
-  case P9_RWRITE:
-    pprint_msg_hdr(m, "Rwrite", dir);
-    OUT_UINT(m, count);
+static void
+print_field(struct p9_msg *m, const struct p9_field *f)
+{
+  unsigned long long x;
+  unsigned int i;
+
+  switch (f->kind) {
+  case P9_FU1:
+  case P9_FU2:
+  case P9_FU4:
+  case P9_FU8:
+    if (f->width == 2)
+      x = MEMBER(m, f->off, unsigned short);
+    else if (f->width == 4)
+      x = MEMBER(m, f->off, unsigned int);
+    else
+      x = MEMBER(m, f->off, unsigned long long);
+    fprintf(stderr, ";       %s: %llu\n", f->name, x);
+    break;
+  case P9_FSTR:
+    fprintf(stderr, ";       %s: '%.*s'\n", f->name,
+            MEMBER(m, f->lenoff, unsigned int), MEMBER(m, f->off, char *));
+    break;
+  case P9_FDATA:
+    fprintf(stderr, ";       count: %u\n", m->count);
+    print_data_hex(f->name, m->count, m->data);
+    break;
+  case P9_FQID:
+    print_qid(f->name, -1, &MEMBER(m, f->off, struct p9_qid));
+    break;
+  case P9_FWNAME:
+    fprintf(stderr, ";       nwname: %u\n", m->nwname);
+    for (i = 0; i < m->nwname && i < P9_MAXWELEM; ++i)
+      fprintf(stderr, ";       wname[%u]: '%.*s'\n", i, m->wname_len[i],
+              m->wname[i]);
+    break;
+  case P9_FWQID:
+    fprintf(stderr, ";       nwqid: %u\n", m->nwqid);
+    for (i = 0; i < m->nwqid && i < P9_MAXWELEM; ++i)
+      print_qid(f->name, i, &m->wqid[i]);
+    break;
+  case P9_FSTAT:
+    print_stat(&m->stat);
     break;
+  }
+}
 
-  case P9_TCLUNK:
-    pprint_msg_hdr(m, "Tclunk", dir);
-    OUT_UINT(m, fid);
-    break;
+void
+p9_print_msg(struct p9_msg *m, char *dir)
+{
+  const struct p9_schema *sc = 0;
+  const struct p9_field *f;
+
+  if (m->type >= P9_XSTART && m->type < P9_XEND)
+    sc = &p9_schema[m->type - P9_XSTART];
+  if (!sc || !sc->name) {
+    fprintf(stderr, ";  %s UNKNOWN MSG %u\n\n\n", dir, m->type);
+    return;
+  }
+  fprintf(stderr, "\n;  %s MSG\n", dir);
+  fprintf(stderr, ";       size: %u\n", m->size);
+  fprintf(stderr, ";       type: %s\n", sc->name);
+  fprintf(stderr, ";       tag: %u\n", m->tag);
+  for (f = sc->f; f->kind; ++f)
+    print_field(m, f);
+  fprintf(stderr, "\n\n");
+}
 
-  case P9_RCLUNK:
-    pprint_msg_hdr(m, "Rclunk", dir);
-    break;
+static int
+hist_bucket(unsigned long long v)
+{
+  int m;
+
+  if (v < P9_HISTSUB)
+    return v;
+  m = 63 - __builtin_clzll(v);
+  if (m > 39)
+    return P9_HISTBUCKETS - 1;
+  return (m - 3) * P9_HISTSUB + ((v >> (m - 4)) & (P9_HISTSUB - 1));
+}
 
-  case P9_TREMOVE:
-    pprint_msg_hdr(m, "Tremove", dir);
-    OUT_UINT(m, fid);
-    break;
+/* The largest value that falls into bucket b. */
+static unsigned long long
+hist_top(int b)
+{
+  int m = b / P9_HISTSUB + 3;
 
-  case P9_RREMOVE:
-    pprint_msg_hdr(m, "Rremove", dir);
-    break;
+  if (b < P9_HISTSUB)
+    return b;
+  return ((P9_HISTSUB + b % P9_HISTSUB + 1ull) << (m - 4)) - 1;
+}
 
-  case P9_TSTAT:
-    pprint_msg_hdr(m, "Tstat", dir);
-    OUT_UINT(m, fid);
-    break;
+void
+p9_hist_add(unsigned long long v, struct p9_hist *h)
+{
+  ++h->count;
+  h->sum += v;
+  if (v > h->max)
+    h->max = v;
+  ++h->bucket[hist_bucket(v)];
+}
 
-  case P9_RSTAT:
-    pprint_msg_hdr(m, "Rstat", dir);
-    break;
+/* Adds the values of src to dst. */
+void
+p9_hist_merge(struct p9_hist *src, struct p9_hist *dst)
+{
+  int b;
+
+  dst->count += src->count;
+  dst->sum += src->sum;
+  if (src->max > dst->max)
+    dst->max = src->max;
+  for (b = 0; b < P9_HISTBUCKETS; ++b)
+    dst->bucket[b] += src->bucket[b];
+}
 
-  case P9_TWSTAT:
-    pprint_msg_hdr(m, "Twstat", dir);
-    OUT_UINT(m, fid);
-    break;
+/* p is in percent. */
+unsigned long long
+p9_hist_percentile(double p, struct p9_hist *h)
+{
+  unsigned long long n = 0, want;
+  int b;
+
+  if (!h->count)
+    return 0;
+  want = p / 100 * h->count + 0.999999;
+  if (want < 1)
+    want = 1;
+  for (b = 0; b < P9_HISTBUCKETS - 1; ++b)
+    if ((n += h->bucket[b]) >= want)
+      break;
+  return (b < P9_HISTBUCKETS - 1 && hist_top(b) < h->max) ? hist_top(b)
+                                                         : h->max;
+}
 
-  case P9_RWSTAT:
-    pprint_msg_hdr(m, "Rwstat", dir);
-    break;
+void
+p9_print_stats(struct p9_stats *st, FILE *f)
+{
+  struct p9_hist *h;
+  int i;
 
-  default:
-    fprintf(stderr, ";  %s UNKNOWN MSG %u\n", dir, m->type);
+  fprintf(f, ";  bytes in %llu out %llu\n", st->bytes_in, st->bytes_out);
+  fprintf(f, ";  send %llu recv %llu partial %llu moved %llu\n",
+          st->sends, st->recvs, st->partial_recvs, st->moved);
+  fprintf(f, ";  %-8s %8s %6s %9s %9s %9s %9s %9s us\n", "type",
+          "count", "errors", "mean", "p50", "p99", "p99.9", "max");
+  for (i = 0; i < (P9_XEND - P9_XSTART) / 2; ++i) {
+    h = &st->lat[i];
+    if (!h->count)
+      continue;
+    fprintf(f, ";  %-8s %8llu %6llu %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+            p9_schema[2 * i].name, h->count, st->errors[i],
+            h->sum / 1e3 / h->count, p9_hist_percentile(50, h) / 1e3,
+            p9_hist_percentile(99, h) / 1e3,
+            p9_hist_percentile(99.9, h) / 1e3, h->max / 1e3);
   }
-  fprintf(stderr, "\n\n");
 }
@@ -1 +1,5 @@
 void p9_print_msg(struct p9_msg *m, char *dir);
+void p9_hist_add(unsigned long long v, struct p9_hist *h);
+void p9_hist_merge(struct p9_hist *src, struct p9_hist *dst);
+unsigned long long p9_hist_percentile(double p, struct p9_hist *h);
+void p9_print_stats(struct p9_stats *st, FILE *f);
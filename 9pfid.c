@@ -0,0 +1,301 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "9p.h"
+#include "9pfid.h"
+
+#define MINSLOTS 16
+#define SLABSIZE 32
+#define ALIGN 16
+
+struct p9_fidslot {
+  unsigned int fid;
+  struct p9_fid *f;
+};
+
+struct p9_fidslab {
+  struct p9_fidslab *next;
+  unsigned char mem[];
+};
+
+/* Fids are kept in an open addressing table with linear probing.  The
+ * entries themselves come from slabs and never move. */
+struct p9_fidtab {
+  int size;
+  unsigned int mask;
+  unsigned int used;
+  struct p9_fidslot *slots;
+  struct p9_fidslab *slabs;
+  void *free;
+  pthread_mutex_t lock;
+};
+
+static unsigned int
+hash(unsigned int fid)
+{
+  return fid * 0x9e3779b1u;
+}
+
+/* size is the size of the backend's fid structure starting with struct
+ * p9_fid. */
+struct p9_fidtab *
+mk_p9fidtab(int size)
+{
+  struct p9_fidtab *t;
+
+  if (size < (int)sizeof(struct p9_fid))
+    size = sizeof(struct p9_fid);
+  t = calloc(1, sizeof(struct p9_fidtab));
+  if (!t)
+    return 0;
+  t->size = (size + ALIGN - 1) & ~(ALIGN - 1);
+  t->mask = MINSLOTS - 1;
+  t->slots = calloc(MINSLOTS, sizeof(struct p9_fidslot));
+  if (!t->slots) {
+    free(t);
+    return 0;
+  }
+  pthread_mutex_init(&t->lock, 0);
+  return t;
+}
+
+/* Calls rm of every fid left. */
+void
+rm_p9fidtab(struct p9_fidtab *t)
+{
+  struct p9_fidslab *s;
+  unsigned int i;
+
+  if (!t)
+    return;
+  for (i = 0; i <= t->mask; ++i)
+    if (t->slots[i].f && t->slots[i].f->rm)
+      t->slots[i].f->rm(t->slots[i].f);
+  while ((s = t->slabs)) {
+    t->slabs = s->next;
+    free(s);
+  }
+  free(t->slots);
+  pthread_mutex_destroy(&t->lock);
+  free(t);
+}
+
+static struct p9_fid *
+alloc_fid(struct p9_fidtab *t)
+{
+  struct p9_fidslab *s;
+  void *p;
+  int i;
+
+  if (!t->free) {
+    s = malloc(sizeof(struct p9_fidslab) + ALIGN + SLABSIZE * t->size);
+    if (!s)
+      return 0;
+    s->next = t->slabs;
+    t->slabs = s;
+    p = (void *)(((uintptr_t)s->mem + ALIGN - 1) & ~(uintptr_t)(ALIGN - 1));
+    for (i = 0; i < SLABSIZE; ++i) {
+      *(void **)((char *)p + i * t->size) = t->free;
+      t->free = (char *)p + i * t->size;
+    }
+  }
+  p = t->free;
+  t->free = *(void **)p;
+  memset(p, 0, t->size);
+  return p;
+}
+
+static void
+free_fid(struct p9_fid *f, struct p9_fidtab *t)
+{
+  *(void **)f = t->free;
+  t->free = f;
+}
+
+static struct p9_fidslot *
+find(unsigned int fid, struct p9_fidtab *t)
+{
+  unsigned int i;
+
+  for (i = hash(fid) & t->mask; t->slots[i].f; i = (i + 1) & t->mask)
+    if (t->slots[i].fid == fid)
+      return &t->slots[i];
+  return &t->slots[i];
+}
+
+static int
+grow(struct p9_fidtab *t)
+{
+  struct p9_fidslot *old = t->slots, *s;
+  unsigned int i, n = t->mask + 1;
+
+  t->slots = calloc(n * 2, sizeof(struct p9_fidslot));
+  if (!t->slots) {
+    t->slots = old;
+    return -1;
+  }
+  t->mask = n * 2 - 1;
+  for (i = 0; i < n; ++i)
+    if (old[i].f) {
+      s = find(old[i].fid, t);
+      *s = old[i];
+    }
+  free(old);
+  return 0;
+}
+
+static int
+insert(struct p9_fid *f, struct p9_fidtab *t)
+{
+  struct p9_fidslot *s;
+
+  if ((t->used + 1) * 4 > (t->mask + 1) * 3 && grow(t))
+    return -1;
+  s = find(f->fid, t);
+  if (s->f)
+    return -1;
+  s->fid = f->fid;
+  s->f = f;
+  ++t->used;
+  return 0;
+}
+
+/* Removal shifts the following entries of the probe sequence back, so no
+ * tombstones are needed. */
+static void
+delete(struct p9_fidslot *s, struct p9_fidtab *t)
+{
+  unsigned int i = s - t->slots, j = i, k;
+
+  for (;;) {
+    j = (j + 1) & t->mask;
+    if (!t->slots[j].f)
+      break;
+    k = hash(t->slots[j].fid) & t->mask;
+    if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j))
+      continue;
+    t->slots[i] = t->slots[j];
+    i = j;
+  }
+  t->slots[i].f = 0;
+  --t->used;
+}
+
+struct p9_fid *
+p9_fidtab_get(unsigned int fid, struct p9_fidtab *t)
+{
+  struct p9_fid *f;
+
+  pthread_mutex_lock(&t->lock);
+  f = find(fid, t)->f;
+  pthread_mutex_unlock(&t->lock);
+  return f;
+}
+
+/* Returns a zeroed, not open fid or 0 if fid is in use. */
+struct p9_fid *
+p9_fidtab_add(unsigned int fid, struct p9_fidtab *t)
+{
+  struct p9_fid *f;
+
+  pthread_mutex_lock(&t->lock);
+  if ((f = alloc_fid(t))) {
+    f->fid = fid;
+    f->open_mode = P9_NOTOPEN;
+    if (insert(f, t)) {
+      free_fid(f, t);
+      f = 0;
+    }
+  }
+  pthread_mutex_unlock(&t->lock);
+  return f;
+}
+
+static void
+release(struct p9_fid *f, struct p9_fidtab *t)
+{
+  if (f->rm)
+    f->rm(f);
+  pthread_mutex_lock(&t->lock);
+  free_fid(f, t);
+  pthread_mutex_unlock(&t->lock);
+}
+
+/* Calls rm of the fid and frees it. */
+void
+p9_fidtab_del(struct p9_fid *f, struct p9_fidtab *t)
+{
+  struct p9_fidslot *s;
+
+  pthread_mutex_lock(&t->lock);
+  s = find(f->fid, t);
+  if (s->f == f)
+    delete(s, t);
+  pthread_mutex_unlock(&t->lock);
+  release(f, t);
+}
+
+#define ERR(c, e) P9_SET_STR((c)->r.ename, (char *)(e))
+
+/* Twalk on top of fs->walk1.  The walk goes on a clone of the fid, which
+ * replaces the fid or is added as newfid only if every element could be
+ * walked.  walk1 is called for every element with the clone in t.pfid and
+ * the index of the element in r.nwqid. */
+void
+p9_fidtab_walk(struct p9_connection *c, struct p9_fs *fs,
+               struct p9_fidtab *t)
+{
+  struct p9_fid *fid, *nf;
+  unsigned int n = c->t.nwname;
+  int r;
+
+  fid = p9_fidtab_get(c->t.fid, t);
+  if (!fid)
+    ERR(c, "unknown fid");
+  else if (fid->open_mode != P9_NOTOPEN)
+    ERR(c, "fid is open");
+  else if (c->t.newfid != c->t.fid && p9_fidtab_get(c->t.newfid, t))
+    ERR(c, "fid already in use");
+  else if (n > P9_MAXWELEM || (n && !fs->walk1))
+    ERR(c, "bad walk");
+  if (c->r.ename || (!n && c->t.newfid == c->t.fid))
+    return;
+  pthread_mutex_lock(&t->lock);
+  nf = alloc_fid(t);
+  pthread_mutex_unlock(&t->lock);
+  if (nf) {
+    memcpy(nf, fid, t->size);
+    nf->fid = c->t.newfid;
+  }
+  if (!nf || (fid->clone && fid->clone(nf, fid))) {
+    ERR(c, "out of memory");
+    pthread_mutex_lock(&t->lock);
+    if (nf)
+      free_fid(nf, t);
+    pthread_mutex_unlock(&t->lock);
+    return;
+  }
+  c->t.pfid = nf;
+  for (c->r.nwqid = 0; c->r.nwqid < n && !c->r.ename; ++c->r.nwqid)
+    fs->walk1(c, fs);
+  if (c->r.ename && --c->r.nwqid > 0)
+    c->r.ename = 0;
+  if (c->r.nwqid < n) {
+    release(nf, t);
+    return;
+  }
+  if (n)
+    nf->qid = c->r.wqid[n - 1];
+  pthread_mutex_lock(&t->lock);
+  if (c->t.newfid == c->t.fid)
+    find(fid->fid, t)->f = nf;
+  r = (c->t.newfid != c->t.fid) ? insert(nf, t) : 0;
+  pthread_mutex_unlock(&t->lock);
+  if (r) {
+    ERR(c, "out of memory");
+    release(nf, t);
+  } else if (c->t.newfid == c->t.fid)
+    release(fid, t);
+}
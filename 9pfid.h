@@ -0,0 +1,13 @@
+struct p9_fidtab;
+struct p9_fid;
+struct p9_fs;
+struct p9_connection;
+
+struct p9_fidtab *mk_p9fidtab(int size);
+void rm_p9fidtab(struct p9_fidtab *t);
+
+struct p9_fid *p9_fidtab_get(unsigned int fid, struct p9_fidtab *t);
+struct p9_fid *p9_fidtab_add(unsigned int fid, struct p9_fidtab *t);
+void p9_fidtab_del(struct p9_fid *f, struct p9_fidtab *t);
+void p9_fidtab_walk(struct p9_connection *c, struct p9_fs *fs,
+                    struct p9_fidtab *t);
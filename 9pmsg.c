@@ -1,504 +1,549 @@
+#include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 #include "9p.h"
-
-struct p9_stream {
-  unsigned int off;
-  unsigned int size;
-  unsigned char *buf;
+#include "9pmsg.h"
+
+#define M(f) offsetof(struct p9_msg, f)
+#define W(f) sizeof(((struct p9_msg *)0)->f)
+#define U1(f) {P9_FU1, W(f), M(f), 0, #f}
+#define U2(f) {P9_FU2, W(f), M(f), 0, #f}
+#define U4(f) {P9_FU4, W(f), M(f), 0, #f}
+#define U8(f) {P9_FU8, W(f), M(f), 0, #f}
+#define STR(f) {P9_FSTR, 0, M(f), M(f##_len), #f}
+#define DATA {P9_FDATA, 0, M(data), M(count), "data"}
+#define QID(f) {P9_FQID, 0, M(f), 0, #f}
+#define WNAME {P9_FWNAME, 0, M(wname), M(nwname), "wname"}
+#define WQID {P9_FWQID, 0, M(wqid), M(nwqid), "wqid"}
+#define STAT {P9_FSTAT, 0, M(stat), 0, "stat"}
+#define T(type) [P9_##type - P9_XSTART]
+
+const struct p9_schema p9_schema[P9_XEND - P9_XSTART] = {
+  T(TVERSION) = {"Tversion", {U4(msize), STR(version)}},
+  T(RVERSION) = {"Rversion", {U4(msize), STR(version)}},
+  T(TAUTH) = {"Tauth", {U4(afid), STR(uname), STR(aname)}},
+  T(RAUTH) = {"Rauth", {QID(aqid)}},
+  T(TATTACH) = {"Tattach", {U4(fid), U4(afid), STR(uname), STR(aname)}},
+  T(RATTACH) = {"Rattach", {QID(aqid)}},
+  T(RERROR) = {"Rerror", {STR(ename)}},
+  T(TFLUSH) = {"Tflush", {U2(oldtag)}},
+  T(RFLUSH) = {"Rflush"},
+  T(TWALK) = {"Twalk", {U4(fid), U4(newfid), WNAME}},
+  T(RWALK) = {"Rwalk", {WQID}},
+  T(TOPEN) = {"Topen", {U4(fid), U1(mode)}},
+  T(ROPEN) = {"Ropen", {QID(qid), U4(iounit)}},
+  T(TCREATE) = {"Tcreate", {U4(fid), STR(name), U4(perm), U1(mode)}},
+  T(RCREATE) = {"Rcreate", {QID(qid), U4(iounit)}},
+  T(TREAD) = {"Tread", {U4(fid), U8(offset), U4(count)}},
+  T(RREAD) = {"Rread", {DATA}},
+  T(TWRITE) = {"Twrite", {U4(fid), U8(offset), DATA}},
+  T(RWRITE) = {"Rwrite", {U4(count)}},
+  T(TCLUNK) = {"Tclunk", {U4(fid)}},
+  T(RCLUNK) = {"Rclunk"},
+  T(TREMOVE) = {"Tremove", {U4(fid)}},
+  T(RREMOVE) = {"Rremove"},
+  T(TSTAT) = {"Tstat", {U4(fid)}},
+  T(RSTAT) = {"Rstat", {STAT}},
+  T(TWSTAT) = {"Twstat", {U4(fid), STAT}},
+  T(RWSTAT) = {"Rwstat"},
 };
 
-static void write_uint1(struct p9_stream *s, unsigned char x);
-static void write_uint2(struct p9_stream *s, unsigned short x);
-static void write_uint4(struct p9_stream *s, unsigned int x);
-static void write_uint8(struct p9_stream *s, unsigned long long x);
-static void write_str(struct p9_stream *s, int len, char *x);
-static void write_data(struct p9_stream *s, int len, char *x);
-static void write_qid(struct p9_stream *s, struct p9_qid *qid);
-static void write_stat(struct p9_stream *s, struct p9_stat *stat);
-
-static unsigned char read_uint1(struct p9_stream *s, int *err);
-static unsigned short read_uint2(struct p9_stream *s, int *err);
-static unsigned int read_uint4(struct p9_stream *s, int *err);
-static unsigned long long read_uint8(struct p9_stream *s, int *err);
-static char *read_str(struct p9_stream *s, unsigned int *len, int *err);
-static void read_qid(struct p9_stream *s, struct p9_qid *qid, int *err);
-static char *read_data(struct p9_stream *s, unsigned int *len, int *err);
-static void read_stat(struct p9_stream *s, struct p9_stat *stat, int *err);
+#define MEMBER(m, off, type) (*(type *)((char *)(m) + (off)))
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
 
-int
-p9_unpack_msg(int bytes, char *buf, struct p9_msg *m)
+static const struct p9_schema *
+get_schema(unsigned int type)
 {
-  struct p9_stream s = {0, 0, 0};
-  unsigned int i;
-  int err = 0;
-
-  s.buf = (unsigned char *)buf;
-  s.size = bytes;
-
-  s.size = read_uint4(&s, &err);
-  m->type = read_uint1(&s, &err);
-  m->tag = read_uint2(&s, &err);
-
-  switch (m->type) {
-    case P9_TVERSION:
-    case P9_RVERSION:
-      m->msize = read_uint4(&s, &err);
-      m->version = read_str(&s, &m->version_len, &err);
-      break;
-
-    case P9_TAUTH:
-      m->afid = read_uint4(&s, &err);
-      m->uname = read_str(&s, &m->uname_len, &err);
-      m->aname = read_str(&s, &m->aname_len, &err);
-      break;
-
-    case P9_RAUTH:
-    case P9_RATTACH:
-      read_qid(&s, &m->aqid, &err);
-      break;
-
-    case P9_RERROR:
-      m->ename = read_str(&s, &m->ename_len, &err);
-      break;
-
-    case P9_TFLUSH:
-      m->oldtag = read_uint2(&s, &err);
-      break;
-
-    case P9_RFLUSH:
-    case P9_RCLUNK:
-    case P9_RREMOVE:
-    case P9_RWSTAT:
-      break;
-
-    case P9_TATTACH:
-      m->fid = read_uint4(&s, &err);
-      m->afid = read_uint4(&s, &err);
-      m->uname = read_str(&s, &m->uname_len, &err);
-      m->aname = read_str(&s, &m->aname_len, &err);
-      break;
-
-    case P9_TWALK:
-      m->fid = read_uint4(&s, &err);
-      m->newfid = read_uint4(&s, &err);
-      m->nwname = read_uint2(&s, &err);
-      for (i = 0; i < m->nwname && i < P9_MAXWELEM; ++i)
-        m->wname[i] = read_str(&s, &m->wname_len[i], &err);
-      break;
-
-    case P9_RWALK:
-      m->nwqid = read_uint2(&s, &err);
-      for (i = 0; i < m->nwqid && i < P9_MAXWELEM; ++i)
-        read_qid(&s, &m->wqid[i], &err);
-      break;
-
-    case P9_TOPEN:
-      m->fid = read_uint4(&s, &err);
-      m->mode = read_uint1(&s, &err);
-      break;
-
-    case P9_ROPEN:
-    case P9_RCREATE:
-      read_qid(&s, &m->qid, &err);
-      m->iounit = read_uint4(&s, &err);
-      break;
-
-    case P9_TCREATE:
-      m->fid = read_uint4(&s, &err);
-      m->name = read_str(&s, &m->name_len, &err);
-      m->perm = read_uint4(&s, &err);
-      m->mode = read_uint1(&s, &err);
-      break;
-
-    case P9_TREAD:
-      m->fid = read_uint4(&s, &err);
-      m->offset = read_uint8(&s, &err);
-      m->count = read_uint4(&s, &err);
-      break;
-
-    case P9_RREAD:
-      m->data = read_data(&s, &m->count, &err);
-      break;
-
-    case P9_TWRITE:
-      m->fid = read_uint4(&s, &err);
-      m->offset = read_uint8(&s, &err);
-      m->data = read_data(&s, &m->count, &err);
-      break;
-
-    case P9_RWRITE:
-      m->count = read_uint4(&s, &err);
-      break;
-
-    case P9_TCLUNK:
-    case P9_TREMOVE:
-    case P9_TSTAT:
-      m->fid = read_uint4(&s, &err);
-      break;
-
-    case P9_RSTAT:
-      i = read_uint2(&s, &err);
-      read_stat(&s, &m->stat, &err);
-      break;
-
-    case P9_TWSTAT:
-      m->fid = read_uint4(&s, &err);
-      i = read_uint2(&s, &err);
-      read_stat(&s, &m->stat, &err);
-      break;
-    default: err = -1;
-  }
-  return err;
+  if (type < P9_XSTART || type >= P9_XEND || !p9_schema[type - P9_XSTART].name)
+    return 0;
+  return &p9_schema[type - P9_XSTART];
 }
 
-int
-p9_pack_msg(int bytes, char *buf, struct p9_msg *m)
+/* Integers are moved with unaligned loads and stores, swapped only on
+ * big-endian hosts. */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define LE16(x) __builtin_bswap16(x)
+#define LE32(x) __builtin_bswap32(x)
+#define LE64(x) __builtin_bswap64(x)
+#else
+#define LE16(x) (x)
+#define LE32(x) (x)
+#define LE64(x) (x)
+#endif
+
+static inline unsigned char *
+put2(unsigned char *p, unsigned int x)
 {
-  struct p9_stream s = {4, 0, 0};
-  unsigned int size, i;
+  uint16_t v = LE16((uint16_t)x);
 
-  if (bytes < 7)
-    return -1;
-
-  s.buf = (unsigned char *)buf;
-  s.size = bytes;
-
-  write_uint1(&s, m->type);
-  write_uint2(&s, m->tag);
-  switch (m->type) {
-    case P9_TVERSION:
-    case P9_RVERSION:
-      if (s.off + 4 + 2 + m->version_len >= s.size)
-        return -1;
-      write_uint4(&s, m->msize);
-      write_str(&s, m->version_len, m->version);
-      break;
-
-    case P9_TAUTH:
-      if (s.off + 4 + 2 + m->uname_len + 2 + m->aname_len >= s.size)
-        return -1;
-      write_uint4(&s, m->afid);
-      write_str(&s, m->uname_len, m->uname);
-      write_str(&s, m->aname_len, m->aname);
-      break;
-
-    case P9_RAUTH:
-    case P9_RATTACH:
-      if (s.off + 13 >= s.size)
-        return -1;
-      write_qid(&s, &m->aqid);
-      break;
-
-    case P9_RERROR:
-      if (s.off + 2 + m->ename_len >= s.size)
-        return -1;
-      write_str(&s, m->ename_len, m->ename);
-      break;
-
-    case P9_TFLUSH:
-      if (s.off + 2 >= s.size)
-        return -1;
-      write_uint2(&s, m->oldtag);
-      break;
-
-    case P9_RFLUSH:
-    case P9_RCLUNK:
-    case P9_RREMOVE:
-    case P9_RWSTAT:
-      break;
-
-    case P9_TATTACH:
-      if (s.off + 4 + 4 + 2 + m->uname_len + 2 + m->aname_len >= s.size)
-        return -1;
-      write_uint4(&s, m->fid);
-      write_uint4(&s, m->afid);
-      write_str(&s, m->uname_len, m->uname);
-      write_str(&s, m->aname_len, m->aname);
-      break;
-
-    case P9_TWALK:
-      size = s.off + 4 + 4 + 2;
-      for (i = 0; i < m->nwname && i < P9_MAXWELEM; ++i)
-        size += 2 + m->wname_len[i];
-      if (size >= s.size)
-        return -1;
-      write_uint4(&s, m->fid);
-      write_uint4(&s, m->newfid);
-      write_uint2(&s, m->nwname);
-      for (i = 0; i < m->nwname && i < P9_MAXWELEM; ++i)
-        write_str(&s, m->wname_len[i], m->wname[i]);
-      break;
+  memcpy(p, &v, 2);
+  return p + 2;
+}
 
-    case P9_RWALK:
-      if (s.off + 2 + 13 * m->nwqid >= s.size)
-        return -1;
-      write_uint2(&s, m->nwqid);
-      for (i = 0; i < m->nwqid && i < P9_MAXWELEM; ++i)
-        write_qid(&s, &m->wqid[i]);
-      break;
+static inline unsigned char *
+put4(unsigned char *p, unsigned int x)
+{
+  uint32_t v = LE32((uint32_t)x);
 
-    case P9_TOPEN:
-      if (s.off + 4 + 1 >= s.size)
-        return -1;
-      write_uint4(&s, m->fid);
-      write_uint1(&s, m->mode);
-      break;
+  memcpy(p, &v, 4);
+  return p + 4;
+}
 
-    case P9_ROPEN:
-    case P9_RCREATE:
-      if (s.off + 13 + 4 >= s.size)
-        return -1;
-      write_qid(&s, &m->qid);
-      write_uint4(&s, m->iounit);
-      break;
+static inline unsigned char *
+put8(unsigned char *p, unsigned long long x)
+{
+  uint64_t v = LE64((uint64_t)x);
 
-    case P9_TCREATE:
-      if (s.off + 4 + 2 + m->name_len + 4 + 1 >= s.size)
-        return -1;
-      write_uint4(&s, m->fid);
-      write_str(&s, m->name_len, m->name);
-      write_uint4(&s, m->perm);
-      write_uint1(&s, m->mode);
-      break;
+  memcpy(p, &v, 8);
+  return p + 8;
+}
 
-    case P9_TREAD:
-      if (s.off + 4 + 8 + 4 >= s.size)
-        return -1;
-      write_uint4(&s, m->fid);
-      write_uint8(&s, m->offset);
-      write_uint4(&s, m->count);
-      break;
+static inline unsigned char *
+put_bytes(unsigned char *p, unsigned int len, const char *x)
+{
+  if (len)
+    memcpy(p, x, len);
+  return p + len;
+}
 
-    case P9_RREAD:
-      if (s.off + 4 + m->count >= s.size)
-        return -1;
-      write_data(&s, m->count, m->data);
-      break;
+static inline unsigned char *
+put_str(unsigned char *p, unsigned int len, const char *x)
+{
+  return put_bytes(put2(p, len), len, x);
+}
 
-    case P9_TWRITE:
-      if (s.off + 4 + 8 + m->count >= s.size)
-        return -1;
-      write_uint4(&s, m->fid);
-      write_uint8(&s, m->offset);
-      write_data(&s, m->count, m->data);
-      break;
+static inline unsigned char *
+put_qid(unsigned char *p, struct p9_qid *qid)
+{
+  *p = qid->type;
+  put4(p + 1, qid->version);
+  return put8(p + 5, qid->path);
+}
 
-    case P9_RWRITE:
-      if (s.off + 4 >= s.size)
-        return -1;
-      write_uint4(&s, m->count);
-      break;
+static inline unsigned char *
+put_hdr(unsigned char *p, unsigned int size, struct p9_msg *m)
+{
+  put4(p, size);
+  p[4] = m->type;
+  return put2(p + 5, m->tag);
+}
 
-    case P9_TCLUNK:
-    case P9_TREMOVE:
-    case P9_TSTAT:
-      if (s.off + 4 >= s.size)
-        return -1;
-      write_uint4(&s, m->fid);
-      break;
+static inline unsigned int
+get2(const unsigned char *p)
+{
+  uint16_t v;
 
-    case P9_RSTAT:
-      m->stat.size = p9_stat_size(&m->stat);
-      if (s.off + 2 + 2 + m->stat.size >= s.size)
-        return -1;
-      write_uint2(&s, m->stat.size + 2);
-      write_stat(&s, &m->stat);
-      break;
+  memcpy(&v, p, 2);
+  return LE16(v);
+}
 
-    case P9_TWSTAT:
-      m->stat.size = p9_stat_size(&m->stat);
-      if (s.off + 4 + 2 + 2 + m->stat.size >= s.size)
-        return -1;
-      write_uint4(&s, m->fid);
-      write_uint2(&s, m->stat.size + 2);
-      write_stat(&s, &m->stat);
-      break;
+static inline unsigned int
+get4(const unsigned char *p)
+{
+  uint32_t v;
 
-    default: return -1;
-  }
-  s.buf[0] = s.off & 0xff;
-  s.buf[1] = (s.off >> 8) & 0xff;
-  s.buf[2] = (s.off >> 16) & 0xff;
-  s.buf[3] = (s.off >> 24) & 0xff;
-  return 0;
+  memcpy(&v, p, 4);
+  return LE32(v);
 }
 
-static void
-write_uint1(struct p9_stream *s, unsigned char x)
+static inline unsigned long long
+get8(const unsigned char *p)
 {
-  s->buf[s->off++] = x;
+  uint64_t v;
+
+  memcpy(&v, p, 8);
+  return LE64(v);
 }
 
-static void
-write_uint2(struct p9_stream *s, unsigned short x)
+static inline void
+get_qid(const unsigned char *p, struct p9_qid *qid)
 {
-  unsigned char *buf = s->buf;
-  unsigned int off = s->off;
-  buf[off] = x & 0xff;
-  buf[off + 1] = (x >> 8) & 0xff;
-  s->off = off + 2;
+  qid->type = p[0];
+  qid->version = get4(p + 1);
+  qid->path = get8(p + 5);
 }
 
-static void
-write_uint4(struct p9_stream *s, unsigned int x)
+/* A string of length 0 unpacks as a null pointer. */
+static inline const unsigned char *
+get_str(const unsigned char *p, const unsigned char *end, char **x,
+        unsigned int *len)
 {
-  unsigned char *buf = s->buf;
-  unsigned int off = s->off;
-  buf[off] = x & 0xff;
-  buf[off + 1] = (x >> 8) & 0xff;
-  buf[off + 2] = (x >> 16) & 0xff;
-  buf[off + 3] = (x >> 24) & 0xff;
-  s->off = off + 4;
+  if (end - p < 2)
+    return 0;
+  *len = get2(p);
+  p += 2;
+  if (end - p < *len)
+    return 0;
+  *x = (*len) ? (char *)p : 0;
+  return p + *len;
 }
 
-static void
-write_uint8(struct p9_stream *s, unsigned long long x)
+static unsigned long long
+field_size(struct p9_msg *m, const struct p9_field *f)
 {
-  unsigned char *buf = s->buf;
-  unsigned int off = s->off;
-  buf[off] = x & 0xff;
-  buf[off + 1] = (x >> 8) & 0xff;
-  buf[off + 2] = (x >> 16) & 0xff;
-  buf[off + 3] = (x >> 24) & 0xff;
-  buf[off + 4] = (x >> 32) & 0xff;
-  buf[off + 5] = (x >> 40) & 0xff;
-  buf[off + 6] = (x >> 48) & 0xff;
-  buf[off + 7] = (x >> 56) & 0xff;
-  s->off = off + 8;
+  unsigned long long size;
+  unsigned int i, n;
+
+  switch (f->kind) {
+  case P9_FU1: return 1;
+  case P9_FU2: return 2;
+  case P9_FU4: return 4;
+  case P9_FU8: return 8;
+  case P9_FSTR: return 2 + MEMBER(m, f->lenoff, unsigned int);
+  case P9_FDATA: return 4 + (unsigned long long)m->count;
+  case P9_FQID: return 13;
+  case P9_FWNAME:
+    n = MIN(m->nwname, P9_MAXWELEM);
+    for (size = 2, i = 0; i < n; ++i)
+      size += 2 + m->wname_len[i];
+    return size;
+  case P9_FWQID: return 2 + 13 * MIN(m->nwqid, P9_MAXWELEM);
+  case P9_FSTAT: return 2 + 2 + m->stat.size;
+  }
+  return 0;
 }
 
-static void
-write_str(struct p9_stream *s, int len, char *x)
+/* The exact packed size of m.  Sets stat.size. */
+static unsigned long long
+msg_size(struct p9_msg *m, const struct p9_schema *sc)
 {
-  write_uint2(s, len);
-  memcpy(s->buf + s->off, x, len);
-  s->off += len;
+  const struct p9_field *f;
+  unsigned long long size = 7;
+
+  if (m->type == P9_RSTAT || m->type == P9_TWSTAT)
+    m->stat.size = p9_stat_size(&m->stat);
+  for (f = sc->f; f->kind; ++f)
+    size += field_size(m, f);
+  return size;
 }
 
-static void
-write_data(struct p9_stream *s, int len, char *x)
+static unsigned long long
+get_member(struct p9_msg *m, const struct p9_field *f)
 {
-  write_uint4(s, len);
-  memcpy(s->buf + s->off, x, len);
-  s->off += len;
+  switch (f->width) {
+  case 2: return MEMBER(m, f->off, unsigned short);
+  case 4: return MEMBER(m, f->off, unsigned int);
+  }
+  return MEMBER(m, f->off, unsigned long long);
 }
 
 static void
-write_qid(struct p9_stream *s, struct p9_qid *qid)
+set_member(struct p9_msg *m, const struct p9_field *f, unsigned long long x)
 {
-  write_uint1(s, qid->type);
-  write_uint4(s, qid->version);
-  write_uint8(s, qid->path);
+  switch (f->width) {
+  case 2: MEMBER(m, f->off, unsigned short) = x; break;
+  case 4: MEMBER(m, f->off, unsigned int) = x; break;
+  default: MEMBER(m, f->off, unsigned long long) = x;
+  }
 }
 
-static void
-write_stat(struct p9_stream *s, struct p9_stat *stat)
+static unsigned char *
+put_stat(unsigned char *p, struct p9_stat *stat)
 {
-  p9_pack_stat(s->size - s->off, (char *)s->buf + s->off, stat);
-  s->off += stat->size + 2;
+  p = put2(p, stat->size);
+  p = put2(p, stat->type);
+  p = put4(p, stat->dev);
+  p = put_qid(p, &stat->qid);
+  p = put4(p, stat->mode);
+  p = put4(p, stat->atime);
+  p = put4(p, stat->mtime);
+  p = put8(p, stat->length);
+  p = put_str(p, stat->name_len, stat->name);
+  p = put_str(p, stat->uid_len, stat->uid);
+  p = put_str(p, stat->gid_len, stat->gid);
+  return put_str(p, stat->muid_len, stat->muid);
 }
 
-static unsigned char
-read_uint1(struct p9_stream *s, int *err)
+static unsigned char *
+pack_field(unsigned char *p, struct p9_msg *m, const struct p9_field *f)
 {
-  if (*err |= s->off + 1 > s->size)
-    return 0;
-  return s->buf[s->off++];
+  unsigned int i, n;
+
+  switch (f->kind) {
+  case P9_FU1:
+    *p = get_member(m, f);
+    return p + 1;
+  case P9_FU2: return put2(p, get_member(m, f));
+  case P9_FU4: return put4(p, get_member(m, f));
+  case P9_FU8: return put8(p, get_member(m, f));
+  case P9_FSTR:
+    return put_str(p, MEMBER(m, f->lenoff, unsigned int),
+                   MEMBER(m, f->off, char *));
+  case P9_FDATA: return put_bytes(put4(p, m->count), m->count, m->data);
+  case P9_FQID: return put_qid(p, &MEMBER(m, f->off, struct p9_qid));
+  case P9_FWNAME:
+    n = MIN(m->nwname, P9_MAXWELEM);
+    for (p = put2(p, n), i = 0; i < n; ++i)
+      p = put_str(p, m->wname_len[i], m->wname[i]);
+    return p;
+  case P9_FWQID:
+    n = MIN(m->nwqid, P9_MAXWELEM);
+    for (p = put2(p, n), i = 0; i < n; ++i)
+      p = put_qid(p, &m->wqid[i]);
+    return p;
+  case P9_FSTAT: return put_stat(put2(p, m->stat.size + 2), &m->stat);
+  }
+  return p;
 }
 
-static unsigned short
-read_uint2(struct p9_stream *s, int *err)
+static const unsigned char *
+unpack_field(const unsigned char *p, const unsigned char *end,
+             struct p9_msg *m, const struct p9_field *f)
 {
-  unsigned short x;
-  unsigned int off = s->off;
-  unsigned char *buf = s->buf;
-
-  if (*err |= (off + 2 > s->size))
-    return 0;
-  x = buf[off] | (buf[off + 1] << 8);
-  s->off += 2;
-  return x;
+  unsigned int i, n;
+
+  switch (f->kind) {
+  case P9_FU1:
+    if (end - p < 1)
+      return 0;
+    set_member(m, f, *p);
+    return p + 1;
+  case P9_FU2:
+    if (end - p < 2)
+      return 0;
+    set_member(m, f, get2(p));
+    return p + 2;
+  case P9_FU4:
+    if (end - p < 4)
+      return 0;
+    set_member(m, f, get4(p));
+    return p + 4;
+  case P9_FU8:
+    if (end - p < 8)
+      return 0;
+    set_member(m, f, get8(p));
+    return p + 8;
+  case P9_FSTR:
+    return get_str(p, end, &MEMBER(m, f->off, char *),
+                   &MEMBER(m, f->lenoff, unsigned int));
+  case P9_FDATA:
+    if (end - p < 4 || end - p - 4 < get4(p))
+      return 0;
+    m->count = get4(p);
+    m->data = (char *)p + 4;
+    return p + 4 + m->count;
+  case P9_FQID:
+    if (end - p < 13)
+      return 0;
+    get_qid(p, &MEMBER(m, f->off, struct p9_qid));
+    return p + 13;
+  case P9_FWNAME:
+    if (end - p < 2)
+      return 0;
+    m->nwname = get2(p);
+    n = MIN(m->nwname, P9_MAXWELEM);
+    for (p += 2, i = 0; i < n && p; ++i)
+      p = get_str(p, end, &m->wname[i], &m->wname_len[i]);
+    return p;
+  case P9_FWQID:
+    if (end - p < 2)
+      return 0;
+    m->nwqid = get2(p);
+    n = MIN(m->nwqid, P9_MAXWELEM);
+    if (end - p - 2 < 13 * n)
+      return 0;
+    for (p += 2, i = 0; i < n; ++i, p += 13)
+      get_qid(p, &m->wqid[i]);
+    return p;
+  case P9_FSTAT:
+    if (end - p < 2
+        || p9_unpack_stat(end - p - 2, (char *)p + 2, &m->stat))
+      return 0;
+    return end;
+  }
+  return p;
 }
 
-static unsigned int
-read_uint4(struct p9_stream *s, int *err)
+/* Hand-written layouts of the messages that carry the bulk of the
+ * traffic.  Returns the size, 0 if m is not one of them or -1 if it does
+ * not fit into bytes. */
+static inline long long
+pack_fast(unsigned long long bytes, unsigned char *p, struct p9_msg *m)
 {
-  unsigned int x, off = s->off;
-  unsigned char *buf = s->buf;
-
-  if (*err |= (off + 4 > s->size))
-    return 0;
+  unsigned long long size;
+  unsigned int i, n;
+  unsigned char *q;
 
-  x = (buf[off] | (buf[off + 1] << 8) | (buf[off + 2] << 16)
-       | (buf[off + 3] << 24));
-  s->off += 4;
-  return x;
+  switch (m->type) {
+  case P9_TREAD:
+    if (bytes < 23)
+      return -1;
+    put4(put8(put4(put_hdr(p, 23, m), m->fid), m->offset), m->count);
+    return 23;
+  case P9_RREAD:
+    size = 11 + (unsigned long long)m->count;
+    if (size > bytes)
+      return -1;
+    put_bytes(put4(put_hdr(p, size, m), m->count), m->count, m->data);
+    return size;
+  case P9_TWRITE:
+    size = 23 + (unsigned long long)m->count;
+    if (size > bytes)
+      return -1;
+    q = put8(put4(put_hdr(p, size, m), m->fid), m->offset);
+    put_bytes(put4(q, m->count), m->count, m->data);
+    return size;
+  case P9_RWRITE:
+    if (bytes < 11)
+      return -1;
+    put4(put_hdr(p, 11, m), m->count);
+    return 11;
+  case P9_TWALK:
+    n = MIN(m->nwname, P9_MAXWELEM);
+    for (size = 17, i = 0; i < n; ++i)
+      size += 2 + m->wname_len[i];
+    if (size > bytes)
+      return -1;
+    q = put2(put4(put4(put_hdr(p, size, m), m->fid), m->newfid), n);
+    for (i = 0; i < n; ++i)
+      q = put_str(q, m->wname_len[i], m->wname[i]);
+    return size;
+  case P9_RWALK:
+    n = MIN(m->nwqid, P9_MAXWELEM);
+    size = 9 + 13 * n;
+    if (size > bytes)
+      return -1;
+    q = put2(put_hdr(p, size, m), n);
+    for (i = 0; i < n; ++i)
+      q = put_qid(q, &m->wqid[i]);
+    return size;
+  }
+  return 0;
 }
 
-static unsigned long long
-read_uint8(struct p9_stream *s, int *err)
+/* Returns 1 if m is not one of the fast types, else 0 or -1. */
+static inline int
+unpack_fast(const unsigned char *p, const unsigned char *end, struct p9_msg *m)
 {
-  unsigned long long x;
+  unsigned int i, n;
 
-  if (*err |= (s->off + 8 > s->size))
+  switch (m->type) {
+  case P9_TREAD:
+    if (end - p < 16)
+      return -1;
+    m->fid = get4(p);
+    m->offset = get8(p + 4);
+    m->count = get4(p + 12);
     return 0;
-
-  x = read_uint4(s, err);
-  if (*err)
+  case P9_RREAD:
+    if (end - p < 4 || end - p - 4 < get4(p))
+      return -1;
+    m->count = get4(p);
+    m->data = (char *)p + 4;
+    return 0;
+  case P9_TWRITE:
+    if (end - p < 16 || end - p - 16 < get4(p + 12))
+      return -1;
+    m->fid = get4(p);
+    m->offset = get8(p + 4);
+    m->count = get4(p + 12);
+    m->data = (char *)p + 16;
+    return 0;
+  case P9_RWRITE:
+    if (end - p < 4)
+      return -1;
+    m->count = get4(p);
+    return 0;
+  case P9_TWALK:
+    if (end - p < 10)
+      return -1;
+    m->fid = get4(p);
+    m->newfid = get4(p + 4);
+    m->nwname = get2(p + 8);
+    n = MIN(m->nwname, P9_MAXWELEM);
+    for (p += 10, i = 0; i < n; ++i)
+      if (!(p = get_str(p, end, &m->wname[i], &m->wname_len[i])))
+        return -1;
+    return 0;
+  case P9_RWALK:
+    if (end - p < 2)
+      return -1;
+    m->nwqid = get2(p);
+    n = MIN(m->nwqid, P9_MAXWELEM);
+    if (end - p - 2 < 13 * n)
+      return -1;
+    for (p += 2, i = 0; i < n; ++i, p += 13)
+      get_qid(p, &m->wqid[i]);
     return 0;
-  x |= ((unsigned long long)read_uint4(s, err)) << 32;
-  return x;
+  }
+  return 1;
 }
 
-static char *
-read_str(struct p9_stream *s, unsigned int *len, int *err)
+int
+p9_unpack_msg(int bytes, char *buf, struct p9_msg *m)
 {
-  char *x;
-
-  if (*err |= (s->off + 2 > s->size))
-    return 0;
+  const unsigned char *p = (unsigned char *)buf, *end;
+  const struct p9_schema *sc;
+  const struct p9_field *f;
+  int r;
 
-  *len = read_uint2(s, err);
-  if (*err |= (s->off + *len > s->size))
-    return 0;
-  if (!*len)
-    return 0;
-  x = (char *)s->buf + s->off;
-  s->off += *len;
-  return x;
+  if (bytes < 7 || (m->size = get4(p)) < 7 || m->size > (unsigned int)bytes)
+    return -1;
+  m->type = p[4];
+  m->tag = get2(p + 5);
+  end = p + m->size;
+  p += 7;
+  if ((r = unpack_fast(p, end, m)) <= 0)
+    return r;
+  if (!(sc = get_schema(m->type)))
+    return -1;
+  for (f = sc->f; f->kind && p; ++f)
+    p = unpack_field(p, end, m, f);
+  return (p) ? 0 : -1;
 }
 
 static void
-read_qid(struct p9_stream *s, struct p9_qid *qid, int *err)
+pack_schema(unsigned int size, unsigned char *p, struct p9_msg *m,
+            const struct p9_schema *sc)
 {
-  if (*err |= (s->off + 13 > s->size))
-    return;
-  qid->type = read_uint1(s, err);
-  qid->version = read_uint4(s, err);
-  qid->path = read_uint8(s, err);
+  const struct p9_field *f;
+
+  p = put_hdr(p, size, m);
+  for (f = sc->f; f->kind; ++f)
+    p = pack_field(p, m, f);
 }
 
-static char *
-read_data(struct p9_stream *s, unsigned int *len, int *err)
+int
+p9_pack_msg(int bytes, char *buf, struct p9_msg *m)
 {
-  char *x;
+  const struct p9_schema *sc;
+  unsigned long long size;
+  long long r;
 
-  if (*err |= (s->off + 4 > s->size))
-    return 0;
+  if (bytes < 7)
+    return -1;
+  if ((r = pack_fast(bytes, (unsigned char *)buf, m)))
+    return (r < 0) ? -1 : 0;
+  if (!(sc = get_schema(m->type)))
+    return -1;
+  size = msg_size(m, sc);
+  if (size > (unsigned int)bytes)
+    return -1;
+  pack_schema(size, (unsigned char *)buf, m, sc);
+  return 0;
+}
+
+/* The exact number of bytes m packs into, 0 for an unknown type or a
+ * message too big for the size field. */
+unsigned int
+p9_msg_size(struct p9_msg *m)
+{
+  const struct p9_schema *sc;
+  unsigned long long size;
 
-  *len = read_uint4(s, err);
-  if (*err |= (s->off + *len > s->size))
+  if (!(sc = get_schema(m->type)))
     return 0;
-  x = (char *)s->buf + s->off;
-  s->off += *len;
-  return x;
+  size = msg_size(m, sc);
+  return (size > 0xffffffff) ? 0 : size;
 }
 
-static void
-read_stat(struct p9_stream *s, struct p9_stat *stat, int *err)
+/* Packs m into the size bytes returned by p9_msg_size, without checking
+ * the space again. */
+void
+p9_pack_msg_sized(unsigned int size, char *buf, struct p9_msg *m)
 {
-  *err |= p9_unpack_stat(s->size - s->off, (char *)s->buf + s->off, stat);
-  s->off += s->size;
+  if (!pack_fast(size, (unsigned char *)buf, m))
+    pack_schema(size, (unsigned char *)buf, m, get_schema(m->type));
 }
 
 int
@@ -511,51 +556,185 @@ p9_stat_size(struct p9_stat *stat)
 int
 p9_pack_stat(int bytes, char *buf, struct p9_stat *stat)
 {
-  struct p9_stream s = { 0, 0, 0 };
-
-  s.size = bytes;
-  s.buf = (unsigned char *)buf;
-
-  if (s.off + 2 + stat->size >= s.size)
+  if (bytes < 0 || 2 + stat->size > bytes)
     return 1;
-
-  write_uint2(&s, stat->size);
-  write_uint2(&s, stat->type);
-  write_uint4(&s, stat->dev);
-  write_qid(&s, &stat->qid);
-  write_uint4(&s, stat->mode);
-  write_uint4(&s, stat->atime);
-  write_uint4(&s, stat->mtime);
-  write_uint8(&s, stat->length);
-  write_str(&s, stat->name_len, stat->name);
-  write_str(&s, stat->uid_len, stat->uid);
-  write_str(&s, stat->gid_len, stat->gid);
-  write_str(&s, stat->muid_len, stat->muid);
+  put_stat((unsigned char *)buf, stat);
   return 0;
 }
 
 int
 p9_unpack_stat(int bytes, char *buf, struct p9_stat *stat)
 {
-  struct p9_stream s = {0, 0, 0};
-  int err = 0;
-
-  s.size = bytes;
-  s.buf = (unsigned char *)buf;
-
-  stat->size = read_uint2(&s, &err);
-  stat->type = read_uint2(&s, &err);
-  stat->dev = read_uint4(&s, &err);
-  read_qid(&s, &stat->qid, &err);
-  stat->mode = read_uint4(&s, &err);
-  stat->atime = read_uint4(&s, &err);
-  stat->mtime = read_uint4(&s, &err);
-  stat->length = read_uint8(&s, &err);
-  stat->name = read_str(&s, &stat->name_len, &err);
-  stat->uid = read_str(&s, &stat->uid_len, &err);
-  stat->gid = read_str(&s, &stat->gid_len, &err);
-  stat->muid = read_str(&s, &stat->muid_len, &err);
-  return err;
+  const unsigned char *p = (unsigned char *)buf, *end = p + bytes;
+
+  if (bytes < 41 || get2(p) + 2 < 41)
+    return -1;
+  if (get2(p) + 2 < bytes)
+    end = p + 2 + get2(p);
+  stat->size = get2(p);
+  stat->type = get2(p + 2);
+  stat->dev = get4(p + 4);
+  get_qid(p + 8, &stat->qid);
+  stat->mode = get4(p + 21);
+  stat->atime = get4(p + 25);
+  stat->mtime = get4(p + 29);
+  stat->length = get8(p + 33);
+  p = get_str(p + 41, end, &stat->name, &stat->name_len);
+  if (p)
+    p = get_str(p, end, &stat->uid, &stat->uid_len);
+  if (p)
+    p = get_str(p, end, &stat->gid, &stat->gid_len);
+  if (p)
+    p = get_str(p, end, &stat->muid, &stat->muid_len);
+  return (p) ? 0 : -1;
+}
+
+static const unsigned char *
+unpack_cfield(const unsigned char *p, const unsigned char *end,
+              union p9_cfield *x, const struct p9_field *f)
+{
+  unsigned int i, n;
+
+  switch (f->kind) {
+  case P9_FU1:
+    if (end - p < 1)
+      return 0;
+    x->n = *p;
+    return p + 1;
+  case P9_FU2:
+    if (end - p < 2)
+      return 0;
+    x->n = get2(p);
+    return p + 2;
+  case P9_FU4:
+    if (end - p < 4)
+      return 0;
+    x->n = get4(p);
+    return p + 4;
+  case P9_FU8:
+    if (end - p < 8)
+      return 0;
+    x->n = get8(p);
+    return p + 8;
+  case P9_FSTR: return get_str(p, end, &x->str.s, &x->str.len);
+  case P9_FDATA:
+    if (end - p < 4 || end - p - 4 < get4(p))
+      return 0;
+    x->str.len = get4(p);
+    x->str.s = (char *)p + 4;
+    return p + 4 + x->str.len;
+  case P9_FQID:
+    if (end - p < 13)
+      return 0;
+    get_qid(p, &x->qid);
+    return p + 13;
+  case P9_FWNAME:
+    if (end - p < 2)
+      return 0;
+    x->str.len = get2(p);
+    x->str.s = (char *)p + 2;
+    n = MIN(x->str.len, P9_MAXWELEM);
+    for (p += 2, i = 0; i < n && p; ++i)
+      if (end - p < 2 || end - p - 2 < get2(p))
+        p = 0;
+      else
+        p += 2 + get2(p);
+    return p;
+  case P9_FWQID:
+    if (end - p < 2)
+      return 0;
+    x->str.len = get2(p);
+    x->str.s = (char *)p + 2;
+    n = MIN(x->str.len, P9_MAXWELEM);
+    if (end - p - 2 < 13 * n)
+      return 0;
+    return p + 2 + 13 * n;
+  case P9_FSTAT:
+    if (end - p < 2)
+      return 0;
+    x->str.len = end - p - 2;
+    x->str.s = (char *)p + 2;
+    return end;
+  }
+  return p;
+}
+
+int
+p9_unpack_cmsg(int bytes, char *buf, struct p9_cmsg *m)
+{
+  const unsigned char *p = (unsigned char *)buf, *end;
+  const struct p9_schema *sc;
+  const struct p9_field *f;
+  union p9_cfield *x;
+
+  if (bytes < 7 || (m->size = get4(p)) < 7 || m->size > (unsigned int)bytes)
+    return -1;
+  m->type = p[4];
+  m->tag = get2(p + 5);
+  if (!(sc = get_schema(m->type)))
+    return -1;
+  end = p + m->size;
+  p += 7;
+  for (f = sc->f, x = m->f; f->kind && p; ++f, ++x)
+    p = unpack_cfield(p, end, x, f);
+  return (p) ? 0 : -1;
+}
+
+/* The arrays were checked by p9_unpack_cmsg, only stat is decoded here. */
+int
+p9_cmsg_to_msg(struct p9_cmsg *cm, struct p9_msg *m)
+{
+  const struct p9_schema *sc;
+  const struct p9_field *f;
+  union p9_cfield *x;
+  const unsigned char *p;
+  unsigned int i, n;
+
+  if (!(sc = get_schema(cm->type)))
+    return -1;
+  m->size = cm->size;
+  m->type = cm->type;
+  m->tag = cm->tag;
+  for (f = sc->f, x = cm->f; f->kind; ++f, ++x)
+    switch (f->kind) {
+    case P9_FU1:
+    case P9_FU2:
+    case P9_FU4:
+    case P9_FU8:
+      set_member(m, f, x->n);
+      break;
+    case P9_FSTR:
+      MEMBER(m, f->off, char *) = x->str.s;
+      MEMBER(m, f->lenoff, unsigned int) = x->str.len;
+      break;
+    case P9_FDATA:
+      m->data = x->str.s;
+      m->count = x->str.len;
+      break;
+    case P9_FQID:
+      MEMBER(m, f->off, struct p9_qid) = x->qid;
+      break;
+    case P9_FWNAME:
+      m->nwname = x->str.len;
+      n = MIN(m->nwname, P9_MAXWELEM);
+      for (p = (unsigned char *)x->str.s, i = 0; i < n; ++i) {
+        m->wname_len[i] = get2(p);
+        m->wname[i] = (m->wname_len[i]) ? (char *)p + 2 : 0;
+        p += 2 + m->wname_len[i];
+      }
+      break;
+    case P9_FWQID:
+      m->nwqid = x->str.len;
+      n = MIN(m->nwqid, P9_MAXWELEM);
+      for (p = (unsigned char *)x->str.s, i = 0; i < n; ++i, p += 13)
+        get_qid(p, &m->wqid[i]);
+      break;
+    case P9_FSTAT:
+      if (p9_unpack_stat(x->str.len, x->str.s, &m->stat))
+        return -1;
+      break;
+    }
+  return 0;
 }
 
 int
@@ -0,0 +1,31 @@
+/* Wire layout of every message type after size[4] type[1] tag[2], shared
+ * by the codec and the printer. */
+
+enum {
+  P9_FEND,
+  P9_FU1,
+  P9_FU2,
+  P9_FU4,
+  P9_FU8,
+  P9_FSTR,    /* len[2] bytes, length at lenoff */
+  P9_FDATA,   /* count[4] bytes */
+  P9_FQID,
+  P9_FWNAME,  /* nwname[2] nwname * str */
+  P9_FWQID,   /* nwqid[2] nwqid * qid */
+  P9_FSTAT    /* n[2] stat[n] */
+};
+
+struct p9_field {
+  unsigned char kind;
+  unsigned char width;
+  unsigned short off;
+  unsigned short lenoff;
+  const char *name;
+};
+
+struct p9_schema {
+  const char *name;
+  struct p9_field f[5];
+};
+
+extern const struct p9_schema p9_schema[P9_XEND - P9_XSTART];
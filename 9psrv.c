@@ -0,0 +1,1349 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+
+#include "9p.h"
+#include "9psrv.h"
+#include "9ptrace.h"
+#include "util.h"
+
+#define MSIZE 65536
+#define MINMSIZE 256
+#define MAXLISTEN 16
+#define MAXEVENTS 256
+
+#define TYPEBIT(type) (1u << (((type) - P9_XSTART) >> 1))
+
+enum {
+  FD_LISTEN,
+  FD_CONN,
+  FD_WAKE
+};
+
+struct p9_srvfd {
+  int kind;
+  int fd;
+};
+
+struct p9_srvconn;
+struct p9_srvreq;
+
+/* What p9_fs callbacks get as struct p9_connection: either the state of
+ * the connection itself (inline requests) or of a single request. */
+struct p9_srvctx {
+  struct p9_connection c;
+  struct p9_srvconn *sc;
+  struct p9_srvreq *req;
+  int sendfd;
+  unsigned long long sendoff;
+};
+
+/* Data of an Rread that goes from a file straight to the socket once the
+ * output buffer is sent up to pos. */
+struct p9_srvfile {
+  int fd;
+  int pos;
+  unsigned long long off;
+  unsigned int count;
+  struct p9_srvfile *next;
+};
+
+/* A request that outlives its place in the input buffer: executed by the
+ * thread pool, deferred by the backend, parked behind a conflicting one
+ * or a Tflush waiting for one of those.  It carries its own copy of the
+ * message in compact form.  The full state is the worker's while executed
+ * and ctx while deferred. */
+struct p9_srvreq {
+  struct p9_cmsg t;
+  struct p9_srvconn *sc;
+  struct p9_srvctx *ctx;
+  void *flushed;
+  int sendfd;
+  unsigned int sendcount;
+  unsigned long long sendoff;
+  unsigned char *tbuf;
+  int tcap;
+  unsigned char *rbuf;
+  int rcap;
+  int rsize;
+  int deferred;
+  struct p9_srvreq *flushes;
+  struct p9_srvreq *next;
+  struct p9_srvreq *link;
+};
+
+struct p9_srvconn {
+  struct p9_srvfd fd;
+  struct p9_srvctx ctx;
+  unsigned char *inbuf;
+  int insize;
+  int inoff;
+  int inmax;
+  unsigned char *outbuf;
+  int outsize;
+  int outoff;
+  int outmax;
+  int events;
+  int dead;
+  int failed;
+  int nout;
+  unsigned char *tmsg;
+  struct p9_srvreq *out;
+  struct p9_srvreq *parked;
+  struct p9_srvreq **parked_tail;
+  struct p9_srvfile *files;
+  struct p9_srvfile **files_tail;
+  struct p9_srvconn *dirty;
+  struct p9_srv *srv;
+  struct p9_srvconn *prev;
+  struct p9_srvconn *next;
+};
+
+struct p9_srv {
+  struct p9_fs *fs;
+  int msize;
+  int epfd;
+  int running;
+  int nlisten;
+  struct p9_srvfd listen[MAXLISTEN];
+  unsigned int borrowed;
+  struct p9_srvconn *conns;
+  struct p9_srv *shard;
+  pthread_t loop;
+  struct p9_trace *trace;
+
+  unsigned int pooled;
+  int nthreads;
+  pthread_t *threads;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct p9_srvfd wake;
+  struct p9_srvreq *queue;
+  struct p9_srvreq **queue_tail;
+  struct p9_srvreq *done;
+  struct p9_srvreq *free_reqs;
+};
+
+static unsigned int
+unpack_uint4(unsigned char *buf)
+{
+  return buf[0] | (buf[1] << 8) | (buf[2] << 16) | (buf[3] << 24);
+}
+
+static void
+pack_uint4(unsigned char *buf, unsigned int x)
+{
+  buf[0] = x & 0xff;
+  buf[1] = (x >> 8) & 0xff;
+  buf[2] = (x >> 16) & 0xff;
+  buf[3] = (x >> 24) & 0xff;
+}
+
+static int
+set_nonblock(int fd)
+{
+  int x = fcntl(fd, F_GETFL, 0);
+  return (x < 0 || fcntl(fd, F_SETFL, x | O_NONBLOCK) < 0) ? -1 : 0;
+}
+
+struct p9_srv *
+mk_p9srv(struct p9_fs *fs, int msize)
+{
+  struct p9_srv *s;
+  struct epoll_event ev;
+
+  s = calloc(1, sizeof(struct p9_srv));
+  if (!s)
+    return 0;
+  s->fs = fs;
+  s->msize = (msize >= MINMSIZE) ? msize : MSIZE;
+  s->pooled = TYPEBIT(P9_TOPEN) | TYPEBIT(P9_TCREATE) | TYPEBIT(P9_TREAD)
+              | TYPEBIT(P9_TWRITE) | TYPEBIT(P9_TREMOVE) | TYPEBIT(P9_TWSTAT);
+  s->queue_tail = &s->queue;
+  s->wake.kind = FD_WAKE;
+  s->epfd = epoll_create1(EPOLL_CLOEXEC);
+  s->wake.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  ev.events = EPOLLIN;
+  ev.data.ptr = &s->wake;
+  if (s->epfd < 0 || s->wake.fd < 0
+      || epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->wake.fd, &ev)) {
+    if (s->epfd >= 0)
+      close(s->epfd);
+    if (s->wake.fd >= 0)
+      close(s->wake.fd);
+    free(s);
+    return 0;
+  }
+  pthread_mutex_init(&s->lock, 0);
+  pthread_cond_init(&s->cond, 0);
+  return s;
+}
+
+static void
+free_conn(struct p9_srvconn *sc)
+{
+  struct p9_srv *s = sc->srv;
+  struct p9_srvfile *f;
+
+  if (s->fs->disconnect)
+    s->fs->disconnect(&sc->ctx.c);
+  if (sc->prev)
+    sc->prev->next = sc->next;
+  else
+    s->conns = sc->next;
+  if (sc->next)
+    sc->next->prev = sc->prev;
+  if (sc->ctx.sendfd >= 0)
+    close(sc->ctx.sendfd);
+  while ((f = sc->files)) {
+    sc->files = f->next;
+    close(f->fd);
+    free(f);
+  }
+  free(sc->inbuf);
+  free(sc->outbuf);
+  free(sc->ctx.c.buf);
+  free(sc);
+}
+
+static void
+free_ctx(struct p9_srvctx *ctx)
+{
+  if (!ctx)
+    return;
+  if (ctx->sendfd >= 0)
+    close(ctx->sendfd);
+  free(ctx->c.buf);
+  free(ctx);
+}
+
+static void
+free_req(struct p9_srvreq *req)
+{
+  if (req->sendfd >= 0)
+    close(req->sendfd);
+  free_ctx(req->ctx);
+  free(req->tbuf);
+  free(req->rbuf);
+  free(req);
+}
+
+/* A worker defers a request while the loop thread looks at it. */
+static int
+is_deferred(struct p9_srvreq *req)
+{
+  return __atomic_load_n(&req->deferred, __ATOMIC_ACQUIRE);
+}
+
+/* The connection stays allocated until its requests in the thread pool
+ * and the deferred ones complete, so that the backend never sees a torn
+ * down connection.  Deferred requests are flushed, parked ones dropped. */
+static void
+close_conn(struct p9_srvconn *sc)
+{
+  struct p9_srvreq *req;
+  struct p9_fs *fs = sc->srv->fs;
+
+  if (sc->dead)
+    return;
+  sc->dead = 1;
+  epoll_ctl(sc->srv->epfd, EPOLL_CTL_DEL, sc->fd.fd, 0);
+  close(sc->fd.fd);
+  while ((req = sc->parked)) {
+    sc->parked = req->next;
+    free_req(req);
+  }
+  sc->parked_tail = &sc->parked;
+  for (req = sc->out; req; req = req->link)
+    if (is_deferred(req) && !req->flushed) {
+      req->flushed = req->ctx->c.flushed = req;
+      if (fs->flush)
+        fs->flush(&req->ctx->c);
+    }
+  if (!sc->nout)
+    free_conn(sc);
+}
+
+static void
+stop_threads(struct p9_srv *s)
+{
+  int i;
+
+  pthread_mutex_lock(&s->lock);
+  s->running = -1;
+  pthread_cond_broadcast(&s->cond);
+  pthread_mutex_unlock(&s->lock);
+  for (i = 0; i < s->nthreads; ++i)
+    pthread_join(s->threads[i], 0);
+  free(s->threads);
+  s->threads = 0;
+  s->nthreads = 0;
+}
+
+/* Deferred requests must not be responded to once this is called. */
+void
+rm_p9srv(struct p9_srv *s)
+{
+  struct p9_srvreq *req, *f;
+  struct p9_srvconn *sc;
+  int i;
+
+  if (!s)
+    return;
+  rm_p9srv(s->shard);
+  stop_threads(s);
+  s->queue = s->done = 0;
+  for (; (req = s->free_reqs); s->free_reqs = req->next, free_req(req)) {}
+  while ((sc = s->conns)) {
+    close_conn(sc);
+    if (sc != s->conns)
+      continue;
+    while ((req = sc->out)) {
+      sc->out = req->link;
+      for (; (f = req->flushes); req->flushes = f->next, free_req(f)) {}
+      free_req(req);
+    }
+    free_conn(sc);
+  }
+  for (i = 0; i < s->nlisten; ++i)
+    if (!(s->borrowed & (1u << i)))
+      close(s->listen[i].fd);
+  close(s->wake.fd);
+  close(s->epfd);
+  pthread_mutex_destroy(&s->lock);
+  pthread_cond_destroy(&s->cond);
+  free(s);
+}
+
+static int
+listen_unix(const char *path)
+{
+  struct sockaddr_un addr = {0};
+  int fd;
+
+  if (strlen(path) >= sizeof(addr.sun_path))
+    return -1;
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  unlink(path);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int
+listen_tcp(const char *host, const char *port, int reuseport)
+{
+  struct addrinfo hints = {0}, *ai;
+  int fd, x = 1;
+
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  if (!strcmp(host, "*"))
+    host = 0;
+  if (getaddrinfo(host, port, &hints, &ai))
+    return -1;
+  fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+  if (fd >= 0) {
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &x, sizeof(x));
+    if (reuseport)
+      setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &x, sizeof(x));
+    if (bind(fd, ai->ai_addr, ai->ai_addrlen)) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(ai);
+  return fd;
+}
+
+static int
+add_listener(int fd, int borrowed, struct p9_srv *s)
+{
+  struct epoll_event ev;
+
+  if (s->nlisten >= MAXLISTEN)
+    return -1;
+  s->listen[s->nlisten].kind = FD_LISTEN;
+  s->listen[s->nlisten].fd = fd;
+  ev.events = EPOLLIN | ((s->shard || borrowed) ? EPOLLEXCLUSIVE : 0);
+  ev.data.ptr = &s->listen[s->nlisten];
+  if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, fd, &ev))
+    return -1;
+  if (borrowed)
+    s->borrowed |= 1u << s->nlisten;
+  ++s->nlisten;
+  return 0;
+}
+
+/* addr is a dial string: tcp!host!port (host may be *) or unix!path.
+ * Every shard gets its own SO_REUSEPORT socket for tcp, while a unix
+ * socket is shared by all of them. */
+int
+p9srv_listen(const char *addr, struct p9_srv *s)
+{
+  struct p9_srv *sh;
+  char buf[256], *net, *host, *port, *p = buf;
+  int fd = -1;
+
+  if (strlen(addr) >= sizeof(buf))
+    return -1;
+  strcpy(buf, addr);
+  net = strsep(&p, "!");
+  host = strsep(&p, "!");
+  port = p;
+  if (!host || !((!strcmp(net, "tcp") && port) || !strcmp(net, "unix")))
+    return -1;
+  for (sh = s; sh; sh = sh->shard) {
+    if (!strcmp(net, "unix") && sh != s) {
+      if (add_listener(fd, 1, sh))
+        return -1;
+      continue;
+    }
+    fd = (!strcmp(net, "unix")) ? listen_unix(host)
+                                : listen_tcp(host, port, s->shard != 0);
+    if (fd < 0)
+      return -1;
+    if (set_nonblock(fd) || listen(fd, SOMAXCONN) || add_listener(fd, 0, sh)) {
+      close(fd);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static void
+accept_conns(struct p9_srvfd *l, struct p9_srv *s)
+{
+  struct p9_srvconn *sc;
+  struct epoll_event ev;
+  int fd, x = 1;
+
+  while ((fd = accept4(l->fd, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &x, sizeof(x));
+    sc = calloc(1, sizeof(struct p9_srvconn));
+    if (!sc) {
+      close(fd);
+      continue;
+    }
+    sc->fd.kind = FD_CONN;
+    sc->fd.fd = fd;
+    sc->srv = s;
+    sc->ctx.sc = sc;
+    sc->ctx.sendfd = -1;
+    sc->ctx.c.msize = s->msize;
+    sc->files_tail = &sc->files;
+    sc->parked_tail = &sc->parked;
+    sc->inmax = MINMSIZE;
+    sc->inbuf = malloc(sc->inmax);
+    sc->events = ev.events = EPOLLIN;
+    ev.data.ptr = sc;
+    if (!sc->inbuf || epoll_ctl(s->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+      free(sc->inbuf);
+      free(sc);
+      close(fd);
+      continue;
+    }
+    sc->next = s->conns;
+    if (s->conns)
+      s->conns->prev = sc;
+    s->conns = sc;
+    if (s->fs->connect)
+      s->fs->connect(&sc->ctx.c);
+  }
+}
+
+static int
+set_events(struct p9_srvconn *sc, int events)
+{
+  struct epoll_event ev;
+
+  if (sc->events == events)
+    return 0;
+  sc->events = ev.events = events;
+  ev.data.ptr = sc;
+  return epoll_ctl(sc->srv->epfd, EPOLL_CTL_MOD, sc->fd.fd, &ev);
+}
+
+/* A file that got shorter since its Rread header was sent is padded with
+ * zeros to keep the stream in sync. */
+static int
+send_file(int fd, struct p9_srvfile *f)
+{
+  static const char zeros[4096];
+  off_t off = f->off;
+  int r;
+
+  r = sendfile(fd, f->fd, &off, f->count);
+  if (r == 0)
+    r = send(fd, zeros, (f->count < sizeof(zeros)) ? f->count : sizeof(zeros),
+             MSG_NOSIGNAL);
+  if (r > 0) {
+    f->off += r;
+    f->count -= r;
+  }
+  return r;
+}
+
+static int
+flush_out(struct p9_srvconn *sc)
+{
+  struct p9_srvfile *f;
+  int r, end;
+
+  for (;;) {
+    f = sc->files;
+    end = (f) ? f->pos : sc->outsize;
+    while (sc->outoff < end) {
+      r = send(sc->fd.fd, sc->outbuf + sc->outoff, end - sc->outoff,
+               MSG_NOSIGNAL | ((f) ? MSG_MORE : 0));
+      if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return set_events(sc, EPOLLOUT);
+      if (r <= 0)
+        return -1;
+      sc->outoff += r;
+    }
+    if (!f)
+      break;
+    while (f->count) {
+      r = send_file(sc->fd.fd, f);
+      if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return set_events(sc, EPOLLOUT);
+      if (r < 0)
+        return -1;
+    }
+    if (!(sc->files = f->next))
+      sc->files_tail = &sc->files;
+    close(f->fd);
+    free(f);
+  }
+  sc->outoff = sc->outsize = 0;
+  return set_events(sc, EPOLLIN);
+}
+
+static int
+reserve_out(struct p9_srvconn *sc, int size)
+{
+  struct p9_srvfile *f;
+  unsigned char *p;
+  int n;
+
+  if (sc->outmax - sc->outsize >= size)
+    return 0;
+  if (sc->outoff) {
+    memmove(sc->outbuf, sc->outbuf + sc->outoff, sc->outsize - sc->outoff);
+    sc->outsize -= sc->outoff;
+    for (f = sc->files; f; f = f->next)
+      f->pos -= sc->outoff;
+    sc->outoff = 0;
+  }
+  if (sc->outmax - sc->outsize < size) {
+    n = sc->outsize + size;
+    if (!(p = realloc(sc->outbuf, n)))
+      return -1;
+    sc->outbuf = p;
+    sc->outmax = n;
+  }
+  return 0;
+}
+
+/* The number of bytes the reply takes in the output buffer.  Of an Rread
+ * set up with p9srv_sendfile only the header goes there. */
+static int
+reply_size(struct p9_srvctx *ctx)
+{
+  struct p9_msg *r = &ctx->c.r;
+  unsigned int size;
+
+  if (ctx->sendfd >= 0 && r->type != P9_RREAD) {
+    close(ctx->sendfd);
+    ctx->sendfd = -1;
+  }
+  if (ctx->sendfd >= 0)
+    return (11 + (unsigned long long)r->count <= ctx->c.msize) ? 11 : -1;
+  size = p9_msg_size(r);
+  return (size && size <= ctx->c.msize) ? (int)size : -1;
+}
+
+static void
+pack_reply(struct p9_srvctx *ctx, int size, unsigned char *buf)
+{
+  struct p9_msg *r = &ctx->c.r;
+
+  if (ctx->sendfd < 0) {
+    p9_pack_msg_sized(size, (char *)buf, r);
+    return;
+  }
+  pack_uint4(buf, 11 + r->count);
+  buf[4] = P9_RREAD;
+  buf[5] = r->tag & 0xff;
+  buf[6] = r->tag >> 8;
+  pack_uint4(buf + 7, r->count);
+}
+
+/* Takes over the file of a p9srv_sendfile reply whose header was just put
+ * at the end of the output buffer. */
+static int
+put_file(struct p9_srvconn *sc, int *fd, unsigned long long off,
+         unsigned int count)
+{
+  struct p9_srvfile *f;
+
+  if (*fd < 0)
+    return 0;
+  if (!(f = malloc(sizeof(struct p9_srvfile)))) {
+    close(*fd);
+    *fd = -1;
+    return -1;
+  }
+  f->fd = *fd;
+  f->pos = sc->outsize;
+  f->off = off;
+  f->count = count;
+  f->next = 0;
+  *sc->files_tail = f;
+  sc->files_tail = &f->next;
+  *fd = -1;
+  return 0;
+}
+
+static int
+put_reply(struct p9_srvconn *sc)
+{
+  int n;
+
+  if ((n = reply_size(&sc->ctx)) < 0 || reserve_out(sc, n))
+    return -1;
+  pack_reply(&sc->ctx, n, sc->outbuf + sc->outsize);
+  p9_trace(P9_TRACE_OUT, n + ((sc->ctx.sendfd >= 0) ? sc->ctx.c.r.count : 0),
+           n, sc->outbuf + sc->outsize, sc->srv->trace);
+  sc->outsize += n;
+  return put_file(sc, &sc->ctx.sendfd, sc->ctx.sendoff, sc->ctx.c.r.count);
+}
+
+static int
+put_rflush(struct p9_srvconn *sc, unsigned short tag)
+{
+  unsigned char *p;
+
+  if (reserve_out(sc, 7))
+    return -1;
+  p = sc->outbuf + sc->outsize;
+  pack_uint4(p, 7);
+  p[4] = P9_RFLUSH;
+  p[5] = tag & 0xff;
+  p[6] = tag >> 8;
+  p9_trace(P9_TRACE_OUT, 7, 7, p, sc->srv->trace);
+  sc->outsize += 7;
+  return 0;
+}
+
+static int
+has_fid(unsigned int type)
+{
+  switch (type) {
+  case P9_TVERSION:
+  case P9_TAUTH:
+  case P9_TFLUSH:
+    return 0;
+  }
+  return 1;
+}
+
+static int
+conflicts_req(struct p9_cmsg *o, struct p9_msg *t, int rw)
+{
+  if (o->type == P9_TVERSION)
+    return 1;
+  if (!has_fid(o->type) || !has_fid(t->type))
+    return 0;
+  if (rw && (o->type == P9_TREAD || o->type == P9_TWRITE))
+    return 0;
+  return o->f[0].n == t->fid
+         || (t->type == P9_TWALK && o->f[0].n == t->newfid)
+         || (o->type == P9_TWALK && o->f[1].n == t->fid);
+}
+
+/* Requests on the same fid keep their order, except for reads and writes
+ * which may overlap.  Tversion waits for everything and everything waits
+ * for it.  t is checked against the requests in flight and the parked
+ * ones before end.  The fid is the first field of every request that has
+ * one, newfid of Twalk the second. */
+static int
+conflicts(struct p9_srvconn *sc, struct p9_msg *t, struct p9_srvreq *end)
+{
+  struct p9_srvreq *req;
+  int rw;
+
+  if (!sc->out && sc->parked == end)
+    return 0;
+  if (t->type == P9_TVERSION)
+    return 1;
+  rw = (t->type == P9_TREAD || t->type == P9_TWRITE);
+  for (req = sc->out; req; req = req->link)
+    if (conflicts_req(&req->t, t, rw))
+      return 1;
+  for (req = sc->parked; req != end; req = req->next)
+    if (conflicts_req(&req->t, t, rw))
+      return 1;
+  return 0;
+}
+
+/* Copies the message being processed into a request. */
+static struct p9_srvreq *
+get_srvreq(struct p9_srvconn *sc)
+{
+  struct p9_srv *s = sc->srv;
+  struct p9_srvreq *req;
+  unsigned char *p;
+  int size = unpack_uint4(sc->tmsg);
+
+  if ((req = s->free_reqs))
+    s->free_reqs = req->next;
+  else if (!(req = calloc(1, sizeof(struct p9_srvreq))))
+    return 0;
+  req->next = 0;
+  req->sendfd = -1;
+  if (req->tcap < size) {
+    if (!(p = realloc(req->tbuf, size))) {
+      req->next = s->free_reqs;
+      s->free_reqs = req;
+      return 0;
+    }
+    req->tbuf = p;
+    req->tcap = size;
+  }
+  memcpy(req->tbuf, sc->tmsg, size);
+  p9_unpack_cmsg(size, (char *)req->tbuf, &req->t);
+  req->sc = sc;
+  req->ctx = 0;
+  req->flushed = 0;
+  req->rsize = 0;
+  req->deferred = 0;
+  req->flushes = 0;
+  return req;
+}
+
+static void
+put_srvreq(struct p9_srvreq *req)
+{
+  struct p9_srv *s = req->sc->srv;
+
+  if (req->sendfd >= 0) {
+    close(req->sendfd);
+    req->sendfd = -1;
+  }
+  free_ctx(req->ctx);
+  req->ctx = 0;
+  req->sc = 0;
+  req->next = s->free_reqs;
+  s->free_reqs = req;
+}
+
+static void
+link_out(struct p9_srvreq *req)
+{
+  struct p9_srvconn *sc = req->sc;
+  req->link = sc->out;
+  sc->out = req;
+  ++sc->nout;
+}
+
+static void
+unlink_out(struct p9_srvreq *req)
+{
+  struct p9_srvreq **pr;
+
+  for (pr = &req->sc->out; *pr && *pr != req; pr = &(*pr)->link) {}
+  if (*pr)
+    *pr = req->link;
+  --req->sc->nout;
+}
+
+static int
+queue_req(struct p9_srvconn *sc)
+{
+  struct p9_srv *s = sc->srv;
+  struct p9_srvreq *req;
+
+  if (!(req = get_srvreq(sc)))
+    return -1;
+  link_out(req);
+  pthread_mutex_lock(&s->lock);
+  *s->queue_tail = req;
+  s->queue_tail = &req->next;
+  pthread_cond_signal(&s->cond);
+  pthread_mutex_unlock(&s->lock);
+  return 0;
+}
+
+/* A request that conflicts with an earlier one waits in the parked list
+ * until complete_reqs finds it free to run.  Reading goes on meanwhile, so
+ * that a Tflush of the earlier request still gets through. */
+static int
+park_req(struct p9_srvconn *sc)
+{
+  struct p9_srvreq *req;
+
+  if (!(req = get_srvreq(sc)))
+    return -1;
+  *sc->parked_tail = req;
+  sc->parked_tail = &req->next;
+  return 0;
+}
+
+/* Runs the message in ctx, which came from tmsg. */
+static int
+run_msg(struct p9_srvconn *sc)
+{
+  struct p9_connection *c = &sc->ctx.c;
+  unsigned char *p;
+
+  if (sc->srv->nthreads && (sc->srv->pooled & TYPEBIT(c->t.type)))
+    return queue_req(sc);
+  p9_process_treq(c, sc->srv->fs);
+  if (c->r.deferred)
+    return 0;
+  if (c->r.type == P9_RVERSION) {
+    if (c->r.msize > sc->srv->msize)
+      c->r.msize = sc->srv->msize;
+    if (c->r.msize < MINMSIZE)
+      c->r.msize = MINMSIZE;
+    c->msize = c->r.msize;
+  }
+  if (put_reply(sc))
+    return -1;
+  if (c->r.type == P9_RVERSION && sc->inmax < c->msize) {
+    if (!(p = realloc(sc->inbuf, c->msize)))
+      return -1;
+    sc->inbuf = p;
+    sc->inmax = c->msize;
+  }
+  return 0;
+}
+
+/* Runs the parked requests that no longer conflict, in arrival order. */
+static int
+run_parked(struct p9_srvconn *sc)
+{
+  struct p9_connection *c = &sc->ctx.c;
+  struct p9_srvreq *req, **pr = &sc->parked;
+  int r;
+
+  while ((req = *pr)) {
+    if (p9_unpack_msg(unpack_uint4(req->tbuf), (char *)req->tbuf, &c->t))
+      return -1;
+    if (conflicts(sc, &c->t, req)) {
+      pr = &req->next;
+      continue;
+    }
+    if (!(*pr = req->next))
+      sc->parked_tail = pr;
+    sc->tmsg = req->tbuf;
+    r = run_msg(sc);
+    put_srvreq(req);
+    if (r)
+      return -1;
+  }
+  return 0;
+}
+
+/* Tflush of a pending request is answered once that request is settled.
+ * A deferred one is handed to fs->flush with flushed set, a parked one is
+ * dropped right away. */
+static int
+flush_req(struct p9_srvconn *sc)
+{
+  struct p9_connection *c = &sc->ctx.c;
+  struct p9_srvreq *req, *f, **pr;
+  struct p9_fs *fs = sc->srv->fs;
+
+  for (pr = &sc->parked; *pr && (*pr)->t.tag != c->t.oldtag;
+       pr = &(*pr)->next) {}
+  if ((req = *pr)) {
+    if (!(*pr = req->next))
+      sc->parked_tail = pr;
+    put_srvreq(req);
+    return put_rflush(sc, c->t.tag) || run_parked(sc);
+  }
+  for (req = sc->out; req && req->t.tag != c->t.oldtag; req = req->link) {}
+  if (!req)
+    return put_rflush(sc, c->t.tag);
+  if (!(f = get_srvreq(sc)))
+    return -1;
+  f->next = req->flushes;
+  req->flushes = f;
+  if (!req->flushed) {
+    req->flushed = f;
+    if (is_deferred(req)) {
+      req->ctx->c.flushed = f;
+      if (fs->flush)
+        fs->flush(&req->ctx->c);
+    }
+  }
+  return 0;
+}
+
+static int
+process_msg(struct p9_srvconn *sc, int size)
+{
+  struct p9_connection *c = &sc->ctx.c;
+
+  sc->tmsg = sc->inbuf + sc->inoff;
+  if (p9_unpack_msg(size, (char *)sc->tmsg, &c->t))
+    return -1;
+  p9_trace(P9_TRACE_IN, size, size, sc->tmsg, sc->srv->trace);
+  if (c->t.type == P9_TFLUSH)
+    return flush_req(sc);
+  if (conflicts(sc, &c->t, 0))
+    return park_req(sc);
+  return run_msg(sc);
+}
+
+/* The input buffer shrinks to a smaller msize only once the messages
+ * that followed the Tversion are out of it. */
+static int
+process_input(struct p9_srvconn *sc)
+{
+  struct p9_connection *c = &sc->ctx.c;
+  unsigned char *p;
+  int size;
+
+  while (sc->insize - sc->inoff >= 7) {
+    size = unpack_uint4(sc->inbuf + sc->inoff);
+    if (size < 7 || size > sc->inmax || size > c->msize)
+      return -1;
+    if (sc->inoff + size > sc->insize)
+      break;
+    if (process_msg(sc, size))
+      return -1;
+    sc->inoff += size;
+  }
+  if (sc->inoff) {
+    memmove(sc->inbuf, sc->inbuf + sc->inoff, sc->insize - sc->inoff);
+    sc->insize -= sc->inoff;
+    sc->inoff = 0;
+  }
+  if (sc->inmax > c->msize && sc->insize <= c->msize) {
+    if (!(p = realloc(sc->inbuf, c->msize)))
+      return -1;
+    sc->inbuf = p;
+    sc->inmax = c->msize;
+  }
+  return 0;
+}
+
+/* Every complete message in the input buffer is answered before the
+ * replies are written with a single send. */
+static int
+read_conn(struct p9_srvconn *sc)
+{
+  int r;
+
+  r = recv(sc->fd.fd, sc->inbuf + sc->insize, sc->inmax - sc->insize, 0);
+  if (r < 0)
+    return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+  if (r == 0)
+    return -1;
+  sc->insize += r;
+  if (process_input(sc))
+    return -1;
+  return flush_out(sc);
+}
+
+/* Packs the reply in ctx into the request and takes over its file. */
+static void
+pack_srvreq(struct p9_srvreq *req, struct p9_srvctx *ctx)
+{
+  unsigned char *p;
+  int n;
+
+  req->rsize = 0;
+  if ((n = reply_size(ctx)) < 0)
+    return;
+  if (req->rcap < n) {
+    if (!(p = realloc(req->rbuf, n)))
+      return;
+    req->rbuf = p;
+    req->rcap = n;
+  }
+  pack_reply(ctx, n, req->rbuf);
+  req->rsize = n;
+  req->sendfd = ctx->sendfd;
+  req->sendoff = ctx->sendoff;
+  req->sendcount = ctx->c.r.count;
+  ctx->sendfd = -1;
+}
+
+static void
+push_done(struct p9_srvreq *req)
+{
+  struct p9_srv *s = req->sc->srv;
+  uint64_t one = 1;
+
+  pthread_mutex_lock(&s->lock);
+  req->next = s->done;
+  s->done = req;
+  pthread_mutex_unlock(&s->lock);
+  if (write(s->wake.fd, &one, sizeof(one)) < 0) {}
+}
+
+/* Expands the request into the worker's ctx and runs it. */
+static void
+run_srvreq(struct p9_srvreq *req, struct p9_srvctx *ctx, struct p9_fs *fs)
+{
+  struct p9_connection *c = &ctx->c;
+
+  ctx->sc = req->sc;
+  ctx->req = req;
+  c->msize = req->sc->ctx.c.msize;
+  c->aux = req->sc->ctx.c.aux;
+  c->flushed = req->flushed;
+  p9_cmsg_to_msg(&req->t, &c->t);
+  p9_process_treq(c, fs);
+  if (c->r.deferred)
+    return;
+  pack_srvreq(req, ctx);
+  push_done(req);
+}
+
+/* c.buf of the worker is allocated for the largest msize, as the backends
+ * size it by the msize of the first connection they see. */
+static void *
+worker(void *aux)
+{
+  struct p9_srv *s = aux;
+  struct p9_srvreq *req;
+  struct p9_srvctx ctx;
+  void *buf;
+
+  memset(&ctx, 0, sizeof(ctx));
+  ctx.sendfd = -1;
+  ctx.c.buf = buf = malloc(s->msize);
+  for (;;) {
+    pthread_mutex_lock(&s->lock);
+    while (!s->queue && s->running >= 0)
+      pthread_cond_wait(&s->cond, &s->lock);
+    if (s->running < 0) {
+      pthread_mutex_unlock(&s->lock);
+      free(ctx.c.buf);
+      return 0;
+    }
+    req = s->queue;
+    if (!(s->queue = req->next))
+      s->queue_tail = &s->queue;
+    pthread_mutex_unlock(&s->lock);
+
+    run_srvreq(req, &ctx, s->fs);
+    if (!buf) {
+      free(ctx.c.buf);
+      ctx.c.buf = 0;
+    }
+  }
+}
+
+/* Called from the read callback instead of setting r.data: count bytes
+ * of fd starting at off are sent by sendfile right after the reply header.
+ * fd is duplicated, so the callback may close it. */
+int
+p9srv_sendfile(struct p9_connection *c, int fd, unsigned long long off,
+               unsigned int count)
+{
+  struct p9_srvctx *ctx = containerof(c, struct p9_srvctx, c);
+
+  if (ctx->sendfd >= 0)
+    close(ctx->sendfd);
+  ctx->sendfd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+  if (ctx->sendfd < 0)
+    return -1;
+  ctx->sendoff = off;
+  c->r.count = count;
+  c->r.data = 0;
+  return 0;
+}
+
+/* Called from a p9_fs callback instead of filling in the reply.  Returns
+ * the state of the request that stays valid until it is passed to
+ * p9srv_respond, or 0 if the request cannot be deferred. */
+struct p9_connection *
+p9srv_defer(struct p9_connection *c)
+{
+  struct p9_srvctx *ctx = containerof(c, struct p9_srvctx, c), *d;
+  struct p9_srvreq *req = ctx->req;
+
+  if (req && req->ctx == ctx)
+    return c;
+  if (!(d = malloc(sizeof(struct p9_srvctx))))
+    return 0;
+  if (!req) {
+    if (!(req = get_srvreq(ctx->sc))) {
+      free(d);
+      return 0;
+    }
+    link_out(req);
+  }
+  *d = *ctx;
+  p9_cmsg_to_msg(&req->t, &d->c.t);
+  d->c.buf = 0;
+  d->c.flushed = req->flushed;
+  d->c.r.deferred = 1;
+  d->req = req;
+  ctx->sendfd = -1;
+  req->ctx = d;
+  __atomic_store_n(&req->deferred, 1, __ATOMIC_RELEASE);
+  c->r.deferred = 1;
+  return &d->c;
+}
+
+/* Sends the reply of a deferred request filled in r (an error if ename is
+ * set).  May be called from any thread. */
+void
+p9srv_respond(struct p9_connection *c)
+{
+  struct p9_srvctx *ctx = containerof(c, struct p9_srvctx, c);
+
+  c->r.type = (c->r.ename) ? P9_RERROR : c->t.type ^ 1;
+  c->r.tag = c->t.tag;
+  c->r.deferred = 0;
+  pack_srvreq(ctx->req, ctx);
+  push_done(ctx->req);
+}
+
+/* A flushed request is answered only if it succeeded anyway, followed by
+ * Rflush for every Tflush that waited for it. */
+static void
+finish_req(struct p9_srvreq *req)
+{
+  struct p9_srvconn *sc = req->sc;
+  struct p9_srvreq *f;
+  int send = 1;
+
+  if (!req->rsize)
+    sc->failed = 1;
+  else if (req->flushed && req->rbuf[4] == P9_RERROR)
+    send = 0;
+  if (send && !sc->failed && !reserve_out(sc, req->rsize)) {
+    memcpy(sc->outbuf + sc->outsize, req->rbuf, req->rsize);
+    p9_trace(P9_TRACE_OUT,
+             req->rsize + ((req->sendfd >= 0) ? req->sendcount : 0),
+             req->rsize, req->rbuf, sc->srv->trace);
+    sc->outsize += req->rsize;
+    if (put_file(sc, &req->sendfd, req->sendoff, req->sendcount))
+      sc->failed = 1;
+  } else if (send)
+    sc->failed = 1;
+  while ((f = req->flushes)) {
+    req->flushes = f->next;
+    if (put_rflush(sc, f->t.tag))
+      sc->failed = 1;
+    put_srvreq(f);
+  }
+}
+
+/* Replies of the pool and of deferred requests are appended in completion
+ * order and every touched connection is flushed once. */
+static void
+complete_reqs(struct p9_srv *s)
+{
+  struct p9_srvreq *req, *done, *f, *prev = 0;
+  struct p9_srvconn *sc, *dirty = 0, *end = (struct p9_srvconn *)s;
+  uint64_t n;
+
+  if (read(s->wake.fd, &n, sizeof(n)) < 0) {}
+  pthread_mutex_lock(&s->lock);
+  done = s->done;
+  s->done = 0;
+  pthread_mutex_unlock(&s->lock);
+  for (; done; done = req) {
+    req = done->next;
+    done->next = prev;
+    prev = done;
+  }
+  for (req = prev; req; req = done) {
+    done = req->next;
+    sc = req->sc;
+    unlink_out(req);
+    if (sc->dead) {
+      for (; (f = req->flushes); req->flushes = f->next, put_srvreq(f)) {}
+      put_srvreq(req);
+      if (!sc->nout)
+        free_conn(sc);
+      continue;
+    }
+    finish_req(req);
+    put_srvreq(req);
+    if (!sc->dirty) {
+      sc->dirty = (dirty) ? dirty : end;
+      dirty = sc;
+    }
+  }
+  for (sc = dirty; sc && sc != end; sc = dirty) {
+    dirty = sc->dirty;
+    sc->dirty = 0;
+    if (sc->dead)
+      continue;
+    if (sc->failed || (sc->parked && run_parked(sc))
+        || (sc->events != EPOLLOUT && flush_out(sc)))
+      close_conn(sc);
+  }
+}
+
+/* Runs the requests whose types are enabled with p9srv_pooled on n worker
+ * threads.  The p9_fs callbacks then have to be thread-safe. */
+int
+p9srv_threads(int n, struct p9_srv *s)
+{
+  if (s->nthreads || n <= 0)
+    return -1;
+  if (s->shard && p9srv_threads(n, s->shard))
+    return -1;
+  if (!(s->threads = calloc(n, sizeof(pthread_t))))
+    return -1;
+  for (; s->nthreads < n; ++s->nthreads)
+    if (pthread_create(&s->threads[s->nthreads], 0, worker, s))
+      break;
+  return (s->nthreads) ? 0 : -1;
+}
+
+void
+p9srv_pooled(int type, int on, struct p9_srv *s)
+{
+  if (type <= P9_TVERSION || type >= P9_XEND || (type & 1)
+      || type == P9_TFLUSH)
+    return;
+  if (s->shard)
+    p9srv_pooled(type, on, s->shard);
+  if (on)
+    s->pooled |= TYPEBIT(type);
+  else
+    s->pooled &= ~TYPEBIT(type);
+}
+
+/* Traces every frame of every shard into t, which is not owned.  Must be
+ * called before p9srv_run. */
+void
+p9srv_trace(struct p9_trace *t, struct p9_srv *s)
+{
+  for (; s; s = s->shard)
+    s->trace = t;
+}
+
+static int
+run_loop(struct p9_srv *s)
+{
+  struct epoll_event ev[MAXEVENTS];
+  struct p9_srvfd *f;
+  struct p9_srvconn *sc;
+  int i, n, r, wake;
+
+  while (s->running) {
+    n = epoll_wait(s->epfd, ev, NITEMS(ev), -1);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return -1;
+    for (i = 0, wake = 0; i < n; ++i) {
+      f = ev[i].data.ptr;
+      if (f->kind == FD_LISTEN) {
+        accept_conns(f, s);
+        continue;
+      }
+      if (f->kind == FD_WAKE) {
+        wake = 1;
+        continue;
+      }
+      sc = (struct p9_srvconn *)f;
+      if (ev[i].events & (EPOLLERR | EPOLLHUP))
+        r = -1;
+      else if (ev[i].events & EPOLLOUT)
+        r = flush_out(sc);
+      else
+        r = read_conn(sc);
+      if (r)
+        close_conn(sc);
+    }
+    /* After the batch, as it may free connections with events in it. */
+    if (wake)
+      complete_reqs(s);
+  }
+  return 0;
+}
+
+static void *
+shard_loop(void *aux)
+{
+  run_loop(aux);
+  return 0;
+}
+
+/* Runs the first shard in the calling thread and every other one in a
+ * thread of its own until p9srv_stop. */
+int
+p9srv_run(struct p9_srv *s)
+{
+  struct p9_srv *sh, *end;
+  int r;
+
+  for (sh = s; sh; sh = sh->shard)
+    sh->running = 1;
+  for (end = s->shard; end; end = end->shard)
+    if (pthread_create(&end->loop, 0, shard_loop, end))
+      break;
+  r = (end) ? -1 : run_loop(s);
+  p9srv_stop(s);
+  for (sh = s->shard; sh != end; sh = sh->shard)
+    pthread_join(sh->loop, 0);
+  return r;
+}
+
+/* Safe to call from a signal handler. */
+void
+p9srv_stop(struct p9_srv *s)
+{
+  uint64_t one = 1;
+
+  for (; s; s = s->shard) {
+    s->running = 0;
+    if (write(s->wake.fd, &one, sizeof(one)) < 0) {}
+  }
+}
+
+/* Splits the server into n shards, each with its own event loop thread,
+ * listening sockets, connections and thread pool.  Only the p9_fs is
+ * shared, so its callbacks have to be thread-safe.  Must be called before
+ * p9srv_listen. */
+int
+p9srv_shards(int n, struct p9_srv *s)
+{
+  struct p9_srv **p;
+
+  if (s->shard || s->nlisten || n <= 0)
+    return -1;
+  for (p = &s->shard; --n > 0; p = &(*p)->shard) {
+    if (!(*p = mk_p9srv(s->fs, s->msize)))
+      return -1;
+    (*p)->pooled = s->pooled;
+    (*p)->trace = s->trace;
+  }
+  return 0;
+}
@@ -0,0 +1,20 @@
+struct p9_srv;
+struct p9_fs;
+struct p9_connection;
+struct p9_trace;
+
+struct p9_srv *mk_p9srv(struct p9_fs *fs, int msize);
+void rm_p9srv(struct p9_srv *s);
+
+int p9srv_listen(const char *addr, struct p9_srv *s);
+int p9srv_shards(int n, struct p9_srv *s);
+int p9srv_threads(int n, struct p9_srv *s);
+void p9srv_pooled(int type, int on, struct p9_srv *s);
+void p9srv_trace(struct p9_trace *t, struct p9_srv *s);
+int p9srv_run(struct p9_srv *s);
+void p9srv_stop(struct p9_srv *s);
+
+struct p9_connection *p9srv_defer(struct p9_connection *c);
+void p9srv_respond(struct p9_connection *c);
+int p9srv_sendfile(struct p9_connection *c, int fd, unsigned long long off,
+                   unsigned int count);
@@ -0,0 +1,215 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "9ptrace.h"
+
+#define NSLOTS 8192
+#define SNAPLEN 256
+#define FLUSHUS 10000
+#define OUTSIZE 65536
+
+/* A slot is free for the producer of frame i when seq is i and holds that
+ * frame once seq is i + 1. */
+struct p9_traceslot {
+  unsigned long long seq;
+  unsigned long long ns;
+  unsigned int size;
+  unsigned int caplen;
+  unsigned char dir;
+  unsigned char buf[];
+};
+
+/* Frames go into a bounded ring of fixed-size slots that any number of
+ * threads may fill without locks.  A thread of its own writes them out.
+ * Frames that find the ring full are dropped and only counted. */
+struct p9_trace {
+  int fd;
+  int snaplen;
+  int slotsize;
+  unsigned long long nslots;
+  unsigned char *slots;
+  unsigned long long head __attribute__((aligned(64)));
+  unsigned long long dropped __attribute__((aligned(64)));
+  unsigned long long tail __attribute__((aligned(64)));
+  unsigned long long reported;
+  int stop;
+  pthread_t thread;
+  int outsize;
+  unsigned char out[OUTSIZE];
+};
+
+static struct p9_traceslot *
+get_slot(unsigned long long i, struct p9_trace *t)
+{
+  return (void *)(t->slots + (i & (t->nslots - 1)) * t->slotsize);
+}
+
+static void
+put_le(unsigned char *p, int n, unsigned long long x)
+{
+  for (; n > 0; --n, x >>= 8)
+    *p++ = x & 0xff;
+}
+
+static void
+write_out(struct p9_trace *t)
+{
+  int n, off = 0;
+
+  for (; off < t->outsize; off += n)
+    if ((n = write(t->fd, t->out + off, t->outsize - off)) <= 0)
+      break;
+  t->outsize = 0;
+}
+
+static void
+put_record(int dir, unsigned long long ns, unsigned int size,
+           unsigned int caplen, const unsigned char *buf, struct p9_trace *t)
+{
+  unsigned char *p;
+
+  if (t->outsize + P9_TRACE_HDRSZ + caplen > OUTSIZE)
+    write_out(t);
+  p = t->out + t->outsize;
+  put_le(p, 8, ns);
+  p[8] = dir;
+  p[9] = p[10] = p[11] = 0;
+  put_le(p + 12, 4, size);
+  put_le(p + 16, 4, caplen);
+  memcpy(p + P9_TRACE_HDRSZ, buf, caplen);
+  t->outsize += P9_TRACE_HDRSZ + caplen;
+}
+
+static unsigned long long
+now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Returns the number of frames written. */
+static int
+drain(struct p9_trace *t)
+{
+  struct p9_traceslot *s;
+  unsigned long long dropped;
+  int n = 0;
+
+  for (;; ++n, ++t->tail) {
+    s = get_slot(t->tail, t);
+    if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != t->tail + 1)
+      break;
+    put_record(s->dir, s->ns, s->size, s->caplen, s->buf, t);
+    __atomic_store_n(&s->seq, t->tail + t->nslots, __ATOMIC_RELEASE);
+  }
+  dropped = __atomic_load_n(&t->dropped, __ATOMIC_RELAXED);
+  if (dropped != t->reported) {
+    put_record(P9_TRACE_DROP, now(), dropped - t->reported, 0, 0, t);
+    t->reported = dropped;
+  }
+  write_out(t);
+  return n;
+}
+
+static void *
+flusher(void *aux)
+{
+  struct p9_trace *t = aux;
+
+  while (!__atomic_load_n(&t->stop, __ATOMIC_ACQUIRE))
+    if (!drain(t))
+      usleep(FLUSHUS);
+  drain(t);
+  return 0;
+}
+
+/* nslots is rounded up to a power of two, snaplen bytes of every frame are
+ * kept.  Zero selects the defaults.  Records are appended to path, so
+ * several processes can trace into the same file. */
+struct p9_trace *
+mk_p9trace(const char *path, int nslots, int snaplen)
+{
+  struct p9_trace *t;
+  struct stat st;
+  unsigned long long i;
+
+  t = calloc(1, sizeof(struct p9_trace));
+  if (!t)
+    return 0;
+  t->snaplen = (snaplen > 0) ? snaplen : SNAPLEN;
+  if (t->snaplen > OUTSIZE - P9_TRACE_HDRSZ)
+    t->snaplen = OUTSIZE - P9_TRACE_HDRSZ;
+  t->slotsize = (sizeof(struct p9_traceslot) + t->snaplen + 7) & ~7;
+  for (t->nslots = 1; t->nslots < ((nslots > 0) ? nslots : NSLOTS);
+       t->nslots *= 2) {}
+  t->slots = malloc(t->nslots * t->slotsize);
+  t->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (!t->slots || t->fd < 0 || fstat(t->fd, &st))
+    goto err;
+  for (i = 0; i < t->nslots; ++i)
+    get_slot(i, t)->seq = i;
+  if ((!st.st_size && write(t->fd, P9_TRACE_MAGIC, 8) != 8)
+      || pthread_create(&t->thread, 0, flusher, t))
+    goto err;
+  return t;
+err:
+  if (t->fd >= 0)
+    close(t->fd);
+  free(t->slots);
+  free(t);
+  return 0;
+}
+
+/* Writes out what is left in the ring. */
+void
+rm_p9trace(struct p9_trace *t)
+{
+  if (!t)
+    return;
+  __atomic_store_n(&t->stop, 1, __ATOMIC_RELEASE);
+  pthread_join(t->thread, 0);
+  close(t->fd);
+  free(t->slots);
+  free(t);
+}
+
+/* Records a frame of size bytes of which the first len are in buf.  Does
+ * nothing if t is 0. */
+void
+p9_trace(int dir, unsigned int size, unsigned int len,
+         const unsigned char *buf, struct p9_trace *t)
+{
+  struct p9_traceslot *s;
+  unsigned long long i, seq;
+
+  if (!t)
+    return;
+  i = __atomic_load_n(&t->head, __ATOMIC_RELAXED);
+  for (;;) {
+    s = get_slot(i, t);
+    seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+    if ((long long)(seq - i) < 0) {
+      __atomic_add_fetch(&t->dropped, 1, __ATOMIC_RELAXED);
+      return;
+    }
+    if (seq == i) {
+      if (__atomic_compare_exchange_n(&t->head, &i, i + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else
+      i = __atomic_load_n(&t->head, __ATOMIC_RELAXED);
+  }
+  s->ns = now();
+  s->dir = dir;
+  s->size = size;
+  s->caplen = (len < (unsigned int)t->snaplen) ? len : t->snaplen;
+  memcpy(s->buf, buf, s->caplen);
+  __atomic_store_n(&s->seq, i + 1, __ATOMIC_RELEASE);
+}
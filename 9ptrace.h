@@ -0,0 +1,21 @@
+/* A trace file starts with P9_TRACE_MAGIC followed by records of
+ *   ns[8] dir[1] pad[3] size[4] caplen[4] frame[caplen]
+ * in little-endian order.  ns is the realtime clock, size the size of the
+ * frame and caplen how much of it was kept.  A P9_TRACE_DROP record has
+ * no frame and counts in size the frames lost since the previous one. */
+
+#define P9_TRACE_MAGIC "9PTRACE1"
+#define P9_TRACE_HDRSZ 20
+
+enum {
+  P9_TRACE_IN,
+  P9_TRACE_OUT,
+  P9_TRACE_DROP
+};
+
+struct p9_trace;
+
+struct p9_trace *mk_p9trace(const char *path, int nslots, int snaplen);
+void rm_p9trace(struct p9_trace *t);
+void p9_trace(int dir, unsigned int size, unsigned int len,
+              const unsigned char *buf, struct p9_trace *t);
@@ -1,15 +1,23 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <errno.h>
 #include <unistd.h>
 #include <netdb.h>
 #include <fcntl.h>
 #include <netinet/tcp.h>
 #include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/uio.h>
 
 #include "9p.h"
 #include "9pconn.h"
+#include "9pdbg.h"
+#include "9ptrace.h"
 #include "util.h"
 
 int logmask;
@@ -20,6 +28,8 @@ enum {
 
 static const char *sockvar = "P9SOCKET";
 static const char *root_fid_var = "P9ROOTFID";
+static const char *tracevar = "P9TRACE";
+static struct p9_trace *trace;
 
 static int cmd_root(int argc, char **argv);
 static int cmd_walk(int argc, char **argv);
@@ -28,22 +38,36 @@ static int cmd_write(int argc, char **argv);
 static int cmd_write_fid(int argc, char **argv);
 static int cmd_read(int argc, char **argv);
 static int cmd_ls(int argc, char **argv);
+static int cmd_stat(int argc, char **argv);
+static int cmd_stats(int argc, char **argv);
 static int cmd_quit(int argc, char **argv);
 
+struct job;
+static struct p9_bulkitem *pipe_read(int argc, char **argv, struct job *j);
+static struct p9_bulkitem *pipe_ls(int argc, char **argv, struct job *j);
+static struct p9_bulkitem *pipe_stat(int argc, char **argv, struct job *j);
+
+#define READ_CHUNK (1 << 20)
+#define MAX_WINDOW 1024
+
 static char buffer[4096];
 
+/* pipe starts the command in the pipelined mode, see process_pipelined. */
 struct cmd {
   char *s;
   int (*fn)(int argc, char **argv);
   char *help;
+  struct p9_bulkitem *(*pipe)(int argc, char **argv, struct job *j);
 } cmds[] = {
   {"write_fid", cmd_write_fid, "<fid> <n>\\n<n bytes of data>"},
   {"write", cmd_write, "<path> <n>\\n<n bytes of data>"},
-  {"read", cmd_read, "<path>"},
+  {"read", cmd_read, "<path> [offset [length]]", pipe_read},
   {"walk", cmd_walk, "<path> — prints fid of destination or -1 on error"},
-  {"mkdir", cmd_mkdir, "<path>"},
+  {"mkdir", cmd_mkdir, "[-p] <path> [perm]"},
   {"root", cmd_root, "— returns root fid"},
-  {"ls", cmd_ls, "<path>"},
+  {"ls", cmd_ls, "<path>", pipe_ls},
+  {"stat", cmd_stat, "[-w window] <n>\\n<n lines of paths>", pipe_stat},
+  {"stats", cmd_stats, "[-r] — prints connection counters, -r resets them"},
   {"quit", cmd_quit},
   {"exit", cmd_quit},
   {"q", cmd_quit},
@@ -53,7 +77,7 @@ struct cmd {
 
 struct cmd shortcuts[] = {
   ['>'] = {0, cmd_write_fid},
-  ['<'] = {0, cmd_read},
+  ['<'] = {0, cmd_read, 0, pipe_read},
 };
 
 static int fd = -1;
@@ -62,7 +86,12 @@ static char *res = "";
 static char *user = "nobody";
 static char *host = 0;
 static struct p9_conn *conn = 0;
+static FILE *out;
+static FILE *input;
 static int running;
+static int window = 0;
+static int unordered = 0;
+static int binary = 0;
 
 void
 die(char *fmt, ...)
@@ -80,11 +109,11 @@ static void
 print_buf(int n, char *buf, int single)
 {
   if (mode == MODE_INT)
-    printf("%d\n", n);
+    fprintf(out, "%d\n", n);
   if (n)
-    fwrite(buf, 1, n, stdout);
+    fwrite(buf, 1, n, out);
   if ((!n || buf[n - 1] != '\n') && (single || mode == MODE_INT))
-    puts("");
+    fputc('\n', out);
 }
 
 static int
@@ -111,25 +140,31 @@ cmd_walk(int argc, char **argv)
   print_buf(n, buf, 1);
   return 0;
 err:
-  puts("err");
+  fputs("err\n", out);
   return -1;
 }
 
 static int
 cmd_mkdir(int argc, char **argv)
 {
-  int perm = 0700;
+  int perm = 0700, parents = 0;
 
+  if (argc > 1 && !strcmp(argv[1], "-p")) {
+    parents = 1;
+    --argc;
+    ++argv;
+  }
   if (argc < 2)
     goto err;
-  if (argc > 2 && sscanf(argv[3], "%o", &perm) != 1)
+  if (argc > 2 && sscanf(argv[2], "%o", &perm) != 1)
     goto err;
-  if (p9_mkdir(argv[1], perm, conn))
+  if ((parents) ? p9_mkdirp(argv[1], perm, conn)
+                : p9_mkdir(argv[1], perm, conn))
     goto err;
-  puts("ok");
+  fputs("ok\n", out);
   return 0;
 err:
-  puts("err");
+  fputs("err\n", out);
   return -1;
 }
 
@@ -156,7 +191,7 @@ cmd_write(int argc, char **argv)
   case MODE_INT:
     rsize = (sizeof(buffer) < size) ? sizeof(buffer) : size;
     while (written < size) {
-      n = fread(buffer, 1, rsize, stdin);
+      n = fread(buffer, 1, rsize, input);
       w = p9_write(n, buffer, f);
       if (w < 0)
         break;
@@ -165,7 +200,7 @@ cmd_write(int argc, char **argv)
     break;
   case MODE_CMD:
     for (;;) {
-      n = fread(buffer, 1, sizeof(buffer), stdin);
+      n = fread(buffer, 1, sizeof(buffer), input);
       if (n <= 0)
         break;
       w = p9_write(n, buffer, f);
@@ -180,7 +215,7 @@ cmd_write(int argc, char **argv)
   p9_close(f);
   return 0;
 err:
-  puts("err");
+  fputs("err\n", out);
   return -1;
 }
 
@@ -198,7 +233,7 @@ cmd_write_fid(int argc, char **argv)
     goto err;
   rsize = (sizeof(buffer) < size) ? sizeof(buffer) : size;
   while (written < size) {
-    n = fread(buffer, 1, rsize, stdin);
+    n = fread(buffer, 1, rsize, input);
     n = p9fid_write(tfid, written, n, buffer, conn);
     if (n < 0)
       goto err;
@@ -211,44 +246,78 @@ cmd_write_fid(int argc, char **argv)
 err:
   if (tfid != P9_NOFID)
     p9fid_close(tfid, conn);
-  puts("err");
+  fputs("err\n", out);
   return -1;
 }
 
+static int
+write_full(int fd, const char *buf, size_t size)
+{
+  ssize_t r;
+  size_t sent;
+
+  for (sent = 0; sent < size; sent += r)
+    if ((r = write(fd, buf + sent, size - sent)) < 0) {
+      if (errno != EINTR)
+        return -1;
+      r = 0;
+    }
+  return 0;
+}
+
+/* p9_preadv keeps several iounit-sized Treads in flight for each chunk;
+ * in MODE_CMD a chunk goes to stdout in a single write.  A short chunk
+ * may end in an error, so only an empty one ends the file.  In MODE_INT
+ * a read that fails midway ends with "err" instead of the empty chunk. */
 static int
 cmd_read(int argc, char **argv)
 {
   P9_file *f;
-  char buf[1024];
-  int n, ret = 0;
+  struct iovec iov;
+  unsigned long long off = 0, left = ~0ull;
+  long n;
+  int ret = 0;
 
-  if (argc < 2)
+  if (argc < 2 || (argc > 2 && sscanf(argv[2], "%llu", &off) != 1)
+      || (argc > 3 && sscanf(argv[3], "%llu", &left) != 1))
     goto err;
   f = p9_open(argv[1], P9_OREAD, -1, conn);
   if (!f)
     goto err;
-
-  switch (mode) {
-  case MODE_INT:
-    while ((n = p9_read(sizeof(buf), buf, f)) > 0)
-      print_buf(n, buf, 0);
-    print_buf(0, 0, 0);
-    break;
-  case MODE_CMD:
-    n = p9_read(sizeof(buf), buf, f);
-    if (n >= 0)
-      print_buf(n, buf, 1);
-    else {
-      fprintf(stderr, "Error reading '%s'\n", argv[1]);
+  if (!(iov.iov_base = malloc(READ_CHUNK))) {
+    p9_close(f);
+    goto err;
+  }
+  fflush(out);
+  while (left > 0) {
+    iov.iov_len = (left < READ_CHUNK) ? left : READ_CHUNK;
+    if ((n = p9_preadv(&iov, 1, off, f)) < 0) {
       ret = -1;
+      break;
     }
-    break;
+    if (mode == MODE_INT && n)
+      print_buf(n, iov.iov_base, 0);
+    if (mode == MODE_CMD && write_full(1, iov.iov_base, n)) {
+      ret = -1;
+      break;
+    }
+    off += n;
+    left -= n;
+    if (!n)
+      break;
   }
+  if (mode == MODE_INT && ret)
+    fputs("err\n", out);
+  else if (mode == MODE_INT)
+    print_buf(0, 0, 0);
+  else if (ret)
+    fprintf(stderr, "Error reading '%s'\n", argv[1]);
+  free(iov.iov_base);
   p9_close(f);
   return ret;
 err:
   if (mode == MODE_INT)
-    puts("err");
+    fputs("err\n", out);
   return -1;
 }
 
@@ -268,6 +337,17 @@ static const char *str_from_mode(unsigned int mode)
   return buf;
 }
 
+static int
+ls_line(int size, char *line, struct p9_stat *stat)
+{
+  int n;
+
+  n = snprintf(line, size, "%s %8llu %.*s%s\n", str_from_mode(stat->mode),
+               stat->length, stat->name_len, stat->name,
+               ((stat->qid.type & P9_QTDIR) ? "/" : ""));
+  return (n < size) ? n : size - 1;
+}
+
 static int
 cmd_ls(int argc, char **argv)
 {
@@ -278,13 +358,11 @@ cmd_ls(int argc, char **argv)
 
   f = p9_open((argc > 1) ? argv[1] : "/", P9_OREAD, -1, conn);
   if (!f) {
-    puts("err");
+    fputs("err\n", out);
     return -1;
   }
   while (p9_readdir(&stat, f) > 0) {
-    n = snprintf(line, sizeof(line), "%s %8llu %.*s%s\n",
-                 str_from_mode(stat.mode), stat.length, stat.name_len,
-                 stat.name, ((stat.qid.type & P9_QTDIR) ? "/" : ""));
+    n = ls_line(sizeof(line), line, &stat);
     if (size + n > sizeof(buf)) {
       print_buf(size, buf, 0);
       size = 0;
@@ -299,6 +377,124 @@ cmd_ls(int argc, char **argv)
   return 0;
 }
 
+struct stat_input {
+  int left;
+  int argc;
+  char **argv;
+  char line[1024];
+  char out[1024];
+  int size;
+};
+
+static const char *
+next_stat_path(void *aux)
+{
+  struct stat_input *in = aux;
+
+  if (in->argc > 0) {
+    --in->argc;
+    return *in->argv++;
+  }
+  if (!in->left || !fgets(in->line, sizeof(in->line), input))
+    return 0;
+  if (in->left > 0)
+    --in->left;
+  return trim_string_right(in->line, "\r\n");
+}
+
+static int
+stat_line(int size, char *line, const char *path, struct p9_stat *stat,
+          const char *err)
+{
+  int n;
+
+  if (stat)
+    n = snprintf(line, size, "%s %8llu %u %02x %u %llu %s\n",
+                 str_from_mode(stat->mode), stat->length, stat->mtime,
+                 stat->qid.type, stat->qid.version, stat->qid.path, path);
+  else
+    n = snprintf(line, size, "err %s: %s\n", path, err);
+  return (n < size) ? n : size - 1;
+}
+
+static void
+print_stat(const char *path, struct p9_stat *stat, const char *err,
+           void *aux)
+{
+  struct stat_input *in = aux;
+  char line[512];
+  int n;
+
+  n = stat_line(sizeof(line), line, path, stat, err);
+  if (in->size + n > sizeof(in->out)) {
+    print_buf(in->size, in->out, 0);
+    in->size = 0;
+  }
+  memcpy(in->out + in->size, line, n);
+  in->size += n;
+}
+
+static int
+cmd_stat(int argc, char **argv)
+{
+  struct stat_input in = {0};
+  int window = 64, r;
+
+  ++argv;
+  --argc;
+  if (argc > 1 && !strcmp(argv[0], "-w")) {
+    if (sscanf(argv[1], "%d", &window) != 1)
+      goto err;
+    argv += 2;
+    argc -= 2;
+  }
+  switch (mode) {
+  case MODE_INT:
+    if (argc < 1 || sscanf(argv[0], "%d", &in.left) != 1)
+      goto err;
+    break;
+  case MODE_CMD:
+    in.argc = argc;
+    in.argv = argv;
+    in.left = (argc) ? 0 : -1;
+    break;
+  }
+  r = p9_bulkstat(window, next_stat_path, print_stat, &in, conn);
+  if (in.size)
+    print_buf(in.size, in.out, 0);
+  print_buf(0, 0, 0);
+  return (r) ? -1 : 0;
+err:
+  fputs("err\n", out);
+  return -1;
+}
+
+static int
+cmd_stats(int argc, char **argv)
+{
+  static struct p9_stats st;
+  char *buf;
+  size_t size;
+  FILE *f;
+
+  if (argc > 2 || (argc == 2 && strcmp(argv[1], "-r"))) {
+    fputs("err\n", out);
+    return -1;
+  }
+  p9_get_stats(&st, conn);
+  if (!(f = open_memstream(&buf, &size)))
+    die("Cannot allocate output buffer");
+  p9_print_stats(&st, f);
+  fclose(f);
+  if (size)
+    print_buf(size, buf, 0);
+  print_buf(0, 0, 0);
+  free(buf);
+  if (argc == 2)
+    p9_reset_stats(conn);
+  return 0;
+}
+
 static int
 cmd_quit(int argc, char **argv)
 {
@@ -306,10 +502,10 @@ cmd_quit(int argc, char **argv)
   return 0;
 }
 
-static int
-run_cmd(int argc, char **argv)
+static struct cmd *
+find_cmd(int argc, char **argv)
 {
-  int i, r, c;
+  int i, c;
   struct cmd *cmd = 0;
   if (argc) {
     c = argv[0][0];
@@ -318,11 +514,19 @@ run_cmd(int argc, char **argv)
     for (i = 0; cmds[i].s && !cmd; ++i)
       if (!strcmp(argv[0], cmds[i].s) && cmds[i].fn)
         cmd = &cmds[i];
-    if (cmd) {
-      r = cmd->fn(argc, argv);
-      fflush(stdout);
-      return r;
-    }
+  }
+  return cmd;
+}
+
+static int
+run_cmd(int argc, char **argv)
+{
+  int r;
+  struct cmd *cmd = find_cmd(argc, argv);
+  if (cmd) {
+    r = cmd->fn(argc, argv);
+    fflush(out);
+    return r;
   }
   return -1;
 }
@@ -342,23 +546,55 @@ process_stdin(void)
   return 0;
 }
 
-int
-process_command(int argc, char **argv)
+static void
+stop_trace(void)
+{
+  rm_p9trace(trace);
+  trace = 0;
+}
+
+/* Traces the connection into the file named by $P9TRACE, if set. */
+static void
+start_trace(struct p9_conn *c)
+{
+  char *path = getenv(tracevar);
+
+  if (!path || !*path)
+    return;
+  if (!trace) {
+    if (!(trace = mk_p9trace(path, 0, 0)))
+      die("Cannot open trace file %s", path);
+    atexit(stop_trace);
+  }
+  p9_set_trace(trace, c);
+}
+
+/* Uses the connection at fd set up by a parent 9client. */
+void
+use_connection(int fd)
 {
-  int ret = 1;
   unsigned int root_fid = P9_NOFID;
   char *var;
 
-  mode = MODE_CMD;
   conn = mk_p9conn(fd, 0);
   if (!conn)
     die("Cannot create 9P connection");
+  start_trace(conn);
   if ((var = getenv(root_fid_var)) && sscanf(var, "%d", &root_fid) != 0)
     die("Wrong root fid");
   if (root_fid == P9_NOFID)
     p9_attach(conn, user, res);
   else
     p9_set_root_fid(root_fid, conn);
+}
+
+int
+process_command(int argc, char **argv)
+{
+  int ret;
+
+  mode = MODE_CMD;
+  use_connection(fd);
   ret = run_cmd(argc, argv);
   rm_p9conn(conn, 0);
   return ret;
@@ -408,10 +644,902 @@ init_connection(int fd)
     die("Cannot set socket env variable");
   }
   conn = mk_p9conn(fd, 1);
-  if (!conn || p9_attach(conn, user, res) == P9_NOTAG)
+  if (conn)
+    start_trace(conn);
+  if (!conn || p9_attach(conn, user, res) == P9_NOFID)
     die("Cannot init 9P connection");
 }
 
+enum {
+  JOB_READ,
+  JOB_LS,
+  JOB_STAT
+};
+
+/* A command of the pipelined mode.  Its output is staged in the chunks
+ * the command would print on its own, and kept until the jobs before it
+ * are printed. */
+struct job {
+  int id;
+  int kind;
+  int left;
+  int done;
+  int failed;
+  unsigned long long got;
+  char *stage;
+  int used;
+  int cap;
+  int window;
+  FILE *f;
+  char *outbuf;
+  size_t outsize;
+  struct job *next;
+};
+
+struct jobitem {
+  struct p9_bulkitem it;
+  struct job *job;
+  char path[1024];
+};
+
+static struct job *jobs, **jobs_tail = &jobs;
+static struct job *stat_job;
+static int stat_left;
+static int njobs;
+static int nitems;
+static char *held;
+static int held_id;
+
+/* stdin of the pipelined mode is read into inbuf, so that lines already
+ * read are seen before fd 0 is polled for more. */
+static char inbuf[65536];
+static int inpos, inlen;
+static int eof;
+
+/* Gets the next line into line, waiting for it only if wait is set.
+ * Returns 0 if there is none yet or stdin has ended. */
+static int
+get_line(int size, char *line, int wait)
+{
+  struct pollfd pfd = {0, POLLIN, 0};
+  char *nl;
+  int n;
+
+  for (;;) {
+    nl = memchr(inbuf + inpos, '\n', inlen - inpos);
+    n = (nl) ? nl + 1 - (inbuf + inpos) : inlen - inpos;
+    if (n > size - 1)
+      n = size - 1;
+    if (nl || n == size - 1 || (eof && n)) {
+      memcpy(line, inbuf + inpos, n);
+      line[n] = 0;
+      inpos += n;
+      return 1;
+    }
+    if (eof || (!wait && poll(&pfd, 1, 0) <= 0))
+      return 0;
+    memmove(inbuf, inbuf + inpos, inlen - inpos);
+    inlen -= inpos;
+    inpos = 0;
+    n = read(0, inbuf + inlen, sizeof(inbuf) - inlen);
+    if (n > 0)
+      inlen += n;
+    else if (n == 0 || errno != EINTR)
+      eof = 1;
+  }
+}
+
+/* Lets the commands that read their data from input take it from inbuf
+ * first. */
+static ssize_t
+read_input(void *aux, char *buf, size_t size)
+{
+  ssize_t n;
+
+  if (inpos == inlen)
+    return (eof) ? 0 : read(0, buf, size);
+  n = (size < inlen - inpos) ? size : inlen - inpos;
+  memcpy(buf, inbuf + inpos, n);
+  inpos += n;
+  return n;
+}
+
+static void
+print_jobs(void)
+{
+  struct job *j, **jp = &jobs;
+
+  while ((j = *jp)) {
+    if (!j->done) {
+      if (!unordered)
+        break;
+      jp = &j->next;
+      continue;
+    }
+    if (unordered)
+      printf("@%d\n", j->id);
+    fwrite(j->outbuf, 1, j->outsize, stdout);
+    if (!(*jp = j->next))
+      jobs_tail = jp;
+    free(j->outbuf);
+    free(j->stage);
+    free(j);
+  }
+  fflush(stdout);
+}
+
+static void
+job_flush(struct job *j)
+{
+  out = j->f;
+  if (j->used)
+    print_buf(j->used, j->stage, 0);
+  j->used = 0;
+  out = stdout;
+}
+
+/* Whole lines go to the next chunk if they do not fit, data is split. */
+static void
+job_put(int n, const char *data, int split, struct job *j)
+{
+  int k;
+
+  if (!split && j->used + n > j->cap)
+    job_flush(j);
+  if (!j->stage && !(j->stage = malloc(j->cap)))
+    die("Cannot allocate output buffer");
+  while (n > 0) {
+    k = (n < j->cap - j->used) ? n : j->cap - j->used;
+    memcpy(j->stage + j->used, data, k);
+    j->used += k;
+    data += k;
+    n -= k;
+    if (split && j->used == j->cap)
+      job_flush(j);
+  }
+}
+
+static void
+job_check(struct job *j)
+{
+  if (j->left || j == stat_job)
+    return;
+  job_flush(j);
+  if (j->failed)
+    fputs("err\n", j->f);
+  else {
+    out = j->f;
+    print_buf(0, 0, 0);
+    out = stdout;
+  }
+  fclose(j->f);
+  j->done = 1;
+  print_jobs();
+}
+
+static struct job *
+mk_job(int id)
+{
+  struct job *j;
+
+  if (!(j = calloc(1, sizeof(struct job)))
+      || !(j->f = open_memstream(&j->outbuf, &j->outsize)))
+    die("Cannot allocate job");
+  j->id = id;
+  *jobs_tail = j;
+  jobs_tail = &j->next;
+  return j;
+}
+
+static struct jobitem *
+add_item(const char *path, int stat, struct job *j)
+{
+  struct jobitem *it;
+
+  if (!(it = calloc(1, sizeof(struct jobitem))))
+    die("Cannot allocate job");
+  snprintf(it->path, sizeof(it->path), "%s", path);
+  it->it.path = it->path;
+  it->it.stat = stat;
+  it->job = j;
+  ++j->left;
+  ++nitems;
+  return it;
+}
+
+static struct p9_bulkitem *
+pipe_read(int argc, char **argv, struct job *j)
+{
+  unsigned long long off = 0, len = ~0ull;
+  struct jobitem *it;
+
+  j->kind = JOB_READ;
+  j->cap = READ_CHUNK;
+  if (argc < 2 || (argc > 2 && sscanf(argv[2], "%llu", &off) != 1)
+      || (argc > 3 && sscanf(argv[3], "%llu", &len) != 1)) {
+    j->failed = 1;
+    return 0;
+  }
+  it = add_item(argv[1], !len, j);
+  it->it.off = off;
+  it->it.len = (len == ~0ull) ? 0 : len;
+  return &it->it;
+}
+
+static struct p9_bulkitem *
+pipe_ls(int argc, char **argv, struct job *j)
+{
+  j->kind = JOB_LS;
+  j->cap = 1024;
+  return &add_item((argc > 1) ? argv[1] : "/", 0, j)->it;
+}
+
+/* The paths come from the lines that follow, see next_item. */
+static struct p9_bulkitem *
+pipe_stat(int argc, char **argv, struct job *j)
+{
+  int w;
+
+  j->kind = JOB_STAT;
+  j->cap = 1024;
+  ++argv;
+  --argc;
+  if (argc > 1 && !strcmp(argv[0], "-w")) {
+    if (sscanf(argv[1], "%d", &w) != 1)
+      argc = 0;
+    j->window = (w > 0) ? w : 1;
+    argv += 2;
+    argc -= 2;
+  }
+  if (argc < 1 || sscanf(argv[0], "%d", &stat_left) != 1)
+    j->failed = 1;
+  else if (stat_left)
+    stat_job = j;
+  return 0;
+}
+
+static void
+ls_data(int len, const char *data, struct job *j)
+{
+  struct p9_stat stat;
+  char line[256];
+  int size, n;
+
+  for (; len >= 2; len -= size + 2, data += size + 2) {
+    size = (unsigned char)data[0] | ((unsigned char)data[1] << 8);
+    if (size + 2 > len || p9_unpack_stat(size + 2, (char *)data, &stat))
+      break;
+    n = ls_line(sizeof(line), line, &stat);
+    job_put(n, line, 0, j);
+  }
+}
+
+static void
+item_done(struct p9_bulkitem *item, const char *data, int len,
+          struct p9_stat *stat, const char *err, void *aux)
+{
+  struct jobitem *it = (struct jobitem *)item;
+  struct job *j = it->job;
+  char line[512];
+  int n;
+
+  if (data) {
+    j->got += len;
+    if (j->kind == JOB_LS)
+      ls_data(len, data, j);
+    else
+      job_put(len, data, 1, j);
+    return;
+  }
+  if (j->kind == JOB_STAT) {
+    n = stat_line(sizeof(line), line, it->path, stat, err);
+    job_put(n, line, 0, j);
+  } else if (err && (j->kind == JOB_READ || !j->got))
+    j->failed = 1;
+  free(it);
+  --nitems;
+  --j->left;
+  job_check(j);
+}
+
+/* Reads the next command or path of a stat without blocking while items
+ * are in flight, and holds back the paths of a stat with -w once it has
+ * that many in flight.  A command that cannot be pipelined is held until
+ * the ones before it are done. */
+static struct p9_bulkitem *
+next_item(void *aux)
+{
+  static char buf[1024], line[1024];
+  char *args[1024];
+  struct p9_bulkitem *item;
+  struct cmd *cmd;
+  struct job *j;
+  int nargs;
+
+  while (running && !held) {
+    if ((j = stat_job) && j->window && j->left >= j->window)
+      return 0;
+    if (!get_line(sizeof(buf), buf, !nitems))
+      return 0;
+    if (j) {
+      if (stat_left > 0 && !--stat_left)
+        stat_job = 0;
+      return &add_item(trim_string_right(buf, "\r\n"), 1, j)->it;
+    }
+    memcpy(line, buf, sizeof(buf));
+    if (!(nargs = parse_args(buf, NITEMS(args), args)))
+      continue;
+    ++njobs;
+    cmd = find_cmd(nargs, args);
+    if (!cmd || !cmd->pipe) {
+      if (!(held = strdup(line)))
+        die("Cannot allocate command");
+      held_id = njobs;
+      break;
+    }
+    j = mk_job(njobs);
+    if ((item = cmd->pipe(nargs, args, j)))
+      return item;
+    job_check(j);
+  }
+  return 0;
+}
+
+/* Like process_stdin, but read, ls and stat start as soon as they are
+ * read, with up to window files in flight on the connection, and their
+ * output is printed in input order.  Other commands wait for the ones
+ * before them, as they may read stdin or use fids of their own. */
+static int
+process_pipelined(void)
+{
+  cookie_io_functions_t io = {read_input, 0, 0, 0};
+  char *args[1024];
+  struct job *j;
+  int nargs;
+
+  if (!(input = fopencookie(0, "r", io)))
+    die("Cannot open input");
+  setvbuf(input, 0, _IONBF, 0);
+  running = 1;
+  while (running) {
+    if (p9_bulkio(window, next_item, item_done, 0, conn) < 0 || !held)
+      break;
+    if (unordered)
+      printf("@%d\n", held_id);
+    nargs = parse_args(held, NITEMS(args), args);
+    run_cmd(nargs, args);
+    fflush(stdout);
+    free(held);
+    held = 0;
+  }
+  if ((j = stat_job)) {
+    stat_job = 0;
+    job_check(j);
+  }
+  print_jobs();
+  fclose(input);
+  input = stdin;
+  return 0;
+}
+
+/* Binary mode frames, little-endian.  A request is op[1] pad[3] id[4]
+ * argsize[4] datasize[8] followed by the args and the data, a reply is
+ * op[1] status[1] pad[2] id[4] datasize[8] followed by the data.  A reply
+ * with BIN_MORE is followed by another one for the same request.
+ *
+ * BIN_CMD: args are a command line split by NULs, data is its stdin; the
+ *   reply holds its output.
+ * BIN_READ: args are offset[8] count[8] path; count 0 reads to the end.
+ * BIN_WRITE: args are offset[8] path, data goes to the file; the reply
+ *   holds count[8] of bytes written.
+ * A BIN_ERR reply holds an error message. */
+#define BIN_REQSZ 20
+#define BIN_REPSZ 16
+#define BIN_MAXARGS 65536
+#define BIN_CHUNK (1 << 20)
+
+enum {
+  BIN_CMD,
+  BIN_READ,
+  BIN_WRITE
+};
+
+enum {
+  BIN_OK,
+  BIN_ERR,
+  BIN_MORE
+};
+
+static unsigned long long
+get_le(const unsigned char *p, int n)
+{
+  unsigned long long x = 0;
+
+  while (n-- > 0)
+    x = (x << 8) | p[n];
+  return x;
+}
+
+static void
+put_le(unsigned char *p, unsigned long long x, int n)
+{
+  for (; n > 0; --n, x >>= 8)
+    *p++ = x & 0xff;
+}
+
+static int
+read_full(int fd, void *buf, size_t size)
+{
+  ssize_t r;
+  size_t got;
+
+  for (got = 0; got < size; got += r)
+    if ((r = read(fd, (char *)buf + got, size - got)) <= 0) {
+      if (r < 0 && errno == EINTR) {
+        r = 0;
+        continue;
+      }
+      return -1;
+    }
+  return 0;
+}
+
+static int
+skip_data(unsigned long long size, char *buf)
+{
+  int n;
+
+  for (; size > 0; size -= n) {
+    n = (size < BIN_CHUNK) ? size : BIN_CHUNK;
+    if (read_full(0, buf, n))
+      return -1;
+  }
+  return 0;
+}
+
+static int
+put_bin(int op, int status, unsigned int id, size_t size, const void *data)
+{
+  unsigned char hdr[BIN_REPSZ] = {0};
+  struct iovec iov[2] = {{hdr, sizeof(hdr)}, {(void *)data, size}};
+  ssize_t r;
+  int i = 0;
+
+  hdr[0] = op;
+  hdr[1] = status;
+  put_le(hdr + 4, id, 4);
+  put_le(hdr + 8, size, 8);
+  while (i < 2) {
+    if ((r = writev(1, iov + i, 2 - i)) < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    for (; i < 2 && r >= iov[i].iov_len; ++i)
+      r -= iov[i].iov_len;
+    if (i < 2) {
+      iov[i].iov_base = (char *)iov[i].iov_base + r;
+      iov[i].iov_len -= r;
+    }
+  }
+  return 0;
+}
+
+static int
+put_bin_err(int op, unsigned int id, const char *msg)
+{
+  return put_bin(op, BIN_ERR, id, strlen(msg), msg);
+}
+
+static int
+bin_cmd(unsigned int id, int argsize, char *args, unsigned long long size,
+        char *buf)
+{
+  char *argv[1024], *data = 0, *s;
+  size_t outsize = 0;
+  int argc, r;
+
+  for (argc = 0, s = args; s < args + argsize && argc < NITEMS(argv);
+       s += strlen(s) + 1)
+    argv[argc++] = s;
+  if (!(data = malloc(size + 1)))
+    return skip_data(size, buf) || put_bin_err(BIN_CMD, id, "no memory");
+  if (read_full(0, data, size)) {
+    free(data);
+    return -1;
+  }
+  input = fmemopen(data, size, "r");
+  out = open_memstream(&s, &outsize);
+  if (!input || !out)
+    die("Cannot allocate command streams");
+  r = run_cmd(argc, argv);
+  fclose(input);
+  fclose(out);
+  input = stdin;
+  out = stdout;
+  r = put_bin(BIN_CMD, (r < 0) ? BIN_ERR : BIN_OK, id, outsize, s);
+  free(s);
+  free(data);
+  return r;
+}
+
+static int
+bin_read(unsigned int id, unsigned long long off, unsigned long long count,
+         char *path, char *buf)
+{
+  P9_file f;
+  struct iovec iov = {buf, 0};
+  unsigned long long left = (count) ? count : ~0ull;
+  long n;
+  int r = 0;
+
+  if (!(f = p9_open(path, P9_OREAD, -1, conn)))
+    return put_bin_err(BIN_READ, id, "cannot open file");
+  while (!r) {
+    iov.iov_len = (left < BIN_CHUNK) ? left : BIN_CHUNK;
+    if ((n = p9_preadv(&iov, 1, off, f)) < 0) {
+      r = put_bin_err(BIN_READ, id, "read failed");
+      break;
+    }
+    off += n;
+    left -= n;
+    if (n < iov.iov_len || !left) {
+      r = put_bin(BIN_READ, BIN_OK, id, n, buf);
+      break;
+    }
+    r = put_bin(BIN_READ, BIN_MORE, id, n, buf);
+  }
+  p9_close(f);
+  return r;
+}
+
+static int
+bin_write(unsigned int id, unsigned long long off, char *path,
+          unsigned long long size, char *buf)
+{
+  P9_file f;
+  struct iovec iov = {buf, 0};
+  unsigned long long written = 0;
+  unsigned char count[8];
+  long n;
+  int err;
+
+  err = !(f = p9_open(path, P9_OWRITE, -1, conn));
+  while (size > 0) {
+    iov.iov_len = (size < BIN_CHUNK) ? size : BIN_CHUNK;
+    if (read_full(0, buf, iov.iov_len))
+      return -1;
+    size -= iov.iov_len;
+    if (err)
+      continue;
+    if ((n = p9_pwritev(&iov, 1, off + written, f)) >= 0)
+      written += n;
+    err = n < (long)iov.iov_len;
+  }
+  if (f)
+    p9_close(f);
+  if (err)
+    return put_bin_err(BIN_WRITE, id, (f) ? "write failed"
+                                          : "cannot open file");
+  put_le(count, written, 8);
+  return put_bin(BIN_WRITE, BIN_OK, id, sizeof(count), count);
+}
+
+/* Reads requests from stdin until it ends, a command quits or the
+ * framing breaks.  Payloads go between the pipes and p9_preadv and
+ * p9_pwritev in BIN_CHUNK pieces, without stdio. */
+static int
+process_binary(void)
+{
+  unsigned char hdr[BIN_REQSZ];
+  unsigned long long size, off;
+  unsigned int id, argsize;
+  char *buf, *args;
+  int op, r;
+
+  if (!(buf = malloc(BIN_CHUNK)) || !(args = malloc(BIN_MAXARGS + 1)))
+    die("Cannot allocate buffers");
+  running = 1;
+  while (running && !read_full(0, hdr, sizeof(hdr))) {
+    op = hdr[0];
+    id = get_le(hdr + 4, 4);
+    argsize = get_le(hdr + 8, 4);
+    size = get_le(hdr + 12, 8);
+    if (argsize > BIN_MAXARGS || read_full(0, args, argsize))
+      break;
+    args[argsize] = 0;
+    switch (op) {
+    case BIN_CMD:
+      r = bin_cmd(id, argsize, args, size, buf);
+      break;
+    case BIN_READ:
+      if (argsize < 16)
+        goto bad;
+      r = bin_read(id, get_le((unsigned char *)args, 8),
+                   get_le((unsigned char *)args + 8, 8), args + 16, buf);
+      break;
+    case BIN_WRITE:
+      if (argsize < 8)
+        goto bad;
+      off = get_le((unsigned char *)args, 8);
+      r = bin_write(id, off, args + 8, size, buf);
+      break;
+    default:
+    bad:
+      r = skip_data(size, buf) || put_bin_err(op, id, "bad request");
+    }
+    if (r)
+      break;
+  }
+  free(args);
+  free(buf);
+  return 0;
+}
+
+enum {
+  OP_WALK,
+  OP_OPEN,
+  OP_READ,
+  OP_WRITE,
+  OP_STAT,
+  OP_CLUNK,
+  NOPS
+};
+
+enum {
+  VC_NOFID,
+  VC_WALKED,
+  VC_OPEN
+};
+
+static char *opnames[NOPS] = {"walk", "open", "read", "write", "stat",
+                              "clunk"};
+
+/* A virtual client of the benchmark, with a connection of its own. */
+struct vclient {
+  pthread_t thread;
+  int fd;
+  struct p9_conn *c;
+  unsigned int seed;
+  unsigned int fid;
+  int state;
+  unsigned long long off;
+  unsigned long long start;
+  unsigned long long errors[NOPS];
+  struct p9_hist lat[NOPS];
+};
+
+static int bench_clients = 16;
+static int bench_seconds = 5;
+static double bench_rate = 0;
+static int bench_files = 100;
+static int bench_iosize = 4096;
+static char *bench_prefix = "";
+static int bench_weight[NOPS] = {1, 1, 4, 0, 2, 1};
+static int bench_total;
+static volatile int bench_stop;
+
+static unsigned long long
+now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* An operation that cannot be done on the fid of the client yet, or any
+ * more, is replaced with the step towards it. */
+static int
+next_op(struct vclient *v)
+{
+  int op, w = rand_r(&v->seed) % bench_total;
+
+  for (op = 0; w >= bench_weight[op]; w -= bench_weight[op++]) {}
+  switch (op) {
+  case OP_WALK:
+    return (v->state == VC_NOFID) ? OP_WALK : OP_CLUNK;
+  case OP_OPEN:
+    return (v->state == VC_NOFID) ? OP_WALK
+           : (v->state == VC_OPEN) ? OP_CLUNK : OP_OPEN;
+  case OP_READ:
+  case OP_WRITE:
+    return (v->state == VC_NOFID) ? OP_WALK
+           : (v->state == VC_WALKED) ? OP_OPEN : op;
+  }
+  return (v->state == VC_NOFID) ? OP_WALK : op;
+}
+
+static int
+do_op(int op, char *buf, struct vclient *v)
+{
+  struct p9_stat st;
+  char path[256];
+  int n = 0;
+
+  switch (op) {
+  case OP_WALK:
+    snprintf(path, sizeof(path), "%sfile%u", bench_prefix,
+             rand_r(&v->seed) % bench_files);
+    if (p9fid_walk2(path, P9_NOFID, v->c, &v->fid) < 0
+        || v->fid == P9_NOFID)
+      return -1;
+    v->state = VC_WALKED;
+    return 0;
+  case OP_OPEN:
+    n = p9fid_open(v->fid, (bench_weight[OP_WRITE]) ? P9_ORDWR : P9_OREAD,
+                   v->c);
+    v->off = 0;
+    if (!n)
+      v->state = VC_OPEN;
+    break;
+  case OP_READ:
+    if ((n = p9fid_read(v->fid, v->off, bench_iosize, buf, v->c)) >= 0)
+      v->off = (n) ? v->off + n : 0;
+    break;
+  case OP_WRITE:
+    n = p9fid_write(v->fid, 0, bench_iosize, buf, v->c);
+    break;
+  case OP_STAT:
+    n = p9fid_stat(v->fid, &st, v->c);
+    break;
+  case OP_CLUNK:
+    p9fid_close(v->fid, v->c);
+    v->state = VC_NOFID;
+    return 0;
+  }
+  if (n >= 0)
+    return 0;
+  p9fid_close(v->fid, v->c);
+  v->state = VC_NOFID;
+  return -1;
+}
+
+/* In an open loop the latency is counted from when the operation was due,
+ * so a server that falls behind is not measured at the rate it can
+ * keep. */
+static void *
+bench_client(void *aux)
+{
+  struct vclient *v = aux;
+  unsigned long long t, due, step = 0;
+  char *buf;
+  int op;
+
+  if (!(buf = calloc(1, bench_iosize)))
+    die("Cannot allocate buffer");
+  if (bench_rate > 0)
+    step = 1e9 / (bench_rate / bench_clients);
+  due = v->start + ((step) ? rand_r(&v->seed) % step : 0);
+  while (!bench_stop) {
+    t = now_ns();
+    if (step) {
+      if (due > t) {
+        usleep((due - t) / 1000);
+        continue;
+      }
+      t = due;
+      due += step;
+    }
+    op = next_op(v);
+    if (do_op(op, buf, v))
+      ++v->errors[op];
+    p9_hist_add(now_ns() - t, &v->lat[op]);
+  }
+  if (v->state != VC_NOFID)
+    p9fid_close(v->fid, v->c);
+  free(buf);
+  return 0;
+}
+
+static void
+parse_mix(char *s)
+{
+  char *name, *w;
+  int i;
+
+  memset(bench_weight, 0, sizeof(bench_weight));
+  while ((name = strsep(&s, ","))) {
+    if (!(w = strchr(name, ':')))
+      die("Bad mix %s", name);
+    *w++ = 0;
+    for (i = 0; i < NOPS && strcmp(name, opnames[i]); ++i) {}
+    if (i == NOPS)
+      die("Unknown operation %s", name);
+    bench_weight[i] = atoi(w);
+  }
+}
+
+static int
+run_bench(int argc, char **argv)
+{
+  struct vclient *vc;
+  struct p9_hist *lat;
+  unsigned long long t, errors, total = 0;
+  double secs;
+  int i, op;
+  char *usage = "usage: 9client -a address [-p port] bench [-c clients]"
+                " [-d seconds] [-r ops/s]\n"
+                "         [-m op:weight,...] [-n nfiles] [-s iosize]"
+                " [-P prefix]\n"
+                "  ops are walk, open, read, write, stat and clunk"
+                " on prefix/fileN\n";
+
+  for (i = 1; i < argc && argv[i][0] == '-'; ++i)
+    if (!strcmp(argv[i], "-c") && i + 1 < argc)
+      bench_clients = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-d") && i + 1 < argc)
+      bench_seconds = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-r") && i + 1 < argc)
+      bench_rate = atof(argv[++i]);
+    else if (!strcmp(argv[i], "-m") && i + 1 < argc)
+      parse_mix(argv[++i]);
+    else if (!strcmp(argv[i], "-n") && i + 1 < argc)
+      bench_files = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-s") && i + 1 < argc)
+      bench_iosize = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-P") && i + 1 < argc)
+      bench_prefix = argv[++i];
+    else
+      die(usage);
+  for (op = 0, bench_total = 0; op < NOPS; ++op)
+    bench_total += bench_weight[op];
+  if (i < argc || !host || bench_clients <= 0 || bench_files <= 0
+      || bench_iosize <= 0 || bench_total <= 0)
+    die(usage);
+  if (!(vc = calloc(bench_clients, sizeof(struct vclient)))
+      || !(lat = calloc(NOPS, sizeof(struct p9_hist))))
+    die("Cannot allocate clients");
+  for (i = 0; i < bench_clients; ++i) {
+    if ((vc[i].fd = connect_to(host, port)) < 0)
+      die("Cannot connect to host");
+    vc[i].c = mk_p9conn(vc[i].fd, 1);
+    if (!vc[i].c || p9_attach(vc[i].c, user, res) == P9_NOFID)
+      die("Cannot init 9P connection");
+    vc[i].seed = i + 1;
+  }
+  t = now_ns();
+  for (i = 0; i < bench_clients; ++i) {
+    vc[i].start = t;
+    if (pthread_create(&vc[i].thread, 0, bench_client, &vc[i]))
+      die("Cannot start client");
+  }
+  sleep(bench_seconds);
+  bench_stop = 1;
+  for (i = 0; i < bench_clients; ++i)
+    pthread_join(vc[i].thread, 0);
+  secs = (now_ns() - t) / 1e9;
+  printf("%-6s %10s %8s %10s %9s %9s %9s %9s\n", "op", "count", "errors",
+         "ops/s", "p50 us", "p99 us", "p99.9 us", "max us");
+  for (op = 0; op < NOPS; ++op) {
+    for (i = 0, errors = 0; i < bench_clients; ++i) {
+      p9_hist_merge(&vc[i].lat[op], &lat[op]);
+      errors += vc[i].errors[op];
+    }
+    if (!lat[op].count)
+      continue;
+    total += lat[op].count;
+    printf("%-6s %10llu %8llu %10.0f %9.1f %9.1f %9.1f %9.1f\n",
+           (op == OP_CLUNK) ? "clunk*" : opnames[op], lat[op].count,
+           errors, lat[op].count / secs,
+           p9_hist_percentile(50, &lat[op]) / 1e3,
+           p9_hist_percentile(99, &lat[op]) / 1e3,
+           p9_hist_percentile(99.9, &lat[op]) / 1e3, lat[op].max / 1e3);
+  }
+  if (lat[OP_CLUNK].count)
+    printf("* sent without waiting for the reply, the latency is the send"
+           " time only\n");
+  printf("%d clients, %.1f s: %.0f ops/s\n", bench_clients, secs,
+         total / secs);
+  for (i = 0; i < bench_clients; ++i) {
+    rm_p9conn(vc[i].c, 1);
+    close(vc[i].fd);
+  }
+  free(vc);
+  free(lat);
+  return 0;
+}
+
 void
 sighandle(int sig)
 {
@@ -424,9 +1552,14 @@ main(int argc, char **argv)
   int i, ret = 1;
   char *usage = "usage: 9client [-r resource] [-p port] [-a address]"
                 " [runcmd ...]\n"
-                "       9client [-s fd] filecmd...\n";
+                "       9client [-s fd] filecmd...\n"
+                "       9client [-a address] [-p port] [-s fd] -P window [-U]\n"
+                "       9client [-a address] [-p port] [-s fd] -B\n"
+                "       9client -a address [-p port] bench [options]\n";
   char *sockdef;
   
+  out = stdout;
+  input = stdin;
   logmask = 0xff & ~LOG_MSG;
   for (i = 1; i < argc && argv[i][0] == '-'; ++i)
     if (!strcmp(argv[i], "-p") && i + 1 < argc)
@@ -439,6 +1572,14 @@ main(int argc, char **argv)
       fd = atoi(argv[++i]);
     else if (!strcmp(argv[i], "-u") && i + 1 < argc)
       user = argv[++i];
+    else if (!strcmp(argv[i], "-P") && i + 1 < argc) {
+      window = atoi(argv[++i]);
+      if (window > MAX_WINDOW)
+        window = MAX_WINDOW;
+    } else if (!strcmp(argv[i], "-U"))
+      unordered = 1;
+    else if (!strcmp(argv[i], "-B"))
+      binary = 1;
     else if (!strcmp(argv[i], "-hcmd")) {
       for (i = 0; cmds[i].s; ++i)
         printf("  %s %s\n", cmds[i].s, cmds[i].help ? cmds[i].help : "");
@@ -453,6 +1594,8 @@ main(int argc, char **argv)
   }
   if (!user && !(user = getenv("USER")))
     user = "nobody";
+  if (argc > i && !strcmp(argv[i], "bench"))
+    return run_bench(argc - i, argv + i);
   signal(SIGHUP, sighandle);
   signal(SIGINT, sighandle);
   signal(SIGQUIT, sighandle);
@@ -466,13 +1609,22 @@ main(int argc, char **argv)
   }
   if (host)
     init_connection(fd);
+  else if (argc == i)
+    use_connection(fd);
   if (host && argc > i) {
     rm_p9conn(conn, 0);
+    stop_trace();
     execvp(argv[i], argv + i + 1);
     perror("exec");
+  } else if (argc == i && binary) {
+    process_binary();
+    rm_p9conn(conn, host != 0);
+  } else if (argc == i && window > 0) {
+    process_pipelined();
+    rm_p9conn(conn, host != 0);
   } else if (argc == i) {
     process_stdin();
-    rm_p9conn(conn, 1);
+    rm_p9conn(conn, host != 0);
   } else
     ret = process_command(argc - i, argv + i);
   return ret;
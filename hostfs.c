@@ -0,0 +1,743 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "9p.h"
+#include "9pfid.h"
+#include "9psrv.h"
+#include "hostfs.h"
+#include "util.h"
+
+/* Every fid holds an O_PATH descriptor of its file and, once opened, a
+ * regular one.  path is relative to the exported directory. */
+struct hostfid {
+  struct p9_fid f;
+  int fd;
+  int ofd;
+  char *path;
+  pthread_mutex_t lock;
+  unsigned long long diroff;
+  long long dirpos;
+};
+
+struct linux_dirent64 {
+  unsigned long long d_ino;
+  long long d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+static void hostfs_version(struct p9_connection *c);
+static void hostfs_auth(struct p9_connection *c);
+static void hostfs_attach(struct p9_connection *c);
+static void hostfs_flush(struct p9_connection *c);
+static void hostfs_walk(struct p9_connection *c);
+static void hostfs_walk1(struct p9_connection *c, struct p9_fs *fs);
+static void hostfs_open(struct p9_connection *c);
+static void hostfs_create(struct p9_connection *c);
+static void hostfs_read(struct p9_connection *c);
+static void hostfs_write(struct p9_connection *c);
+static void hostfs_clunk(struct p9_connection *c);
+static void hostfs_remove(struct p9_connection *c);
+static void hostfs_stat(struct p9_connection *c);
+static void hostfs_wstat(struct p9_connection *c);
+static void hostfs_connect(struct p9_connection *c);
+static void hostfs_disconnect(struct p9_connection *c);
+
+static struct p9_fs fs = {
+  .version = hostfs_version,
+  .auth = hostfs_auth,
+  .attach = hostfs_attach,
+  .flush = hostfs_flush,
+  .walk = hostfs_walk,
+  .walk1 = hostfs_walk1,
+  .open = hostfs_open,
+  .create = hostfs_create,
+  .read = hostfs_read,
+  .write = hostfs_write,
+  .clunk = hostfs_clunk,
+  .remove = hostfs_remove,
+  .stat = hostfs_stat,
+  .wstat = hostfs_wstat,
+  .connect = hostfs_connect,
+  .disconnect = hostfs_disconnect,
+};
+
+static int rootfd = -1;
+
+static const char *Enofid = "unknown fid";
+static const char *Einuse = "fid already in use";
+static const char *Eopen = "fid is open";
+static const char *Enotopen = "fid is not open for that";
+static const char *Eisdir = "is a directory";
+static const char *Ename = "bad file name";
+static const char *Eoffset = "bad directory offset";
+static const char *Enomem = "out of memory";
+
+#define ERR(c, e) P9_SET_STR((c)->r.ename, (char *)(e))
+#define SYSERR(c) ERR(c, strerror(errno))
+#define IOHDRSZ 24
+
+static int
+is_root(const char *path)
+{
+  return path[0] == '.' && !path[1];
+}
+
+static const char *
+base_name(const char *path)
+{
+  const char *p = strrchr(path, '/');
+  return (p) ? p + 1 : (is_root(path)) ? "/" : path;
+}
+
+/* Names from messages are not terminated; buf has NAME_MAX + 1 bytes. */
+static int
+get_name(char *buf, const char *name, int len)
+{
+  errno = (len > NAME_MAX) ? ENAMETOOLONG : ENOENT;
+  if (!len || len > NAME_MAX || strnchr(name, len, '/')
+      || strnchr(name, len, 0) || (len == 1 && name[0] == '.')
+      || (len == 2 && !memcmp(name, "..", 2)))
+    return -1;
+  memcpy(buf, name, len);
+  buf[len] = 0;
+  return 0;
+}
+
+static char *
+join_path(const char *dir, const char *name)
+{
+  char *p;
+  int n = strlen(dir), len = strlen(name);
+
+  if (is_root(dir))
+    return strdup(name);
+  if (!(p = malloc(n + len + 2)))
+    return 0;
+  memcpy(p, dir, n);
+  p[n] = '/';
+  memcpy(p + n + 1, name, len);
+  p[n + len + 1] = 0;
+  return p;
+}
+
+static char *
+parent_path(const char *path)
+{
+  const char *p = strrchr(path, '/');
+  return (p) ? strndup(path, p - path) : strdup(".");
+}
+
+/* The parent directory of path, for operations on a name in it. */
+static int
+open_parent(const char *path)
+{
+  char *dir = parent_path(path);
+  int fd;
+
+  if (!dir)
+    return -1;
+  fd = openat(rootfd, dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+  free(dir);
+  return fd;
+}
+
+/* O_PATH descriptors can be opened for real only through /proc. */
+static int
+reopen(int fd, int flags)
+{
+  char path[32];
+
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+  return open(path, flags | O_CLOEXEC);
+}
+
+static void
+fill_qid(struct stat *st, struct p9_qid *qid)
+{
+  qid->type = (S_ISDIR(st->st_mode)) ? P9_QTDIR
+              : (S_ISLNK(st->st_mode)) ? P9_QTSYMLINK : P9_QTFILE;
+  qid->version = st->st_mtim.tv_sec ^ st->st_mtim.tv_nsec;
+  qid->path = st->st_ino;
+}
+
+/* uid and gid are numeric, into the 2 * 16 bytes of ids. */
+static void
+fill_stat(struct stat *st, const char *name, char *ids, struct p9_stat *s)
+{
+  memset(s, 0, sizeof(*s));
+  fill_qid(st, &s->qid);
+  s->mode = st->st_mode & 0777;
+  if (S_ISDIR(st->st_mode))
+    s->mode |= P9_DMDIR;
+  s->atime = st->st_atime;
+  s->mtime = st->st_mtime;
+  s->length = (S_ISDIR(st->st_mode)) ? 0 : st->st_size;
+  P9_SET_STR(s->name, (char *)name);
+  snprintf(ids, 16, "%u", (unsigned int)st->st_uid);
+  snprintf(ids + 16, 16, "%u", (unsigned int)st->st_gid);
+  P9_SET_STR(s->uid, ids);
+  P9_SET_STR(s->gid, ids + 16);
+  P9_SET_STR(s->muid, ids);
+  s->size = p9_stat_size(s);
+}
+
+static void
+rm_hostfid(struct p9_fid *fid)
+{
+  struct hostfid *f = containerof(fid, struct hostfid, f);
+  int dfd;
+
+  if (f->ofd >= 0)
+    close(f->ofd);
+  if (fid->open_mode != P9_NOTOPEN && (fid->open_mode & P9_ORCLOSE)
+      && (dfd = open_parent(f->path)) >= 0) {
+    unlinkat(dfd, base_name(f->path),
+             (fid->qid.type & P9_QTDIR) ? AT_REMOVEDIR : 0);
+    close(dfd);
+  }
+  close(f->fd);
+  free(f->path);
+  pthread_mutex_destroy(&f->lock);
+}
+
+static int
+clone_hostfid(struct p9_fid *dst, struct p9_fid *src)
+{
+  struct hostfid *d = containerof(dst, struct hostfid, f);
+  struct hostfid *s = containerof(src, struct hostfid, f);
+
+  if ((d->fd = fcntl(s->fd, F_DUPFD_CLOEXEC, 0)) < 0)
+    return -1;
+  if (!(d->path = strdup(s->path))) {
+    close(d->fd);
+    return -1;
+  }
+  d->ofd = -1;
+  d->diroff = 0;
+  d->dirpos = 0;
+  pthread_mutex_init(&d->lock, 0);
+  return 0;
+}
+
+static struct hostfid *
+get_fid(struct p9_connection *c, unsigned int fid)
+{
+  struct p9_fid *f = p9_fidtab_get(fid, c->aux);
+  return (f) ? containerof(f, struct hostfid, f) : 0;
+}
+
+/* Takes over fd and path. */
+static struct hostfid *
+new_fid(struct p9_connection *c, unsigned int fid, int fd, char *path,
+        struct p9_qid *qid)
+{
+  struct p9_fid *f;
+  struct hostfid *h;
+
+  f = p9_fidtab_add(fid, c->aux);
+  if (!f)
+    return 0;
+  h = containerof(f, struct hostfid, f);
+  f->qid = *qid;
+  f->rm = rm_hostfid;
+  f->clone = clone_hostfid;
+  h->fd = fd;
+  h->ofd = -1;
+  h->path = path;
+  pthread_mutex_init(&h->lock, 0);
+  return h;
+}
+
+static void
+del_fid(struct p9_connection *c, struct hostfid *fid)
+{
+  p9_fidtab_del(&fid->f, c->aux);
+}
+
+static void *
+get_buf(struct p9_connection *c)
+{
+  if (!c->buf)
+    c->buf = malloc(c->msize);
+  return c->buf;
+}
+
+static void
+hostfs_version(struct p9_connection *c)
+{
+  c->r.msize = c->t.msize;
+  if (c->t.version_len >= 6 && !strncmp(c->t.version, P9_VERSION, 6))
+    P9_SET_STR(c->r.version, P9_VERSION);
+  else
+    P9_SET_STR(c->r.version, "unknown");
+}
+
+static void
+hostfs_auth(struct p9_connection *c)
+{
+  ERR(c, "authentication not required");
+}
+
+static void
+hostfs_attach(struct p9_connection *c)
+{
+  struct stat st;
+  struct p9_qid qid;
+  char *path;
+  int fd;
+
+  if (get_fid(c, c->t.fid)) {
+    ERR(c, Einuse);
+    return;
+  }
+  if ((fd = fcntl(rootfd, F_DUPFD_CLOEXEC, 0)) < 0 || fstat(fd, &st)) {
+    SYSERR(c);
+    if (fd >= 0)
+      close(fd);
+    return;
+  }
+  fill_qid(&st, &qid);
+  if (!(path = strdup(".")) || !new_fid(c, c->t.fid, fd, path, &qid)) {
+    ERR(c, Enomem);
+    free(path);
+    close(fd);
+    return;
+  }
+  c->r.aqid = qid;
+}
+
+static void
+hostfs_flush(struct p9_connection *c)
+{
+}
+
+static void
+hostfs_walk(struct p9_connection *c)
+{
+  p9_fidtab_walk(c, &fs, c->aux);
+}
+
+/* Every element is opened O_PATH relative to the previous one, without
+ * following symlinks.  ".." never leaves the exported directory. */
+static void
+hostfs_walk1(struct p9_connection *c, struct p9_fs *fs)
+{
+  struct hostfid *fid = containerof(c->t.pfid, struct hostfid, f);
+  struct stat st;
+  char name[NAME_MAX + 1], *path = 0;
+  unsigned int i = c->r.nwqid;
+  int fd;
+
+  if (c->t.wname_len[i] == 2 && !memcmp(c->t.wname[i], "..", 2)) {
+    if (is_root(fid->path))
+      fd = fcntl(fid->fd, F_DUPFD_CLOEXEC, 0);
+    else
+      fd = openat(fid->fd, "..", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0)
+      path = parent_path(fid->path);
+  } else if (get_name(name, c->t.wname[i], c->t.wname_len[i]))
+    fd = -1;
+  else if ((fd = openat(fid->fd, name, O_PATH | O_NOFOLLOW | O_CLOEXEC)) >= 0)
+    path = join_path(fid->path, name);
+  if (fd >= 0 && !path)
+    errno = ENOMEM;
+  if (fd < 0 || !path || fstat(fd, &st)) {
+    SYSERR(c);
+    if (fd >= 0)
+      close(fd);
+    free(path);
+    return;
+  }
+  close(fid->fd);
+  free(fid->path);
+  fid->fd = fd;
+  fid->path = path;
+  fill_qid(&st, &c->r.wqid[i]);
+}
+
+static int
+open_flags(unsigned int mode)
+{
+  int flags;
+
+  switch (mode & 3) {
+  case P9_OWRITE: flags = O_WRONLY; break;
+  case P9_ORDWR: flags = O_RDWR; break;
+  default: flags = O_RDONLY;
+  }
+  if (mode & P9_OTRUNC)
+    flags |= O_TRUNC;
+  if (mode & P9_OAPPEND)
+    flags |= O_APPEND;
+  return flags;
+}
+
+static void
+hostfs_open(struct p9_connection *c)
+{
+  struct hostfid *fid;
+  struct stat st;
+
+  fid = get_fid(c, c->t.fid);
+  if (!fid)
+    ERR(c, Enofid);
+  else if (fid->f.open_mode != P9_NOTOPEN)
+    ERR(c, Eopen);
+  else if ((fid->f.qid.type & P9_QTDIR) && (P9_WRITE_MODE(c->t.mode)
+                                             || (c->t.mode & P9_OTRUNC)))
+    ERR(c, Eisdir);
+  else if (fid->f.qid.type & P9_QTSYMLINK)
+    ERR(c, "cannot open a symbolic link");
+  if (c->r.ename)
+    return;
+  fid->ofd = reopen(fid->fd, open_flags(c->t.mode));
+  if (fid->ofd < 0 || fstat(fid->ofd, &st)) {
+    SYSERR(c);
+    return;
+  }
+  fill_qid(&st, &fid->f.qid);
+  fid->f.open_mode = c->t.mode;
+  fid->diroff = 0;
+  fid->dirpos = 0;
+  c->r.qid = fid->f.qid;
+  c->r.iounit = c->msize - IOHDRSZ;
+}
+
+static void
+hostfs_create(struct p9_connection *c)
+{
+  struct hostfid *fid;
+  struct stat st;
+  char name[NAME_MAX + 1], *path;
+  int fd = -1, ofd = -1;
+
+  fid = get_fid(c, c->t.fid);
+  if (!fid)
+    ERR(c, Enofid);
+  else if (fid->f.open_mode != P9_NOTOPEN)
+    ERR(c, Eopen);
+  else if (!(fid->f.qid.type & P9_QTDIR))
+    ERR(c, "not a directory");
+  else if (get_name(name, c->t.name, c->t.name_len))
+    ERR(c, Ename);
+  if (c->r.ename)
+    return;
+  if (!(path = join_path(fid->path, name))) {
+    ERR(c, Enomem);
+    return;
+  }
+  if (c->t.perm & P9_DMDIR) {
+    if (!mkdirat(fid->fd, name, c->t.perm & 0777))
+      ofd = openat(fid->fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW
+                                  | O_CLOEXEC);
+  } else
+    ofd = openat(fid->fd, name, open_flags(c->t.mode) | O_CREAT | O_EXCL
+                                | O_NOFOLLOW | O_CLOEXEC, c->t.perm & 0777);
+  if (ofd < 0 || fstat(ofd, &st)
+      || (fd = openat(fid->fd, name, O_PATH | O_NOFOLLOW | O_CLOEXEC)) < 0) {
+    SYSERR(c);
+    if (ofd >= 0)
+      close(ofd);
+    free(path);
+    return;
+  }
+  close(fid->fd);
+  free(fid->path);
+  fid->fd = fd;
+  fid->ofd = ofd;
+  fid->path = path;
+  fill_qid(&st, &fid->f.qid);
+  fid->f.open_mode = c->t.mode;
+  fid->diroff = 0;
+  fid->dirpos = 0;
+  c->r.qid = fid->f.qid;
+  c->r.iounit = c->msize - IOHDRSZ;
+}
+
+/* Entries are packed from where the previous read stopped; the 9P offset
+ * must continue that read or be 0 to start over. */
+static void
+read_dir(struct p9_connection *c, struct hostfid *fid, unsigned int count)
+{
+  char dbuf[8192], ids[32], *buf;
+  struct linux_dirent64 *d;
+  struct p9_stat s;
+  struct stat st;
+  long long pos;
+  unsigned int n = 0;
+  int r, i;
+
+  if (!(buf = get_buf(c))) {
+    ERR(c, Enomem);
+    return;
+  }
+  pthread_mutex_lock(&fid->lock);
+  if (c->t.offset == 0)
+    fid->diroff = fid->dirpos = 0;
+  else if (c->t.offset != fid->diroff) {
+    ERR(c, Eoffset);
+    goto out;
+  }
+  if (lseek(fid->ofd, fid->dirpos, SEEK_SET) < 0) {
+    SYSERR(c);
+    goto out;
+  }
+  pos = fid->dirpos;
+  while ((r = syscall(SYS_getdents64, fid->ofd, dbuf, sizeof(dbuf))) > 0) {
+    for (i = 0; i < r; i += d->d_reclen, pos = d->d_off) {
+      d = (struct linux_dirent64 *)(dbuf + i);
+      if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, "..")
+          || fstatat(fid->ofd, d->d_name, &st, AT_SYMLINK_NOFOLLOW))
+        continue;
+      fill_stat(&st, d->d_name, ids, &s);
+      if (n + s.size + 2 > count || p9_pack_stat(count - n, buf + n, &s))
+        goto done;
+      n += s.size + 2;
+    }
+  }
+  if (r < 0 && !n) {
+    SYSERR(c);
+    goto out;
+  }
+done:
+  fid->dirpos = pos;
+  fid->diroff += n;
+  c->r.count = n;
+  c->r.data = buf;
+out:
+  pthread_mutex_unlock(&fid->lock);
+}
+
+/* File data goes straight from the page cache to the socket. */
+static void
+hostfs_read(struct p9_connection *c)
+{
+  struct hostfid *fid;
+  struct stat st;
+  unsigned int count = c->t.count;
+  unsigned long long n;
+  ssize_t r;
+
+  if (count > c->msize - IOHDRSZ)
+    count = c->msize - IOHDRSZ;
+  fid = get_fid(c, c->t.fid);
+  if (!fid)
+    ERR(c, Enofid);
+  else if (fid->f.open_mode == P9_NOTOPEN || !P9_READ_MODE(fid->f.open_mode))
+    ERR(c, Enotopen);
+  if (c->r.ename)
+    return;
+  if (fid->f.qid.type & P9_QTDIR) {
+    read_dir(c, fid, count);
+    return;
+  }
+  if (fstat(fid->ofd, &st)) {
+    SYSERR(c);
+    return;
+  }
+  n = (c->t.offset < st.st_size) ? st.st_size - c->t.offset : 0;
+  if (n > count)
+    n = count;
+  if (!S_ISREG(st.st_mode) || !n
+      || p9srv_sendfile(c, fid->ofd, c->t.offset, n)) {
+    if (!get_buf(c)) {
+      ERR(c, Enomem);
+      return;
+    }
+    r = pread(fid->ofd, c->buf, count, c->t.offset);
+    if (r < 0) {
+      SYSERR(c);
+      return;
+    }
+    c->r.data = c->buf;
+    c->r.count = r;
+  }
+}
+
+static void
+hostfs_write(struct p9_connection *c)
+{
+  struct hostfid *fid;
+  ssize_t r;
+
+  fid = get_fid(c, c->t.fid);
+  if (!fid)
+    ERR(c, Enofid);
+  else if (fid->f.open_mode == P9_NOTOPEN || !P9_WRITE_MODE(fid->f.open_mode))
+    ERR(c, Enotopen);
+  if (c->r.ename)
+    return;
+  r = pwrite(fid->ofd, c->t.data, c->t.count, c->t.offset);
+  if (r < 0)
+    SYSERR(c);
+  else
+    c->r.count = r;
+}
+
+static void
+hostfs_clunk(struct p9_connection *c)
+{
+  struct hostfid *fid;
+
+  if ((fid = get_fid(c, c->t.fid)))
+    del_fid(c, fid);
+  else
+    ERR(c, Enofid);
+}
+
+static void
+hostfs_remove(struct p9_connection *c)
+{
+  struct hostfid *fid;
+  int dfd;
+
+  if (!(fid = get_fid(c, c->t.fid))) {
+    ERR(c, Enofid);
+    return;
+  }
+  if (is_root(fid->path))
+    ERR(c, "cannot remove root");
+  else if ((dfd = open_parent(fid->path)) < 0)
+    SYSERR(c);
+  else {
+    if (unlinkat(dfd, base_name(fid->path),
+                 (fid->f.qid.type & P9_QTDIR) ? AT_REMOVEDIR : 0))
+      SYSERR(c);
+    close(dfd);
+  }
+  fid->f.open_mode = P9_NOTOPEN;
+  del_fid(c, fid);
+}
+
+static void
+hostfs_stat(struct p9_connection *c)
+{
+  struct hostfid *fid;
+  struct stat st;
+
+  if (!(fid = get_fid(c, c->t.fid)))
+    ERR(c, Enofid);
+  else if (fstat(fid->fd, &st))
+    SYSERR(c);
+  else if (!get_buf(c))
+    ERR(c, Enomem);
+  else
+    fill_stat(&st, base_name(fid->path), c->buf, &c->r.stat);
+}
+
+static int
+rename_fid(struct hostfid *fid, const char *name)
+{
+  char *dir, *path;
+  int dfd, r = -1;
+
+  if (!(dir = parent_path(fid->path)))
+    return -1;
+  path = join_path(dir, name);
+  free(dir);
+  if (!path)
+    return -1;
+  if ((dfd = open_parent(fid->path)) >= 0) {
+    r = renameat(dfd, base_name(fid->path), dfd, name);
+    close(dfd);
+  }
+  if (r) {
+    free(path);
+    return -1;
+  }
+  free(fid->path);
+  fid->path = path;
+  return 0;
+}
+
+static void
+hostfs_wstat(struct p9_connection *c)
+{
+  struct hostfid *fid;
+  struct p9_stat *st = &c->t.stat;
+  struct timespec ts[2];
+  char name[NAME_MAX + 1], proc[32];
+  int fd;
+
+  if (!(fid = get_fid(c, c->t.fid))) {
+    ERR(c, Enofid);
+    return;
+  }
+  snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fid->fd);
+  if (st->name_len) {
+    if (is_root(fid->path) || get_name(name, st->name, st->name_len)) {
+      ERR(c, Ename);
+      return;
+    }
+    if (strcmp(name, base_name(fid->path)) && rename_fid(fid, name)) {
+      SYSERR(c);
+      return;
+    }
+  }
+  if (st->length != ~0ull && !(fid->f.qid.type & P9_QTDIR)) {
+    if ((fd = reopen(fid->fd, O_WRONLY)) < 0 || ftruncate(fd, st->length)) {
+      SYSERR(c);
+      if (fd >= 0)
+        close(fd);
+      return;
+    }
+    close(fd);
+  }
+  if (st->mode != ~0u && chmod(proc, st->mode & 0777)) {
+    SYSERR(c);
+    return;
+  }
+  if (st->mtime != ~0u) {
+    ts[0].tv_nsec = UTIME_OMIT;
+    ts[1].tv_sec = st->mtime;
+    ts[1].tv_nsec = 0;
+    if (utimensat(AT_FDCWD, proc, ts, 0))
+      SYSERR(c);
+  }
+}
+
+static void
+hostfs_connect(struct p9_connection *c)
+{
+  c->aux = mk_p9fidtab(sizeof(struct hostfid));
+}
+
+static void
+hostfs_disconnect(struct p9_connection *c)
+{
+  rm_p9fidtab(c->aux);
+  c->aux = 0;
+}
+
+/* Exports the directory tree at dir.  Reads of regular files use
+ * p9srv_sendfile, so this backend only runs under the 9psrv runtime. */
+struct p9_fs *
+mk_hostfs(const char *dir)
+{
+  if (rootfd >= 0)
+    return &fs;
+  rootfd = open(dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+  return (rootfd >= 0) ? &fs : 0;
+}
+
+void
+rm_hostfs(void)
+{
+  if (rootfd < 0)
+    return;
+  close(rootfd);
+  rootfd = -1;
+}
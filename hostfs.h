@@ -0,0 +1,4 @@
+struct p9_fs;
+
+struct p9_fs *mk_hostfs(const char *dir);
+void rm_hostfs(void);
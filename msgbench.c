@@ -0,0 +1,464 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "9p.h"
+#include "9pmsg.h"
+#include "9pconn.h"
+#include "ramfs.h"
+#include "seq.h"
+#include "util.h"
+
+#define NINFLIGHT 10000
+#define MAXRESULTS 128
+#define MSIZE 65536
+
+struct result {
+  char name[32];
+  unsigned int bytes;
+  double ns;
+};
+
+int logmask;
+
+static int iters = 1000000;
+static char data[8192];
+static volatile unsigned long long sink;
+static struct result results[MAXRESULTS];
+static int nresults;
+
+static double
+now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void
+die(char *fmt, ...)
+{
+  va_list args;
+
+  va_start(args, fmt);
+  vfprintf(stderr, fmt, args);
+  va_end(args);
+  fputc('\n', stderr);
+  exit(1);
+}
+
+static void
+add_result(const char *name, unsigned int bytes, double ns)
+{
+  if (nresults == MAXRESULTS)
+    die("Too many results");
+  snprintf(results[nresults].name, sizeof(results[nresults].name), "%s",
+           name);
+  results[nresults].bytes = bytes;
+  results[nresults++].ns = ns;
+}
+
+#define SET_STR(x, s) ((x) = (s), (x##_len) = strlen(s))
+
+/* A representative message of each type. */
+static void
+sample(unsigned int type, struct p9_msg *m)
+{
+  static char *path[] = {"usr", "share", "doc", "9p", "README"};
+  int i;
+
+  memset(m, 0, sizeof(*m));
+  m->type = type;
+  m->tag = 42;
+  m->fid = 7;
+  m->newfid = 8;
+  m->afid = P9_NOFID;
+  m->msize = 65536;
+  m->iounit = 65512;
+  m->oldtag = 41;
+  m->mode = P9_ORDWR;
+  m->perm = 0644;
+  m->offset = 1 << 20;
+  m->count = (type == P9_TREAD || type == P9_RWRITE) ? 4096 : 0;
+  if (type == P9_RREAD || type == P9_TWRITE) {
+    m->count = 4096;
+    m->data = data;
+  }
+  SET_STR(m->version, "9P2000");
+  SET_STR(m->uname, "glenda");
+  SET_STR(m->aname, "/");
+  SET_STR(m->ename, "file does not exist");
+  SET_STR(m->name, "newfile");
+  m->nwname = m->nwqid = 5;
+  for (i = 0; i < 5; ++i) {
+    m->wname[i] = path[i];
+    m->wname_len[i] = strlen(path[i]);
+    m->wqid[i].path = i + 100;
+  }
+  m->qid.path = m->aqid.path = 99;
+  m->stat.qid.path = 99;
+  m->stat.mode = 0644;
+  m->stat.length = 12345;
+  SET_STR(m->stat.name, "README");
+  SET_STR(m->stat.uid, "glenda");
+  SET_STR(m->stat.gid, "glenda");
+  SET_STR(m->stat.muid, "glenda");
+}
+
+static void
+codec(void)
+{
+  static char buf[16384];
+  struct p9_msg m, u;
+  unsigned int t, size;
+  char name[32];
+  double t0;
+  int i;
+
+  for (t = P9_XSTART; t < P9_XEND; ++t) {
+    if (!p9_schema[t - P9_XSTART].name)
+      continue;
+    sample(t, &m);
+    t0 = now();
+    for (i = 0; i < iters; ++i)
+      if (p9_pack_msg(sizeof(buf), buf, &m))
+        die("Cannot pack %s", p9_schema[t - P9_XSTART].name);
+    size = (unsigned char)buf[0] | (unsigned char)buf[1] << 8;
+    snprintf(name, sizeof(name), "pack/%s", p9_schema[t - P9_XSTART].name);
+    add_result(name, size, (now() - t0) * 1e9 / iters);
+    t0 = now();
+    for (i = 0; i < iters; ++i)
+      if (p9_unpack_msg(sizeof(buf), buf, &u))
+        die("Cannot unpack %s", p9_schema[t - P9_XSTART].name);
+    snprintf(name, sizeof(name), "unpack/%s", p9_schema[t - P9_XSTART].name);
+    add_result(name, size, (now() - t0) * 1e9 / iters);
+  }
+}
+
+/* Directories of n entries as the data of Rread, unpacked the way
+ * p9_readdir walks them.  The time is per entry. */
+static void
+readdir(void)
+{
+  static int sizes[] = {10, 100, 1000};
+  struct p9_msg m;
+  struct p9_stat st;
+  char *dir, name[32];
+  double t0;
+  int i, j, k, n, off, len, loops;
+
+  for (k = 0; k < NITEMS(sizes); ++k) {
+    n = sizes[k];
+    sample(P9_RSTAT, &m);
+    if (!(dir = malloc(n * 128)))
+      die("Cannot allocate directory");
+    for (i = len = 0; i < n; ++i) {
+      snprintf(name, sizeof(name), "file%d", i);
+      SET_STR(m.stat.name, name);
+      m.stat.qid.path = i;
+      m.stat.size = p9_stat_size(&m.stat);
+      if (p9_pack_stat(n * 128 - len, dir + len, &m.stat))
+        die("Cannot pack directory");
+      len += m.stat.size + 2;
+    }
+    loops = iters / n + 1;
+    t0 = now();
+    for (j = 0; j < loops; ++j)
+      for (off = 0; off < len; off += st.size + 2)
+        if (p9_unpack_stat(len - off, dir + off, &st))
+          die("Cannot unpack directory");
+    snprintf(name, sizeof(name), "readdir/%d", n);
+    add_result(name, len, (now() - t0) * 1e9 / ((double)loops * n));
+    free(dir);
+  }
+}
+
+/* Tags or fids taken and given back with a share of the 1024 in use.  Two
+ * are dropped each round, so one comes back through the last drop and
+ * the other from a scan of the bitmap. */
+static void
+seq(void)
+{
+  static int pct[] = {0, 50, 90, 99};
+  struct p9_seq *s;
+  unsigned int *held, seed = 1, a, b;
+  char name[32];
+  double t0;
+  int i, k, n;
+
+  if (!(held = malloc(1024 * sizeof(unsigned int))))
+    die("Cannot allocate tags");
+  for (k = 0; k < NITEMS(pct); ++k) {
+    if (!(s = mk_p9seq()))
+      die("Cannot allocate sequence");
+    n = 1024 * pct[k] / 100 + 2;
+    for (i = 0; i < n; ++i)
+      held[i] = p9_seq_next(s);
+    t0 = now();
+    for (i = 0; i < iters; ++i) {
+      a = rand_r(&seed) % n;
+      b = (a + 1 + rand_r(&seed) % (n - 1)) % n;
+      p9_seq_drop(held[a], s);
+      p9_seq_drop(held[b], s);
+      held[a] = p9_seq_next(s);
+      held[b] = p9_seq_next(s);
+    }
+    snprintf(name, sizeof(name), "seq/%d%%", pct[k]);
+    add_result(name, 0, (now() - t0) * 1e9 / (2.0 * iters));
+    rm_p9seq(s);
+  }
+  free(held);
+}
+
+static void
+args(void)
+{
+  static char line[4096], buf[4096];
+  char *argv[256];
+  double t0;
+  int i, len = 0, loops = iters / 10 + 1;
+
+  for (i = 0; i < 100; ++i)
+    len += snprintf(line + len, sizeof(line) - len,
+                    (i % 4) ? "arg%d " : "\"quoted arg %d\" ", i);
+  t0 = now();
+  for (i = 0; i < loops; ++i) {
+    memcpy(buf, line, len + 1);
+    if (parse_args(buf, NITEMS(argv), argv) != 100)
+      die("Bad parse_args");
+  }
+  add_result("parse_args/100", len, (now() - t0) * 1e9 / loops);
+}
+
+struct loop {
+  struct p9_fs *fs;
+  int fd;
+};
+
+/* Answers requests one at a time, without the server's event loop. */
+static void *
+loopback_srv(void *aux)
+{
+  struct loop *l = aux;
+  struct p9_fs *fs = l->fs;
+  struct p9_connection c;
+  static unsigned char in[MSIZE], out[MSIZE];
+  unsigned int size, got, r;
+  int fd = l->fd;
+
+  memset(&c, 0, sizeof(c));
+  c.msize = MSIZE;
+  if (!(c.buf = malloc(MSIZE)))
+    die("Cannot allocate buffer");
+  fs->connect(&c);
+  for (;;) {
+    for (got = 0; got < 4 || got < (size = in[0] | in[1] << 8
+                                     | in[2] << 16 | in[3] << 24);
+         got += r)
+      if ((int)(r = recv(fd, in + got, (got < 4) ? 4 - got : size - got,
+                         0)) <= 0)
+        goto done;
+    if (p9_unpack_msg(size, (char *)in, &c.t))
+      break;
+    p9_process_treq(&c, fs);
+    if (c.t.type == P9_TVERSION && c.r.msize > MSIZE)
+      c.r.msize = MSIZE;
+    size = p9_msg_size(&c.r);
+    p9_pack_msg_sized(size, (char *)out, &c.r);
+    if (send(fd, out, size, 0) != size)
+      break;
+  }
+done:
+  fs->disconnect(&c);
+  free(c.buf);
+  return 0;
+}
+
+static void
+loopback(void)
+{
+  static int sizes[] = {128, 4096, 32768};
+  static char buf[32768];
+  struct loop l;
+  struct p9_conn *c;
+  pthread_t thread;
+  unsigned int fid;
+  char name[32];
+  double t0;
+  int i, k, fd[2], loops = iters / 20 + 1;
+
+  if (!(l.fs = mk_ramfs(1, sizeof(buf), 0)))
+    die("Cannot create file tree");
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fd))
+    die("Cannot create socket pair");
+  l.fd = fd[1];
+  if (pthread_create(&thread, 0, loopback_srv, &l))
+    die("Cannot start server thread");
+  if (!(c = mk_p9conn(fd[0], 1)) || p9_attach(c, "bench", "") == P9_NOFID
+      || p9fid_walk2("file0", P9_NOFID, c, &fid) < 0 || fid == P9_NOFID
+      || p9fid_open(fid, P9_ORDWR, c))
+    die("Cannot open loopback file");
+  for (k = 0; k < NITEMS(sizes); ++k) {
+    t0 = now();
+    for (i = 0; i < loops; ++i)
+      if (p9fid_write(fid, 0, sizes[k], buf, c) != sizes[k])
+        die("Cannot write loopback file");
+    snprintf(name, sizeof(name), "loopback/write/%d", sizes[k]);
+    add_result(name, sizes[k], (now() - t0) * 1e9 / loops);
+    t0 = now();
+    for (i = 0; i < loops; ++i)
+      if (p9fid_read(fid, 0, sizes[k], buf, c) != sizes[k])
+        die("Cannot read loopback file");
+    snprintf(name, sizeof(name), "loopback/read/%d", sizes[k]);
+    add_result(name, sizes[k], (now() - t0) * 1e9 / loops);
+  }
+  p9fid_close(fid, c);
+  rm_p9conn(c, 1);
+  close(fd[0]);
+  pthread_join(thread, 0);
+  close(fd[1]);
+  rm_ramfs();
+}
+
+/* NINFLIGHT requests kept unpacked, as by a server with that many in
+ * flight, and scanned for a fid the way it checks for conflicts. */
+static void
+inflight(void)
+{
+  static unsigned int types[] = {P9_TREAD, P9_TWRITE, P9_TWALK, P9_TSTAT};
+  struct p9_msg m, *full;
+  struct p9_cmsg *compact;
+  char *wire;
+  unsigned long long sum = 0;
+  double t0;
+  int i, j, size = 128;
+
+  wire = malloc((size_t)NINFLIGHT * size);
+  full = malloc(NINFLIGHT * sizeof(struct p9_msg));
+  compact = malloc(NINFLIGHT * sizeof(struct p9_cmsg));
+  if (!wire || !full || !compact)
+    die("Cannot allocate requests");
+  for (i = 0; i < NINFLIGHT; ++i) {
+    sample(types[i % 4], &m);
+    m.fid = i;
+    m.count = (m.type == P9_TWRITE) ? 16 : m.count;
+    if (p9_pack_msg(size, wire + (size_t)i * size, &m)
+        || p9_unpack_msg(size, wire + (size_t)i * size, &full[i])
+        || p9_unpack_cmsg(size, wire + (size_t)i * size, &compact[i]))
+      die("Cannot pack requests");
+  }
+  t0 = now();
+  for (j = 0; j < 100; ++j)
+    for (i = 0; i < NINFLIGHT; ++i)
+      sum += full[i].type + full[i].fid;
+  add_result("inflight/p9_msg", NINFLIGHT * sizeof(struct p9_msg),
+             (now() - t0) * 1e9 / (100.0 * NINFLIGHT));
+  t0 = now();
+  for (j = 0; j < 100; ++j)
+    for (i = 0; i < NINFLIGHT; ++i)
+      sum += compact[i].type + compact[i].f[0].n;
+  add_result("inflight/p9_cmsg", NINFLIGHT * sizeof(struct p9_cmsg),
+             (now() - t0) * 1e9 / (100.0 * NINFLIGHT));
+  sink = sum;
+  free(wire);
+  free(full);
+  free(compact);
+}
+
+static void
+print_results(const char *format)
+{
+  int i;
+
+  if (!strcmp(format, "csv")) {
+    printf("name,bytes,ns\n");
+    for (i = 0; i < nresults; ++i)
+      printf("%s,%u,%.2f\n", results[i].name, results[i].bytes,
+             results[i].ns);
+  } else if (!strcmp(format, "json")) {
+    printf("[\n");
+    for (i = 0; i < nresults; ++i)
+      printf("  {\"name\": \"%s\", \"bytes\": %u, \"ns\": %.2f}%s\n",
+             results[i].name, results[i].bytes, results[i].ns,
+             (i + 1 < nresults) ? "," : "");
+    printf("]\n");
+  } else {
+    printf("%-20s %10s %12s\n", "case", "bytes", "ns/op");
+    for (i = 0; i < nresults; ++i)
+      printf("%-20s %10u %12.2f\n", results[i].name, results[i].bytes,
+             results[i].ns);
+  }
+}
+
+/* Compares against a csv of an earlier run.  Returns the number of cases
+ * slower by more than threshold percent. */
+static int
+compare(const char *path, double threshold)
+{
+  char line[256], *comma;
+  double old, diff;
+  int i, bad = 0;
+  FILE *f;
+
+  if (!(f = fopen(path, "r")))
+    die("Cannot open %s", path);
+  printf("%-20s %12s %12s %8s\n", "case", "base ns", "ns", "diff");
+  while (fgets(line, sizeof(line), f)) {
+    if (!(comma = strchr(line, ',')) || !strncmp(line, "name,", 5))
+      continue;
+    *comma = 0;
+    if (!(comma = strchr(comma + 1, ',')))
+      continue;
+    old = atof(comma + 1);
+    for (i = 0; i < nresults && strcmp(results[i].name, line); ++i) {}
+    if (i == nresults || old <= 0)
+      continue;
+    diff = (results[i].ns - old) * 100 / old;
+    printf("%-20s %12.2f %12.2f %+7.1f%%%s\n", line, old, results[i].ns,
+           diff, (diff > threshold) ? "  REGRESSION" : "");
+    bad += diff > threshold;
+  }
+  fclose(f);
+  return bad;
+}
+
+int
+main(int argc, char **argv)
+{
+  char *format = "table", *base = 0;
+  double threshold = 10;
+  int i;
+  char *usage = "usage: msgbench [-n iterations] [-f table|csv|json]"
+                " [-c base.csv [-t percent]]\n";
+
+  for (i = 1; i < argc && argv[i][0] == '-'; ++i)
+    if (!strcmp(argv[i], "-n") && i + 1 < argc)
+      iters = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-f") && i + 1 < argc)
+      format = argv[++i];
+    else if (!strcmp(argv[i], "-c") && i + 1 < argc)
+      base = argv[++i];
+    else if (!strcmp(argv[i], "-t") && i + 1 < argc)
+      threshold = atof(argv[++i]);
+    else
+      die(usage);
+  if (i < argc || iters <= 0)
+    die(usage);
+  codec();
+  readdir();
+  seq();
+  args();
+  loopback();
+  inflight();
+  if (base)
+    return compare(base, threshold) ? 1 : 0;
+  print_results(format);
+  return 0;
+}
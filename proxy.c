@@ -0,0 +1,402 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "9p.h"
+#include "util.h"
+
+#define MAXCONNS 256
+#define NTAGS 65536
+
+int logmask;
+
+static int lport = 5559;
+static char *host = "127.0.0.1";
+static int port = 5558;
+static unsigned long long delay;
+static unsigned long long jitter;
+static double bandwidth;
+static int reorder;
+static unsigned int seed = 1;
+
+struct frame {
+  unsigned long long due;
+  unsigned int size;
+  struct frame *next;
+  unsigned char buf[];
+};
+
+/* One direction of a proxied connection.  Frames wait in q until they are
+ * due, ordered by due time. */
+struct pipe {
+  int from;
+  int to;
+  int fifo;
+  int insize;
+  int incap;
+  unsigned char *inbuf;
+  unsigned long long link_free;
+  unsigned long long last_due;
+  struct frame *q;
+  unsigned long long frames;
+  unsigned long long bytes;
+};
+
+struct pconn {
+  struct pipe up;
+  struct pipe down;
+  unsigned long long start;
+  unsigned long long changed;
+  unsigned long long area;
+  unsigned long long rtt;
+  unsigned long long replies;
+  int inflight;
+  int maxinflight;
+  unsigned long long *sent;
+  /* oldtag + 1 of the Tflush in flight with that tag */
+  unsigned int *flushed;
+};
+
+static struct pconn *conns[MAXCONNS];
+static int nconns;
+
+void
+die(char *fmt, ...)
+{
+  va_list args;
+
+  va_start(args, fmt);
+  vfprintf(stderr, fmt, args);
+  va_end(args);
+  fputc('\n', stderr);
+  exit(1);
+}
+
+static unsigned long long
+now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static unsigned int
+get_le(const unsigned char *p, int n)
+{
+  unsigned int x = 0;
+
+  while (n-- > 0)
+    x = (x << 8) | p[n];
+  return x;
+}
+
+static int
+listen_on(int port)
+{
+  struct sockaddr_in addr = {0};
+  int fd, x = 1;
+
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    return -1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &x, sizeof(x));
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 16)) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int
+dial(void)
+{
+  struct sockaddr_in addr = {0};
+  struct hostent *h;
+  int fd, x = 1;
+
+  if (!(h = gethostbyname(host)) || h->h_addrtype != AF_INET)
+    return -1;
+  memcpy(&addr.sin_addr, h->h_addr_list[0], h->h_length);
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    return -1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &x, sizeof(x));
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void
+count_inflight(int delta, unsigned long long t, struct pconn *pc)
+{
+  pc->area += pc->inflight * (t - pc->changed);
+  pc->changed = t;
+  pc->inflight += delta;
+  if (pc->inflight > pc->maxinflight)
+    pc->maxinflight = pc->inflight;
+}
+
+/* A frame takes size / bandwidth to go out after the frames before it,
+ * then delay plus up to jitter to arrive.  In a fifo pipe it never
+ * overtakes the frame before it. */
+static void
+put_frame(unsigned char *buf, unsigned int size, unsigned long long t,
+          struct pipe *p)
+{
+  struct frame *f, **q;
+
+  if (!(f = malloc(sizeof(struct frame) + size)))
+    die("Cannot allocate frame");
+  memcpy(f->buf, buf, size);
+  f->size = size;
+  if (p->link_free > t)
+    t = p->link_free;
+  if (bandwidth > 0)
+    t += size * 1e9 / bandwidth;
+  p->link_free = t;
+  f->due = t + delay + ((jitter) ? rand_r(&seed) % (jitter + 1) : 0);
+  if (p->fifo && f->due < p->last_due)
+    f->due = p->last_due;
+  p->last_due = f->due;
+  for (q = &p->q; *q && (*q)->due <= f->due; q = &(*q)->next) {}
+  f->next = *q;
+  *q = f;
+}
+
+static int
+read_pipe(int is_up, struct pconn *pc)
+{
+  struct pipe *p = (is_up) ? &pc->up : &pc->down;
+  unsigned long long t;
+  unsigned int size, off = 0, tag;
+  int r;
+
+  if (p->incap - p->insize < 4096) {
+    p->incap = (p->incap) ? p->incap * 2 : 65536;
+    if (!(p->inbuf = realloc(p->inbuf, p->incap)))
+      die("Cannot allocate buffer");
+  }
+  if ((r = recv(p->from, p->inbuf + p->insize, p->incap - p->insize, 0)) <= 0)
+    return -1;
+  p->insize += r;
+  t = now();
+  while (p->insize - off >= 7
+         && (size = get_le(p->inbuf + off, 4)) <= p->insize - off) {
+    if (size < 7)
+      return -1;
+    tag = get_le(p->inbuf + off + 5, 2);
+    if (is_up && !pc->sent[tag]) {
+      pc->sent[tag] = t;
+      count_inflight(1, t, pc);
+    }
+    if (is_up && p->inbuf[off + 4] == P9_TFLUSH && size >= 9)
+      pc->flushed[tag] = get_le(p->inbuf + off + 7, 2) + 1;
+    put_frame(p->inbuf + off, size, t, p);
+    ++p->frames;
+    p->bytes += size;
+    off += size;
+  }
+  if (off) {
+    memmove(p->inbuf, p->inbuf + off, p->insize - off);
+    p->insize -= off;
+  }
+  return 0;
+}
+
+static int
+write_pipe(int is_up, unsigned long long t, struct pconn *pc)
+{
+  struct pipe *p = (is_up) ? &pc->up : &pc->down;
+  struct frame *f;
+  unsigned int tag, old, sent;
+  int r;
+
+  while ((f = p->q) && f->due <= t) {
+    p->q = f->next;
+    for (sent = 0; sent < f->size; sent += r)
+      if ((r = send(p->to, f->buf + sent, f->size - sent, MSG_NOSIGNAL)) <= 0)
+        return -1;
+    tag = get_le(f->buf + 5, 2);
+    if (!is_up && pc->sent[tag]) {
+      pc->rtt += t - pc->sent[tag];
+      ++pc->replies;
+      pc->sent[tag] = 0;
+      count_inflight(-1, t, pc);
+    }
+    if (!is_up && f->buf[4] == P9_RFLUSH && pc->flushed[tag]) {
+      old = pc->flushed[tag] - 1;
+      pc->flushed[tag] = 0;
+      if (pc->sent[old]) {
+        pc->sent[old] = 0;
+        count_inflight(-1, t, pc);
+      }
+    }
+    free(f);
+  }
+  return 0;
+}
+
+/* By Little's law a client gets its mean window over the round trip, so
+ * the rate is compared with what its largest window would allow. */
+static void
+report(struct pconn *pc)
+{
+  unsigned long long t = now();
+  double secs, rtt, window;
+
+  count_inflight(0, t, pc);
+  secs = (t - pc->start) / 1e9;
+  rtt = (pc->replies) ? pc->rtt / 1e9 / pc->replies : 0;
+  window = (secs > 0) ? pc->area / 1e9 / secs : 0;
+  fprintf(stderr, "conn: %.2f s, %llu requests %llu bytes, %llu replies"
+          " %llu bytes\n", secs, pc->up.frames, pc->up.bytes,
+          pc->down.frames, pc->down.bytes);
+  fprintf(stderr, "  in flight mean %.2f max %d, rtt %.1f us\n", window,
+          pc->maxinflight, rtt * 1e6);
+  if (rtt > 0 && secs > 0)
+    fprintf(stderr, "  %.0f replies/s, max in flight / rtt %.0f/s\n",
+            pc->replies / secs, pc->maxinflight / rtt);
+}
+
+static void
+close_conn(int i)
+{
+  struct pconn *pc = conns[i];
+  struct frame *f;
+  struct pipe *p;
+
+  report(pc);
+  for (p = &pc->up; p; p = (p == &pc->up) ? &pc->down : 0) {
+    while ((f = p->q)) {
+      p->q = f->next;
+      free(f);
+    }
+    free(p->inbuf);
+  }
+  close(pc->up.from);
+  close(pc->up.to);
+  free(pc->sent);
+  free(pc->flushed);
+  free(pc);
+  conns[i] = conns[--nconns];
+}
+
+static void
+accept_conn(int lfd)
+{
+  struct pconn *pc;
+  int cfd, sfd, x = 1;
+
+  if ((cfd = accept(lfd, 0, 0)) < 0)
+    return;
+  setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &x, sizeof(x));
+  if (nconns == MAXCONNS || (sfd = dial()) < 0) {
+    fprintf(stderr, "Cannot connect to %s!%d\n", host, port);
+    close(cfd);
+    return;
+  }
+  if (!(pc = calloc(1, sizeof(struct pconn)))
+      || !(pc->sent = calloc(NTAGS, sizeof(unsigned long long)))
+      || !(pc->flushed = calloc(NTAGS, sizeof(unsigned int))))
+    die("Cannot allocate connection");
+  pc->up.from = pc->down.to = cfd;
+  pc->up.to = pc->down.from = sfd;
+  pc->up.fifo = 1;
+  pc->down.fifo = !reorder;
+  pc->start = pc->changed = now();
+  conns[nconns++] = pc;
+}
+
+static void
+run(int lfd)
+{
+  static struct pollfd pfd[1 + 2 * MAXCONNS];
+  struct timespec ts;
+  unsigned long long t, wake;
+  int i, n;
+
+  for (;;) {
+    t = now();
+    wake = 0;
+    for (i = 0; i < nconns; ++i)
+      if (write_pipe(1, t, conns[i]) || write_pipe(0, t, conns[i]))
+        close_conn(i--);
+    for (i = 0; i < nconns; ++i) {
+      if (conns[i]->up.q && (!wake || conns[i]->up.q->due < wake))
+        wake = conns[i]->up.q->due;
+      if (conns[i]->down.q && (!wake || conns[i]->down.q->due < wake))
+        wake = conns[i]->down.q->due;
+    }
+    pfd[0].fd = lfd;
+    pfd[0].events = POLLIN;
+    for (i = 0, n = 1; i < nconns; ++i) {
+      pfd[n].fd = conns[i]->up.from;
+      pfd[n++].events = POLLIN;
+      pfd[n].fd = conns[i]->down.from;
+      pfd[n++].events = POLLIN;
+    }
+    ts.tv_sec = (wake - t) / 1000000000;
+    ts.tv_nsec = (wake - t) % 1000000000;
+    if (ppoll(pfd, n, (wake) ? &ts : 0, 0) < 0)
+      die("poll failed");
+    for (i = nconns - 1; i >= 0; --i)
+      if (((pfd[1 + 2 * i].revents && read_pipe(1, conns[i]))
+           || (pfd[2 + 2 * i].revents && read_pipe(0, conns[i]))))
+        close_conn(i);
+    if (pfd[0].revents)
+      accept_conn(lfd);
+  }
+}
+
+int
+main(int argc, char **argv)
+{
+  int i, lfd;
+  char *usage = "usage: proxy [-l port] [-a host] [-p port] [-d delay_us]"
+                " [-j jitter_us]\n"
+                "             [-b bytes/s] [-R]\n"
+                "  delay, jitter and bandwidth apply to each direction,"
+                " -R lets replies\n"
+                "  overtake each other\n";
+
+  for (i = 1; i < argc && argv[i][0] == '-'; ++i)
+    if (!strcmp(argv[i], "-l") && i + 1 < argc)
+      lport = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-a") && i + 1 < argc)
+      host = argv[++i];
+    else if (!strcmp(argv[i], "-p") && i + 1 < argc)
+      port = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-d") && i + 1 < argc)
+      delay = atoll(argv[++i]) * 1000;
+    else if (!strcmp(argv[i], "-j") && i + 1 < argc)
+      jitter = atoll(argv[++i]) * 1000;
+    else if (!strcmp(argv[i], "-b") && i + 1 < argc)
+      bandwidth = atof(argv[++i]);
+    else if (!strcmp(argv[i], "-R"))
+      reorder = 1;
+    else
+      die(usage);
+  if (i < argc)
+    die(usage);
+  if ((lfd = listen_on(lport)) < 0)
+    die("Cannot listen on port %d", lport);
+  signal(SIGPIPE, SIG_IGN);
+  run(lfd);
+  return 0;
+}
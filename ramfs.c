@@ -0,0 +1,658 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "9p.h"
+#include "9pfid.h"
+#include "ramfs.h"
+#include "util.h"
+
+struct ramfile {
+  char *name;
+  struct p9_qid qid;
+  unsigned int mode;
+  unsigned int atime;
+  unsigned int mtime;
+  unsigned long long length;
+  unsigned long long cap;
+  char *data;
+  int nref;
+  int removed;
+  struct ramfile *parent;
+  struct ramfile *child;
+  struct ramfile *next;
+};
+
+static void ramfs_version(struct p9_connection *c);
+static void ramfs_auth(struct p9_connection *c);
+static void ramfs_attach(struct p9_connection *c);
+static void ramfs_flush(struct p9_connection *c);
+static void ramfs_walk(struct p9_connection *c);
+static void ramfs_walk1(struct p9_connection *c, struct p9_fs *fs);
+static void ramfs_open(struct p9_connection *c);
+static void ramfs_create(struct p9_connection *c);
+static void ramfs_read(struct p9_connection *c);
+static void ramfs_write(struct p9_connection *c);
+static void ramfs_clunk(struct p9_connection *c);
+static void ramfs_remove(struct p9_connection *c);
+static void ramfs_stat(struct p9_connection *c);
+static void ramfs_wstat(struct p9_connection *c);
+static void ramfs_connect(struct p9_connection *c);
+static void ramfs_disconnect(struct p9_connection *c);
+
+static struct p9_fs fs = {
+  .version = ramfs_version,
+  .auth = ramfs_auth,
+  .attach = ramfs_attach,
+  .flush = ramfs_flush,
+  .walk = ramfs_walk,
+  .walk1 = ramfs_walk1,
+  .open = ramfs_open,
+  .create = ramfs_create,
+  .read = ramfs_read,
+  .write = ramfs_write,
+  .clunk = ramfs_clunk,
+  .remove = ramfs_remove,
+  .stat = ramfs_stat,
+  .wstat = ramfs_wstat,
+  .connect = ramfs_connect,
+  .disconnect = ramfs_disconnect,
+};
+
+/* The tree is read under a shared lock and changed under an exclusive one.
+ * File references are atomic, so that walks and clunks can share it. */
+static pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct ramfile *root;
+static unsigned long long qidpath;
+static int latency;
+static char *owner = "ramfs";
+
+static const char *Enofile = "file does not exist";
+static const char *Enofid = "unknown fid";
+static const char *Einuse = "fid already in use";
+static const char *Eopen = "fid is open";
+static const char *Enotopen = "fid is not open for that";
+static const char *Enotdir = "not a directory";
+static const char *Eisdir = "is a directory";
+static const char *Eexist = "file already exists";
+static const char *Enotempty = "directory is not empty";
+static const char *Enomem = "out of memory";
+static const char *Etoobig = "file too large";
+
+/* Files live in memory, so anything larger cannot be allocated anyway. */
+#define MAXFILESIZE (1ull << 40)
+
+#define ERR(c, e) P9_SET_STR((c)->r.ename, (char *)(e))
+
+static void
+incref(struct ramfile *f)
+{
+  __atomic_add_fetch(&f->nref, 1, __ATOMIC_RELAXED);
+}
+
+static struct ramfile *
+mk_ramfile(const char *name, int len, unsigned int mode,
+           struct ramfile *parent)
+{
+  struct ramfile *f;
+
+  f = calloc(1, sizeof(struct ramfile));
+  if (!f)
+    return 0;
+  f->name = strndup(name, len);
+  if (!f->name) {
+    free(f);
+    return 0;
+  }
+  f->mode = mode;
+  f->qid.type = (mode & P9_DMDIR) ? P9_QTDIR : P9_QTFILE;
+  f->qid.path = qidpath++;
+  f->atime = f->mtime = time(0);
+  f->parent = (parent) ? parent : f;
+  if (parent) {
+    f->next = parent->child;
+    parent->child = f;
+    incref(parent);
+  }
+  f->nref = 1;
+  return f;
+}
+
+static void
+decref(struct ramfile *f)
+{
+  struct ramfile *parent;
+
+  for (; f && !__atomic_sub_fetch(&f->nref, 1, __ATOMIC_ACQ_REL);
+       f = parent) {
+    parent = (f->parent != f) ? f->parent : 0;
+    free(f->name);
+    free(f->data);
+    free(f);
+  }
+}
+
+static void
+unlink_file(struct ramfile *f)
+{
+  struct ramfile **p;
+
+  for (p = &f->parent->child; *p && *p != f; p = &(*p)->next) {}
+  if (*p)
+    *p = f->next;
+  f->removed = 1;
+  decref(f);
+}
+
+static struct ramfile *
+lookup(struct ramfile *dir, const char *name, int len)
+{
+  struct ramfile *f;
+
+  if (len == 2 && !memcmp(name, "..", 2))
+    return dir->parent;
+  if (len == 1 && name[0] == '.')
+    return dir;
+  for (f = dir->child; f; f = f->next)
+    if (!strncmp(f->name, name, len) && !f->name[len])
+      return f;
+  return 0;
+}
+
+static int
+resize(struct ramfile *f, unsigned long long size)
+{
+  unsigned long long cap;
+  char *p;
+
+  if (size > MAXFILESIZE)
+    return -1;
+  if (size > f->cap) {
+    for (cap = (f->cap) ? f->cap : 4096; cap < size; cap *= 2) {}
+    if (!(p = realloc(f->data, cap)))
+      return -1;
+    f->data = p;
+    f->cap = cap;
+  }
+  if (size > f->length)
+    memset(f->data + f->length, 0, size - f->length);
+  f->length = size;
+  return 0;
+}
+
+static void
+fill_stat(struct ramfile *f, struct p9_stat *st)
+{
+  memset(st, 0, sizeof(*st));
+  st->qid = f->qid;
+  st->mode = f->mode;
+  st->atime = __atomic_load_n(&f->atime, __ATOMIC_RELAXED);
+  st->mtime = f->mtime;
+  st->length = (f->mode & P9_DMDIR) ? 0 : f->length;
+  P9_SET_STR(st->name, f->name);
+  P9_SET_STR(st->uid, owner);
+  P9_SET_STR(st->gid, owner);
+  P9_SET_STR(st->muid, owner);
+  st->size = p9_stat_size(st);
+}
+
+static void
+rm_ramfid(struct p9_fid *fid)
+{
+  struct ramfile *f = fid->file;
+
+  if (fid->open_mode != P9_NOTOPEN && (fid->open_mode & P9_ORCLOSE)
+      && !f->removed && f != root && !f->child)
+    unlink_file(f);
+  decref(f);
+}
+
+static int
+clone_ramfid(struct p9_fid *dst, struct p9_fid *src)
+{
+  incref(dst->file);
+  return 0;
+}
+
+static struct p9_fid *
+get_fid(struct p9_connection *c, unsigned int fid)
+{
+  return p9_fidtab_get(fid, c->aux);
+}
+
+static struct p9_fid *
+new_fid(struct p9_connection *c, unsigned int fid, struct ramfile *file)
+{
+  struct p9_fid *f;
+
+  f = p9_fidtab_add(fid, c->aux);
+  if (!f)
+    return 0;
+  f->qid = file->qid;
+  f->rm = rm_ramfid;
+  f->clone = clone_ramfid;
+  f->file = file;
+  incref(file);
+  return f;
+}
+
+static void
+del_fid(struct p9_connection *c, struct p9_fid *fid)
+{
+  p9_fidtab_del(fid, c->aux);
+}
+
+static void *
+get_buf(struct p9_connection *c)
+{
+  if (!c->buf)
+    c->buf = malloc(c->msize);
+  return c->buf;
+}
+
+static void
+lock_tree(int exclusive)
+{
+  if (exclusive)
+    pthread_rwlock_wrlock(&lock);
+  else
+    pthread_rwlock_rdlock(&lock);
+}
+
+static void
+delay(void)
+{
+  if (latency)
+    usleep(latency);
+}
+
+static void
+ramfs_version(struct p9_connection *c)
+{
+  c->r.msize = c->t.msize;
+  if (c->t.version_len >= 6 && !strncmp(c->t.version, P9_VERSION, 6))
+    P9_SET_STR(c->r.version, P9_VERSION);
+  else
+    P9_SET_STR(c->r.version, "unknown");
+}
+
+static void
+ramfs_auth(struct p9_connection *c)
+{
+  ERR(c, "authentication not required");
+}
+
+static void
+ramfs_attach(struct p9_connection *c)
+{
+  delay();
+  lock_tree(0);
+  if (get_fid(c, c->t.fid))
+    ERR(c, Einuse);
+  else if (!new_fid(c, c->t.fid, root))
+    ERR(c, Enomem);
+  else
+    c->r.aqid = root->qid;
+  pthread_rwlock_unlock(&lock);
+}
+
+static void
+ramfs_flush(struct p9_connection *c)
+{
+}
+
+static void
+ramfs_walk(struct p9_connection *c)
+{
+  delay();
+  lock_tree(0);
+  p9_fidtab_walk(c, &fs, c->aux);
+  pthread_rwlock_unlock(&lock);
+}
+
+static void
+ramfs_walk1(struct p9_connection *c, struct p9_fs *fs)
+{
+  struct p9_fid *fid = c->t.pfid;
+  struct ramfile *f = fid->file, *next;
+  unsigned int i = c->r.nwqid;
+
+  if (!(f->mode & P9_DMDIR) || !(next = lookup(f, c->t.wname[i],
+                                               c->t.wname_len[i]))) {
+    ERR(c, Enofile);
+    return;
+  }
+  incref(next);
+  decref(f);
+  fid->file = next;
+  c->r.wqid[i] = next->qid;
+}
+
+static void
+ramfs_open(struct p9_connection *c)
+{
+  struct p9_fid *fid;
+  struct ramfile *f;
+
+  delay();
+  lock_tree(c->t.mode & P9_OTRUNC);
+  fid = get_fid(c, c->t.fid);
+  if (!fid) {
+    ERR(c, Enofid);
+    goto out;
+  }
+  f = fid->file;
+  if (fid->open_mode != P9_NOTOPEN)
+    ERR(c, Eopen);
+  else if ((f->mode & P9_DMDIR) && (P9_WRITE_MODE(c->t.mode)
+                                    || (c->t.mode & P9_OTRUNC)))
+    ERR(c, Eisdir);
+  else if (f->removed)
+    ERR(c, Enofile);
+  if (c->r.ename)
+    goto out;
+  if ((c->t.mode & P9_OTRUNC) && !(f->mode & P9_DMDIR)) {
+    f->length = 0;
+    f->mtime = time(0);
+    ++f->qid.version;
+  }
+  fid->open_mode = c->t.mode;
+  c->r.qid = f->qid;
+out:
+  pthread_rwlock_unlock(&lock);
+}
+
+static void
+ramfs_create(struct p9_connection *c)
+{
+  struct p9_fid *fid;
+  struct ramfile *dir, *f;
+
+  delay();
+  lock_tree(1);
+  fid = get_fid(c, c->t.fid);
+  if (!fid) {
+    ERR(c, Enofid);
+    goto out;
+  }
+  dir = fid->file;
+  if (fid->open_mode != P9_NOTOPEN)
+    ERR(c, Eopen);
+  else if (!(dir->mode & P9_DMDIR))
+    ERR(c, Enotdir);
+  else if (lookup(dir, c->t.name, c->t.name_len)
+           || (c->t.name_len == 1 && c->t.name[0] == '.'))
+    ERR(c, Eexist);
+  else if (!(f = mk_ramfile(c->t.name, c->t.name_len, c->t.perm, dir)))
+    ERR(c, Enomem);
+  if (c->r.ename)
+    goto out;
+  incref(f);
+  decref(fid->file);
+  fid->file = f;
+  fid->qid = f->qid;
+  fid->open_mode = c->t.mode;
+  dir->mtime = time(0);
+  c->r.qid = f->qid;
+out:
+  pthread_rwlock_unlock(&lock);
+}
+
+static void
+read_dir(struct p9_connection *c, struct ramfile *dir)
+{
+  struct ramfile *f;
+  struct p9_stat st;
+  unsigned long long off = 0;
+  char *buf;
+  unsigned int n = 0;
+
+  if (!(buf = get_buf(c))) {
+    ERR(c, Enomem);
+    return;
+  }
+  for (f = dir->child; f && off < c->t.offset; f = f->next) {
+    fill_stat(f, &st);
+    off += st.size + 2;
+  }
+  for (; f; f = f->next) {
+    fill_stat(f, &st);
+    if (n + st.size + 2 > c->t.count || n + st.size + 2 > c->msize - 24)
+      break;
+    if (p9_pack_stat(c->msize - n, buf + n, &st))
+      break;
+    n += st.size + 2;
+  }
+  c->r.count = n;
+  c->r.data = buf;
+}
+
+static void
+ramfs_read(struct p9_connection *c)
+{
+  struct p9_fid *fid;
+  struct ramfile *f;
+  unsigned long long n;
+
+  delay();
+  lock_tree(0);
+  fid = get_fid(c, c->t.fid);
+  if (!fid) {
+    ERR(c, Enofid);
+    goto out;
+  }
+  f = fid->file;
+  if (fid->open_mode == P9_NOTOPEN || !P9_READ_MODE(fid->open_mode))
+    ERR(c, Enotopen);
+  else if (f->mode & P9_DMDIR)
+    read_dir(c, f);
+  else if (!get_buf(c))
+    ERR(c, Enomem);
+  else {
+    n = (c->t.offset < f->length) ? f->length - c->t.offset : 0;
+    if (n > c->t.count)
+      n = c->t.count;
+    if (n > c->msize - 24)
+      n = c->msize - 24;
+    memcpy(c->buf, f->data + c->t.offset, n);
+    c->r.data = c->buf;
+    c->r.count = n;
+    __atomic_store_n(&f->atime, time(0), __ATOMIC_RELAXED);
+  }
+out:
+  pthread_rwlock_unlock(&lock);
+}
+
+static void
+ramfs_write(struct p9_connection *c)
+{
+  struct p9_fid *fid;
+  struct ramfile *f;
+  unsigned long long off;
+
+  delay();
+  lock_tree(1);
+  fid = get_fid(c, c->t.fid);
+  if (!fid) {
+    ERR(c, Enofid);
+    goto out;
+  }
+  f = fid->file;
+  off = (f->mode & P9_DMAPPEND) ? f->length : c->t.offset;
+  if (fid->open_mode == P9_NOTOPEN || !P9_WRITE_MODE(fid->open_mode))
+    ERR(c, Enotopen);
+  else if (f->mode & P9_DMDIR)
+    ERR(c, Eisdir);
+  else if (off > MAXFILESIZE || c->t.count > MAXFILESIZE - off)
+    ERR(c, Etoobig);
+  else if (off + c->t.count > f->length && resize(f, off + c->t.count))
+    ERR(c, Enomem);
+  else {
+    memcpy(f->data + off, c->t.data, c->t.count);
+    c->r.count = c->t.count;
+    f->mtime = time(0);
+    ++f->qid.version;
+  }
+out:
+  pthread_rwlock_unlock(&lock);
+}
+
+static void
+ramfs_clunk(struct p9_connection *c)
+{
+  struct p9_fid *fid;
+
+  if (!(fid = get_fid(c, c->t.fid))) {
+    ERR(c, Enofid);
+    return;
+  }
+  lock_tree(fid->open_mode != P9_NOTOPEN && (fid->open_mode & P9_ORCLOSE));
+  del_fid(c, fid);
+  pthread_rwlock_unlock(&lock);
+}
+
+static void
+ramfs_remove(struct p9_connection *c)
+{
+  struct p9_fid *fid;
+  struct ramfile *f;
+
+  delay();
+  lock_tree(1);
+  if (!(fid = get_fid(c, c->t.fid))) {
+    ERR(c, Enofid);
+    goto out;
+  }
+  f = fid->file;
+  if (f == root)
+    ERR(c, "cannot remove root");
+  else if (f->child)
+    ERR(c, Enotempty);
+  else if (!f->removed) {
+    f->parent->mtime = time(0);
+    unlink_file(f);
+  }
+  del_fid(c, fid);
+out:
+  pthread_rwlock_unlock(&lock);
+}
+
+static void
+ramfs_stat(struct p9_connection *c)
+{
+  struct p9_fid *fid;
+
+  delay();
+  lock_tree(0);
+  if ((fid = get_fid(c, c->t.fid)))
+    fill_stat(fid->file, &c->r.stat);
+  else
+    ERR(c, Enofid);
+  pthread_rwlock_unlock(&lock);
+}
+
+static void
+ramfs_wstat(struct p9_connection *c)
+{
+  struct p9_fid *fid;
+  struct ramfile *f;
+  struct p9_stat *st = &c->t.stat;
+  char *name;
+
+  delay();
+  lock_tree(1);
+  if (!(fid = get_fid(c, c->t.fid))) {
+    ERR(c, Enofid);
+    goto out;
+  }
+  f = fid->file;
+  if (st->name_len && f != root) {
+    if (lookup(f->parent, st->name, st->name_len))
+      ERR(c, Eexist);
+    else if (!(name = strndup(st->name, st->name_len)))
+      ERR(c, Enomem);
+    else {
+      free(f->name);
+      f->name = name;
+    }
+  }
+  if (!c->r.ename && st->length != ~0ull && !(f->mode & P9_DMDIR)
+      && st->length > MAXFILESIZE)
+    ERR(c, Etoobig);
+  else if (!c->r.ename && st->length != ~0ull && !(f->mode & P9_DMDIR)
+           && resize(f, st->length))
+    ERR(c, Enomem);
+  if (c->r.ename)
+    goto out;
+  if (st->mode != ~0u)
+    f->mode = (f->mode & P9_DMDIR) | (st->mode & ~P9_DMDIR);
+  if (st->mtime != ~0u)
+    f->mtime = st->mtime;
+out:
+  pthread_rwlock_unlock(&lock);
+}
+
+static void
+ramfs_connect(struct p9_connection *c)
+{
+  c->aux = mk_p9fidtab(sizeof(struct p9_fid));
+}
+
+static void
+ramfs_disconnect(struct p9_connection *c)
+{
+  lock_tree(1);
+  rm_p9fidtab(c->aux);
+  pthread_rwlock_unlock(&lock);
+  c->aux = 0;
+}
+
+/* Creates nfiles files of filesize bytes each in the root directory and
+ * makes every operation sleep for latency microseconds. */
+struct p9_fs *
+mk_ramfs(int nfiles, int filesize, int lat)
+{
+  struct ramfile *f;
+  char name[32];
+  int i, j, n;
+
+  if (root)
+    return &fs;
+  root = mk_ramfile("/", 1, P9_DMDIR | 0777, 0);
+  if (!root)
+    return 0;
+  latency = lat;
+  for (i = 0; i < nfiles; ++i) {
+    n = snprintf(name, sizeof(name), "file%d", i);
+    if (!(f = mk_ramfile(name, n, 0666, root)) || resize(f, filesize))
+      return 0;
+    for (j = 0; j < filesize; ++j)
+      f->data[j] = 'a' + (i + j) % 26;
+  }
+  return &fs;
+}
+
+static void
+rm_tree(struct ramfile *dir)
+{
+  struct ramfile *f;
+
+  while ((f = dir->child)) {
+    rm_tree(f);
+    unlink_file(f);
+  }
+}
+
+void
+rm_ramfs(void)
+{
+  if (!root)
+    return;
+  rm_tree(root);
+  decref(root);
+  root = 0;
+}
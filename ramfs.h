@@ -0,0 +1,4 @@
+struct p9_fs;
+
+struct p9_fs *mk_ramfs(int nfiles, int filesize, int latency);
+void rm_ramfs(void);
@@ -0,0 +1,459 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "9p.h"
+#include "9pdbg.h"
+#include "9ptrace.h"
+#include "seq.h"
+#include "util.h"
+
+#define MSIZE 65536
+#define FIDBASE 1
+
+int logmask;
+
+static char *host = "127.0.0.1";
+static int port = 5558;
+static int ncopies = 1;
+static int nconns = 0;
+static int window = 1;
+static double speed = 1;
+static int fast;
+
+/* A T-message of the trace, complete as it was sent. */
+struct record {
+  unsigned long long ns;
+  unsigned int size;
+  unsigned char *buf;
+};
+
+struct fidmap {
+  unsigned int from;
+  unsigned int to;
+};
+
+/* A copy replays the whole trace on its own fids over a shared
+ * connection. */
+struct copy {
+  int next;
+  int inflight;
+  unsigned long long start;
+  int nfids;
+  int maxfids;
+  struct fidmap *fids;
+  struct conn *conn;
+};
+
+struct pending {
+  struct copy *copy;
+  int type;
+  unsigned long long start;
+};
+
+struct conn {
+  int fd;
+  int msize;
+  unsigned int nextfid;
+  struct p9_seq *tags;
+  struct pending *pend;
+  int npend;
+  int insize;
+  unsigned char *inbuf;
+  unsigned char *outbuf;
+};
+
+static struct record *recs;
+static int nrecs;
+static struct p9_stats stats;
+static struct p9_hist all;
+static unsigned long long skipped;
+
+void
+die(char *fmt, ...)
+{
+  va_list args;
+
+  va_start(args, fmt);
+  vfprintf(stderr, fmt, args);
+  va_end(args);
+  fputc('\n', stderr);
+  exit(1);
+}
+
+static unsigned long long
+now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static unsigned long long
+get_le(const unsigned char *p, int n)
+{
+  unsigned long long x = 0;
+
+  while (n-- > 0)
+    x = (x << 8) | p[n];
+  return x;
+}
+
+/* Keeps the T-messages of the trace whichever side recorded it, as one
+ * stream, so a server trace should hold a single connection.  Twrite cut
+ * short gets its data back as zeros, anything else cut short and Tversion
+ * and Tflush are left out. */
+static void
+load(const char *path)
+{
+  unsigned char hdr[P9_TRACE_HDRSZ], *buf;
+  unsigned int size, caplen;
+  char magic[8];
+  int max = 0;
+  FILE *f;
+
+  if (!(f = fopen(path, "rb")))
+    die("Cannot open %s", path);
+  if (fread(magic, 1, 8, f) != 8 || memcmp(magic, P9_TRACE_MAGIC, 8))
+    die("%s is not a trace file", path);
+  while (fread(hdr, 1, sizeof(hdr), f) == sizeof(hdr)) {
+    size = get_le(hdr + 12, 4);
+    caplen = get_le(hdr + 16, 4);
+    if (hdr[8] == P9_TRACE_DROP) {
+      skipped += size;
+      continue;
+    }
+    if (caplen > size || size > MSIZE || !(buf = calloc(1, size))
+        || fread(buf, 1, caplen, f) != caplen)
+      die("Bad record in %s", path);
+    if (caplen < 7 || (buf[4] & 1) || buf[4] == P9_TVERSION
+        || buf[4] == P9_TFLUSH
+        || (caplen < size && (buf[4] != P9_TWRITE || caplen < 23))) {
+      if (caplen >= 7 && !(buf[4] & 1))
+        ++skipped;
+      free(buf);
+      continue;
+    }
+    if (nrecs == max) {
+      max = (max) ? max * 2 : 1024;
+      if (!(recs = realloc(recs, max * sizeof(struct record))))
+        die("Cannot allocate records");
+    }
+    recs[nrecs].ns = get_le(hdr, 8);
+    recs[nrecs].size = size;
+    recs[nrecs++].buf = buf;
+  }
+  fclose(f);
+}
+
+static int
+dial(void)
+{
+  struct sockaddr_in addr = {0};
+  struct hostent *h;
+  int fd, x = 1;
+
+  if (!(h = gethostbyname(host)) || h->h_addrtype != AF_INET)
+    die("Cannot resolve %s", host);
+  memcpy(&addr.sin_addr, h->h_addr_list[0], h->h_length);
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    return -1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &x, sizeof(x));
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int
+put_msg(struct p9_msg *m, struct conn *c)
+{
+  int size, sent, r;
+
+  size = p9_msg_size(m);
+  if (!size || size > c->msize)
+    return -1;
+  p9_pack_msg_sized(size, (char *)c->outbuf, m);
+  for (sent = 0; sent < size; sent += r)
+    if ((r = send(c->fd, c->outbuf + sent, size - sent, MSG_NOSIGNAL)) <= 0)
+      return -1;
+  ++stats.sends;
+  stats.bytes_out += size;
+  return 0;
+}
+
+static int
+get_msg(struct conn *c)
+{
+  int r;
+
+  r = recv(c->fd, c->inbuf + c->insize, c->msize - c->insize, 0);
+  ++stats.recvs;
+  if (r <= 0)
+    return -1;
+  c->insize += r;
+  stats.bytes_in += r;
+  return 0;
+}
+
+static void
+mk_conn(struct conn *c)
+{
+  struct p9_msg m;
+
+  memset(&m, 0, sizeof(m));
+  c->msize = MSIZE;
+  c->nextfid = FIDBASE;
+  c->tags = mk_p9seq();
+  c->inbuf = malloc(c->msize);
+  c->outbuf = malloc(c->msize);
+  c->pend = calloc(c->npend, sizeof(struct pending));
+  if (!c->tags || !c->inbuf || !c->outbuf || !c->pend)
+    die("Cannot allocate connection");
+  if ((c->fd = dial()) < 0)
+    die("Cannot connect to %s!%d", host, port);
+  m.type = P9_TVERSION;
+  m.tag = P9_NOTAG;
+  m.msize = c->msize;
+  P9_SET_STR(m.version, P9_VERSION);
+  if (put_msg(&m, c))
+    die("Cannot send Tversion");
+  while (c->insize < 7 || get_le(c->inbuf, 4) > (unsigned int)c->insize)
+    if (get_msg(c))
+      die("Cannot receive Rversion");
+  if (p9_unpack_msg(c->insize, (char *)c->inbuf, &m)
+      || m.type != P9_RVERSION)
+    die("Bad Rversion");
+  if (m.msize < (unsigned int)c->msize)
+    c->msize = m.msize;
+  c->insize = 0;
+}
+
+/* Fids of the trace get fresh numbers on the connection of the copy, which
+ * are never reused. */
+static unsigned int
+map_fid(unsigned int fid, struct copy *cp)
+{
+  int i;
+
+  if (fid == P9_NOFID)
+    return fid;
+  for (i = 0; i < cp->nfids; ++i)
+    if (cp->fids[i].from == fid)
+      return cp->fids[i].to;
+  if (cp->nfids == cp->maxfids) {
+    cp->maxfids = (cp->maxfids) ? cp->maxfids * 2 : 16;
+    cp->fids = realloc(cp->fids, cp->maxfids * sizeof(struct fidmap));
+    if (!cp->fids)
+      die("Cannot allocate fids");
+  }
+  cp->fids[cp->nfids].from = fid;
+  cp->fids[cp->nfids].to = cp->conn->nextfid++;
+  return cp->fids[cp->nfids++].to;
+}
+
+static void
+unmap_fid(unsigned int fid, struct copy *cp)
+{
+  int i;
+
+  for (i = 0; i < cp->nfids; ++i)
+    if (cp->fids[i].from == fid) {
+      cp->fids[i] = cp->fids[--cp->nfids];
+      return;
+    }
+}
+
+static void
+send_rec(struct record *rec, struct copy *cp)
+{
+  struct conn *c = cp->conn;
+  struct p9_msg m;
+  unsigned int tag;
+
+  memset(&m, 0, sizeof(m));
+  if (p9_unpack_msg(rec->size, (char *)rec->buf, &m))
+    die("Bad message in trace");
+  if ((tag = p9_seq_next(c->tags)) >= (unsigned int)c->npend)
+    die("Out of tags");
+  m.tag = tag;
+  switch (m.type) {
+  case P9_TAUTH:
+    m.afid = map_fid(m.afid, cp);
+    break;
+  case P9_TATTACH:
+    m.afid = map_fid(m.afid, cp);
+    m.fid = map_fid(m.fid, cp);
+    break;
+  case P9_TWALK:
+    m.newfid = map_fid(m.newfid, cp);
+    /* fall through */
+  default:
+    m.fid = map_fid(m.fid, cp);
+  }
+  if (put_msg(&m, c))
+    die("Cannot send to server");
+  if (rec->buf[4] == P9_TCLUNK || rec->buf[4] == P9_TREMOVE)
+    unmap_fid(get_le(rec->buf + 7, 4), cp);
+  c->pend[tag].copy = cp;
+  c->pend[tag].type = m.type;
+  c->pend[tag].start = now();
+  ++cp->inflight;
+}
+
+static void
+recv_replies(struct conn *c)
+{
+  struct pending *p;
+  unsigned int size, tag, off = 0;
+  unsigned long long t;
+  int i;
+
+  if (get_msg(c))
+    die("Connection closed by server");
+  t = now();
+  while (c->insize - off >= 7
+         && (size = get_le(c->inbuf + off, 4)) <= c->insize - off) {
+    if (size < 7)
+      die("Bad reply");
+    tag = get_le(c->inbuf + off + 5, 2);
+    if (tag >= (unsigned int)c->npend || !(p = &c->pend[tag])->copy)
+      die("Reply with unknown tag %u", tag);
+    i = (p->type - P9_XSTART) / 2;
+    p9_hist_add(t - p->start, &stats.lat[i]);
+    p9_hist_add(t - p->start, &all);
+    if (c->inbuf[off + 4] == P9_RERROR)
+      ++stats.errors[i];
+    --p->copy->inflight;
+    p->copy = 0;
+    p9_seq_drop(tag, c->tags);
+    off += size;
+  }
+  if (off && off < (unsigned int)c->insize)
+    memmove(c->inbuf, c->inbuf + off, c->insize - off);
+  c->insize -= off;
+}
+
+/* When the next record of the copy is due, or 0 if it is done. */
+static unsigned long long
+due(struct copy *cp)
+{
+  if (cp->next >= nrecs)
+    return 0;
+  if (fast)
+    return cp->start;
+  return cp->start + (recs[cp->next].ns - recs[0].ns) / speed;
+}
+
+static double
+run(struct copy *cps, struct conn *conns)
+{
+  struct pollfd *pfd;
+  unsigned long long t, d, wake, start;
+  int i, busy, timeout;
+
+  if (!(pfd = calloc(nconns, sizeof(struct pollfd))))
+    die("Cannot allocate poll set");
+  for (i = 0; i < nconns; ++i) {
+    pfd[i].fd = conns[i].fd;
+    pfd[i].events = POLLIN;
+  }
+  start = now();
+  for (i = 0; i < ncopies; ++i)
+    cps[i].start = start;
+  for (;;) {
+    t = now();
+    wake = 0;
+    busy = 0;
+    for (i = 0; i < ncopies; ++i) {
+      while ((d = due(&cps[i])) && d <= t && cps[i].inflight < window)
+        send_rec(&recs[cps[i].next++], &cps[i]);
+      if (d && cps[i].inflight < window && (!wake || d < wake))
+        wake = d;
+      busy |= d || cps[i].inflight;
+    }
+    if (!busy)
+      break;
+    timeout = (wake) ? (int)((wake - t + 999999) / 1000000) : -1;
+    if (poll(pfd, nconns, timeout) < 0)
+      die("poll failed");
+    for (i = 0; i < nconns; ++i)
+      if (pfd[i].revents)
+        recv_replies(&conns[i]);
+  }
+  free(pfd);
+  return (now() - start) / 1e9;
+}
+
+int
+main(int argc, char **argv)
+{
+  struct copy *cps;
+  struct conn *conns;
+  double secs;
+  int i;
+  char *usage = "usage: replay [-a host] [-p port] [-n copies] [-c conns]"
+                " [-w window]\n"
+                "              [-s speed | -f] tracefile\n"
+                "  replays the T-messages of a trace, as recorded with"
+                " P9TRACE or server -T\n";
+
+  for (i = 1; i < argc && argv[i][0] == '-'; ++i)
+    if (!strcmp(argv[i], "-a") && i + 1 < argc)
+      host = argv[++i];
+    else if (!strcmp(argv[i], "-p") && i + 1 < argc)
+      port = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-n") && i + 1 < argc)
+      ncopies = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-c") && i + 1 < argc)
+      nconns = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-w") && i + 1 < argc)
+      window = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-s") && i + 1 < argc)
+      speed = atof(argv[++i]);
+    else if (!strcmp(argv[i], "-f"))
+      fast = 1;
+    else
+      die(usage);
+  if (i + 1 != argc || ncopies <= 0 || window <= 0 || speed <= 0)
+    die(usage);
+  if (nconns <= 0 || nconns > ncopies)
+    nconns = ncopies;
+  load(argv[i]);
+  if (!nrecs)
+    die("No T-messages in %s", argv[i]);
+  cps = calloc(ncopies, sizeof(struct copy));
+  conns = calloc(nconns, sizeof(struct conn));
+  if (!cps || !conns)
+    die("Cannot allocate copies");
+  for (i = 0; i < nconns; ++i) {
+    conns[i].npend = ((ncopies + nconns - 1) / nconns) * window;
+    mk_conn(&conns[i]);
+  }
+  for (i = 0; i < ncopies; ++i)
+    cps[i].conn = &conns[i % nconns];
+  secs = run(cps, conns);
+  printf("%d messages x %d copies in %.3f s: %.0f msgs/s\n", nrecs, ncopies,
+         secs, nrecs * ncopies / secs);
+  printf("latency us: p50 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+         p9_hist_percentile(50, &all) / 1e3,
+         p9_hist_percentile(99, &all) / 1e3,
+         p9_hist_percentile(99.9, &all) / 1e3, all.max / 1e3);
+  if (skipped)
+    printf("%llu messages of the trace skipped\n", skipped);
+  fflush(stdout);
+  p9_print_stats(&stats, stderr);
+  return 0;
+}
@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <signal.h>
+
+#include "9p.h"
+#include "9psrv.h"
+#include "9ptrace.h"
+#include "ramfs.h"
+#include "hostfs.h"
+#include "util.h"
+
+int logmask;
+
+static char *addrs[16];
+static int naddrs;
+static int msize = 0;
+static int nthreads = 0;
+static int nshards = 0;
+static int nfiles = 0;
+static int filesize = 0;
+static int latency = 0;
+static char *dir;
+static char *tracefile;
+static struct p9_srv *srv;
+
+void
+die(char *fmt, ...)
+{
+  va_list args;
+
+  va_start(args, fmt);
+  vfprintf(stderr, fmt, args);
+  va_end(args);
+  fputc('\n', stderr);
+  exit(1);
+}
+
+static void
+sighandle(int sig)
+{
+  p9srv_stop(srv);
+}
+
+int
+main(int argc, char **argv)
+{
+  struct p9_fs *fs;
+  struct p9_trace *trace = 0;
+  int i;
+  char *usage = "usage: server [-a address]... [-m msize] [-t threads]"
+                " [-S shards]\n"
+                "              [-n nfiles] [-s filesize] [-l latency_us]\n"
+                "              [-d dir] [-T tracefile]\n"
+                "  address is tcp!host!port or unix!path"
+                " (default tcp!*!5558)\n";
+
+  for (i = 1; i < argc && argv[i][0] == '-'; ++i)
+    if (!strcmp(argv[i], "-a") && i + 1 < argc && naddrs < NITEMS(addrs))
+      addrs[naddrs++] = argv[++i];
+    else if (!strcmp(argv[i], "-m") && i + 1 < argc)
+      msize = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-t") && i + 1 < argc)
+      nthreads = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-S") && i + 1 < argc)
+      nshards = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-n") && i + 1 < argc)
+      nfiles = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-s") && i + 1 < argc)
+      filesize = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-l") && i + 1 < argc)
+      latency = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-d") && i + 1 < argc)
+      dir = argv[++i];
+    else if (!strcmp(argv[i], "-T") && i + 1 < argc)
+      tracefile = argv[++i];
+    else
+      die(usage);
+  if (i < argc)
+    die(usage);
+  if (!naddrs)
+    addrs[naddrs++] = "tcp!*!5558";
+
+  fs = (dir) ? mk_hostfs(dir) : mk_ramfs(nfiles, filesize, latency);
+  if (!fs)
+    die("Cannot %s", (dir) ? "open directory" : "create file tree");
+  srv = mk_p9srv(fs, msize);
+  if (!srv)
+    die("Cannot create server");
+  if (tracefile) {
+    if (!(trace = mk_p9trace(tracefile, 0, 0)))
+      die("Cannot open trace file %s", tracefile);
+    p9srv_trace(trace, srv);
+  }
+  if (nshards > 1 && p9srv_shards(nshards, srv))
+    die("Cannot create shards");
+  for (i = 0; i < naddrs; ++i)
+    if (p9srv_listen(addrs[i], srv))
+      die("Cannot listen on %s", addrs[i]);
+  if (nthreads > 0 && p9srv_threads(nthreads, srv))
+    die("Cannot start threads");
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGINT, sighandle);
+  signal(SIGTERM, sighandle);
+  p9srv_run(srv);
+  rm_p9srv(srv);
+  rm_p9trace(trace);
+  if (dir)
+    rm_hostfs();
+  else
+    rm_ramfs();
+  return 0;
+}
@@ -0,0 +1,197 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "9p.h"
+#include "9pconn.h"
+#include "9psrv.h"
+#include "ramfs.h"
+#include "util.h"
+
+int logmask;
+
+static int maxshards = 0;
+static int nclients = 64;
+static int seconds = 3;
+static int port = 5570;
+static int nfiles = 100;
+static volatile int stop;
+
+struct client {
+  pthread_t thread;
+  int fd;
+  unsigned long long ops;
+};
+
+void
+die(char *fmt, ...)
+{
+  va_list args;
+
+  va_start(args, fmt);
+  vfprintf(stderr, fmt, args);
+  va_end(args);
+  fputc('\n', stderr);
+  exit(1);
+}
+
+static int
+dial(void)
+{
+  struct sockaddr_in addr = {0};
+  int fd, x = 1;
+
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &x, sizeof(x));
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* Small operations only: walk to a file, stat it and clunk it.  Nothing
+ * waits for the clunk, so it is not counted. */
+static void *
+client(void *aux)
+{
+  struct client *cl = aux;
+  struct p9_conn *c;
+  struct p9_stat st;
+  unsigned int fid, i;
+  char path[32];
+
+  c = mk_p9conn(cl->fd, 1);
+  if (!c || p9_attach(c, "bench", "") == P9_NOFID)
+    die("Cannot attach");
+  for (i = 0; !stop; ++i) {
+    snprintf(path, sizeof(path), "file%u", i % nfiles);
+    if (p9fid_walk2(path, p9_root_fid(c), c, &fid) < 0 || fid == P9_NOFID)
+      die("Cannot walk to %s", path);
+    if (p9fid_stat(fid, &st, c))
+      die("Cannot stat %s", path);
+    p9fid_close(fid, c);
+    cl->ops += 2;
+  }
+  rm_p9conn(c, 1);
+  close(cl->fd);
+  return 0;
+}
+
+static void *
+serve(void *aux)
+{
+  p9srv_run(aux);
+  return 0;
+}
+
+static double
+now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double
+run(struct p9_fs *fs, int nshards)
+{
+  struct p9_srv *srv;
+  struct client *cl;
+  pthread_t thread;
+  unsigned long long ops = 0;
+  char addr[32];
+  double t;
+  int i;
+
+  snprintf(addr, sizeof(addr), "tcp!127.0.0.1!%d", port);
+  srv = mk_p9srv(fs, 0);
+  if (!srv || (nshards > 1 && p9srv_shards(nshards, srv))
+      || p9srv_listen(addr, srv))
+    die("Cannot start server on %s", addr);
+  if (pthread_create(&thread, 0, serve, srv))
+    die("Cannot start server thread");
+  cl = calloc(nclients, sizeof(struct client));
+  if (!cl)
+    die("Cannot allocate clients");
+  stop = 0;
+  for (i = 0; i < nclients; ++i)
+    if ((cl[i].fd = dial()) < 0)
+      die("Cannot connect to %s", addr);
+  t = now();
+  for (i = 0; i < nclients; ++i)
+    if (pthread_create(&cl[i].thread, 0, client, &cl[i]))
+      die("Cannot start client");
+  usleep(seconds * 1000000);
+  stop = 1;
+  for (i = 0; i < nclients; ++i) {
+    pthread_join(cl[i].thread, 0);
+    ops += cl[i].ops;
+  }
+  t = now() - t;
+  p9srv_stop(srv);
+  pthread_join(thread, 0);
+  rm_p9srv(srv);
+  free(cl);
+  return ops / t;
+}
+
+int
+main(int argc, char **argv)
+{
+  struct p9_fs *fs;
+  double base = 0, r;
+  int i, n;
+  char *usage = "usage: srvbench [-S maxshards] [-c clients] [-d seconds]"
+                " [-p port] [-n nfiles]\n";
+
+  for (i = 1; i < argc && argv[i][0] == '-'; ++i)
+    if (!strcmp(argv[i], "-S") && i + 1 < argc)
+      maxshards = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-c") && i + 1 < argc)
+      nclients = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-d") && i + 1 < argc)
+      seconds = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-p") && i + 1 < argc)
+      port = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-n") && i + 1 < argc)
+      nfiles = atoi(argv[++i]);
+    else
+      die(usage);
+  if (i < argc || nclients <= 0 || nfiles <= 0)
+    die(usage);
+  if (maxshards <= 0)
+    maxshards = sysconf(_SC_NPROCESSORS_ONLN);
+  fs = mk_ramfs(nfiles, 0, 0);
+  if (!fs)
+    die("Cannot create file tree");
+  printf("%6s %8s %12s %8s\n", "shards", "clients", "ops/s", "speedup");
+  for (n = 1;; n *= 2) {
+    if (n > maxshards)
+      n = maxshards;
+    r = run(fs, n);
+    if (n == 1)
+      base = r;
+    printf("%6d %8d %12.0f %8.2f\n", n, nclients, r, r / base);
+    fflush(stdout);
+    if (n == maxshards)
+      break;
+  }
+  rm_ramfs();
+  return 0;
+}
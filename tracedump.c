@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "9p.h"
+#include "9pmsg.h"
+#include "9pdbg.h"
+#include "9ptrace.h"
+
+#define MAXFRAME 65536
+
+static unsigned long long
+get_le(const unsigned char *p, int n)
+{
+  unsigned long long x = 0;
+
+  while (n-- > 0)
+    x = (x << 8) | p[n];
+  return x;
+}
+
+static void
+put_le4(unsigned char *p, unsigned int x)
+{
+  p[0] = x & 0xff;
+  p[1] = (x >> 8) & 0xff;
+  p[2] = (x >> 16) & 0xff;
+  p[3] = (x >> 24) & 0xff;
+}
+
+/* The offset of count[4] of messages whose data may be cut off. */
+static int
+count_off(unsigned int type)
+{
+  switch (type) {
+  case P9_RREAD:
+    return 7;
+  case P9_TWRITE:
+    return 19;
+  }
+  return -1;
+}
+
+/* A frame cut short is printed in full only if the cut falls into its
+ * data, which is then shortened to what was kept. */
+static void
+print_frame(char *dir, unsigned int size, unsigned int caplen,
+            unsigned char *buf)
+{
+  const struct p9_schema *sc = 0;
+  struct p9_msg m;
+  int off;
+
+  if (caplen < 7) {
+    fprintf(stderr, ";  %s SHORT FRAME %u/%u\n\n\n", dir, caplen, size);
+    return;
+  }
+  if (buf[4] >= P9_XSTART && buf[4] < P9_XEND)
+    sc = &p9_schema[buf[4] - P9_XSTART];
+  if (caplen < size) {
+    off = count_off(buf[4]);
+    if (off < 0 || caplen < (unsigned int)off + 4) {
+      fprintf(stderr, "\n;  %s MSG (cut at %u)\n", dir, caplen);
+      fprintf(stderr, ";       size: %u\n", size);
+      fprintf(stderr, ";       type: %s\n", (sc && sc->name) ? sc->name : "?");
+      fprintf(stderr, ";       tag: %u\n\n\n", buf[5] | (buf[6] << 8));
+      return;
+    }
+    put_le4(buf, caplen);
+    put_le4(buf + off, caplen - off - 4);
+    fprintf(stderr, ";  data cut at %u of %u bytes\n",
+            caplen - off - 4, size - off - 4);
+  }
+  memset(&m, 0, sizeof(m));
+  if (p9_unpack_msg(caplen, (char *)buf, &m)) {
+    fprintf(stderr, ";  %s BAD MSG %u\n\n\n", dir, buf[4]);
+    return;
+  }
+  p9_print_msg(&m, dir);
+}
+
+int
+main(int argc, char **argv)
+{
+  static unsigned char frame[MAXFRAME];
+  unsigned char hdr[P9_TRACE_HDRSZ];
+  unsigned long long ns;
+  unsigned int size, caplen;
+  char magic[8], when[32];
+  time_t sec;
+  FILE *f;
+
+  if (argc > 2) {
+    fprintf(stderr, "usage: tracedump [tracefile]\n");
+    return 1;
+  }
+  f = (argc == 2) ? fopen(argv[1], "rb") : stdin;
+  if (!f) {
+    fprintf(stderr, "Cannot open %s\n", argv[1]);
+    return 1;
+  }
+  if (fread(magic, 1, 8, f) != 8 || memcmp(magic, P9_TRACE_MAGIC, 8)) {
+    fprintf(stderr, "Not a trace file\n");
+    return 1;
+  }
+  while (fread(hdr, 1, sizeof(hdr), f) == sizeof(hdr)) {
+    ns = get_le(hdr, 8);
+    size = get_le(hdr + 12, 4);
+    caplen = get_le(hdr + 16, 4);
+    if (caplen > size || caplen > MAXFRAME
+        || fread(frame, 1, caplen, f) != caplen) {
+      fprintf(stderr, "Truncated trace file\n");
+      return 1;
+    }
+    sec = ns / 1000000000;
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&sec));
+    fprintf(stderr, ";  %s.%09llu\n", when, ns % 1000000000);
+    if (hdr[8] == P9_TRACE_DROP)
+      fprintf(stderr, ";  DROPPED %u\n\n\n", size);
+    else
+      print_frame((hdr[8] == P9_TRACE_IN) ? "IN" : "OUT", size, caplen,
+                  frame);
+  }
+  return 0;
+}